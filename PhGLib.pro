@@ -10,6 +10,14 @@ TARGET = PhGLib
 TEMPLATE = lib
 CONFIG += staticlib c++11
 
+# tensor kernels use omp parallel for and omp simd
+QMAKE_CXXFLAGS += -fopenmp
+LIBS += -fopenmp
+
+# BLAS backend, see include/Math/BlasBackend.hpp, MKL when unset
+#DEFINES += PHG_BLAS=PHG_BLAS_OPENBLAS
+#DEFINES += PHG_BLAS=PHG_BLAS_BUILTIN
+
 INCLUDEPATH += /usr/local/include /home/phg/SDKs/glew-1.12.0/include
 LIBS += -L/usr/local/lib -L/home/phg/SDKs/glew-1.12.0/lib -lGLEW
 
@@ -49,11 +57,24 @@ HEADERS += \
     include/IO/arrayallocator.h \
     include/Math/VectorBase.hpp \
     include/Math/Tensor.hpp \
+    include/Math/BlasBackend.hpp \
+    include/Math/GemmKernels.hpp \
+    include/Math/CpuFeatures.hpp \
+    include/Math/HalfFloat.hpp \
+    include/Math/QuantizedTensor.hpp \
+    include/Math/TensorN.hpp \
+    include/Math/TuckerTensor.hpp \
+    include/Math/TensorFile.hpp \
     include/Math/Optimization.hpp \
     include/Math/MatrixBase.hpp \
     include/Math/mathutils.hpp \
     include/Math/DenseVector.hpp \
     include/Math/DenseMatrix.hpp \
+    include/Math/DenseExpr.hpp \
+    include/Math/DenseView.hpp \
+    include/Math/SparseMatrix.hpp \
+    include/Math/SparseSolvers.hpp \
+    include/Math/NormalEquations.hpp \
     include/Math/denseblas.h \
     include/OpenGL/glutilities.h \
     include/OpenGL/glTrackball.h \
@@ -0,0 +1,30 @@
+#-------------------------------------------------
+#
+# Benchmarks of include/Math/Tensor.hpp, see main.cpp for the options
+#
+#-------------------------------------------------
+
+QT       -= core gui
+
+TARGET = TensorBench
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+QMAKE_CXXFLAGS += -fopenmp
+LIBS += -fopenmp
+
+# same BLAS backend choice as PhGLib.pro, MKL when unset
+#DEFINES += PHG_BLAS=PHG_BLAS_OPENBLAS
+#DEFINES += PHG_BLAS=PHG_BLAS_BUILTIN
+contains(DEFINES, PHG_BLAS=PHG_BLAS_OPENBLAS) {
+    LIBS += -lopenblas -llapacke
+} else:!contains(DEFINES, PHG_BLAS=PHG_BLAS_BUILTIN) {
+    LIBS += -lmkl_rt
+}
+
+INCLUDEPATH += /usr/local/include /home/phg/SDKs/glew-1.12.0/include
+
+SOURCES += \
+    main.cpp \
+    ../../include/IO/FileMapper.cpp
@@ -0,0 +1,264 @@
+// Benchmarks of the Tensor module: unfold/fold, vector and matrix mode
+// products, contraction, file read/write and HOSVD over model-sized shapes.
+//
+//	TensorBench [--quick] [--shape AxBxC]... [--reps N] [--threads N] [--rank R]
+//	            [--json out.json] [--baseline base.json] [--tolerance 0.1]
+//
+// Every case reports the best of N timed runs after one warm-up run, as
+// seconds, GB/s of tensor data touched and GFLOP/s where the work is known.
+// With --baseline the results are compared against an earlier JSON report by
+// name; the exit code is 1 when any case got slower than the tolerance allows.
+
+#include "../../include/Math/Tensor.hpp"
+#include <array>
+#include <chrono>
+#include <cstdio>
+
+namespace {
+	typedef float real;
+
+	struct Result {
+		string name;
+		double seconds;
+		double gbps;		// negative when not meaningful
+		double gflops;		// negative when not meaningful
+	};
+
+	struct Options {
+		Options(void):reps(5),threads(0),rank(16),tolerance(0.1),tmpfile("tensorbench.tmp"){}
+
+		vector<array<int, 3>> shapes;
+		int reps;
+		int threads;
+		int rank;				// rows of the mode product matrices, HOSVD ranks
+		double tolerance;		// allowed slowdown against the baseline
+		string json, baseline;
+		string tmpfile;
+	};
+
+	// keeps the progress messages of the tensor IO out of the report
+	class SilenceCout {
+	public:
+		SilenceCout(void):old(cout.rdbuf(nullptr)){}
+		~SilenceCout(void){ cout.rdbuf(old); }
+	private:
+		streambuf* old;
+	};
+
+	template <typename F>
+	double bestOf(int reps, F f) {
+		f();
+		double best = 1e30;
+		for(int i=0;i<reps;i++) {
+			auto t0 = chrono::steady_clock::now();
+			f();
+			auto t1 = chrono::steady_clock::now();
+			best = min(best, chrono::duration<double>(t1 - t0).count());
+		}
+		return best;
+	}
+
+	string shapeName(const array<int, 3>& s) {
+		return to_string(s[0]) + "x" + to_string(s[1]) + "x" + to_string(s[2]);
+	}
+
+	void add(vector<Result>& results, const string& name, double seconds, double bytes, double flops) {
+		Result r;
+		r.name = name;
+		r.seconds = seconds;
+		r.gbps = (bytes > 0)?(bytes / seconds * 1e-9):-1;
+		r.gflops = (flops > 0)?(flops / seconds * 1e-9):-1;
+		results.push_back(r);
+		printf("%-40s %10.4f ms", name.c_str(), seconds * 1e3);
+		if( r.gbps > 0 ) printf(" %8.2f GB/s", r.gbps);
+		if( r.gflops > 0 ) printf(" %8.2f GFLOP/s", r.gflops);
+		printf("\n");
+		fflush(stdout);
+	}
+
+	void run(const array<int, 3>& shape, const Options& opts, vector<Result>& results) {
+		const string tag = "/" + shapeName(shape);
+		Tensor3<real> t(shape[0], shape[1], shape[2]);
+		mt19937 gen(0);
+		uniform_real_distribution<real> dist(-1, 1);
+		for(size_t i=0;i<t.size();i++) t.rawptr()[i] = dist(gen);
+
+		const double n = double(t.size());
+		const double esize = sizeof(real);
+		Tensor2<real> buffer;
+		buffer.resize(1, int(t.size()));
+
+		for(int mid=0;mid<3;mid++) {
+			const string m = "/mode" + to_string(mid);
+			double s = bestOf(opts.reps, [&]() { t.unfold(mid, buffer.rawptr()); });
+			add(results, "unfold" + m + tag, s, 2 * n * esize, 0);
+
+			Tensor3<real> folded(shape[0], shape[1], shape[2]);
+			s = bestOf(opts.reps, [&]() {
+				Tensor3<real>::fold(buffer.rawptr(), mid, shape[0], shape[1], shape[2], folded.rawptr());
+			});
+			add(results, "fold" + m + tag, s, 2 * n * esize, 0);
+		}
+
+		for(int mid=0;mid<3;mid++) {
+			const string m = "/mode" + to_string(mid);
+			Tensor1<real> v(t.dim(mid));
+			for(int i=0;i<v.length();i++) v(i) = dist(gen);
+			double s = bestOf(opts.reps, [&]() { t.modeProduct(v, mid); });
+			add(results, "modeProduct.vector" + m + tag, s, n * esize, 2 * n);
+
+			Tensor2<real> M(opts.rank, t.dim(mid));
+			for(int i=0;i<opts.rank;i++) {
+				for(int j=0;j<t.dim(mid);j++) M(i, j) = dist(gen);
+			}
+			s = bestOf(opts.reps, [&]() { t.modeProduct(M, mid); });
+			add(results, "modeProduct.matrix" + m + tag, s,
+				n * esize * (1 + double(opts.rank) / t.dim(mid)), 2 * n * opts.rank);
+
+			int m0 = (mid == 0)?1:0, m1 = (mid == 2)?1:2;
+			Tensor1<real> w0(t.dim(m0)), w1(t.dim(m1)), out(t.dim(mid));
+			for(int i=0;i<w0.length();i++) w0(i) = dist(gen);
+			for(int i=0;i<w1.length();i++) w1(i) = dist(gen);
+			s = bestOf(opts.reps, [&]() { t.contract(w0, w1, mid, out); });
+			add(results, "contract" + m + tag, s, n * esize, 2 * n);
+		}
+
+		{
+			SilenceCout silence;
+			double sw = bestOf(opts.reps, [&]() { t.write(opts.tmpfile); });
+			Tensor3<real> r;
+			double sr = bestOf(opts.reps, [&]() { r.read(opts.tmpfile); });
+			remove(opts.tmpfile.c_str());
+			add(results, "write" + tag, sw, n * esize, 0);
+			add(results, "read" + tag, sr, n * esize, 0);
+		}
+
+		{
+			vector<int> modes = {0, 1, 2};
+			vector<int> ranks = {min(shape[0], opts.rank), min(shape[1], opts.rank), min(shape[2], opts.rank)};
+			double s;
+			{
+				SilenceCout silence;
+				s = bestOf(max(1, opts.reps / 2), [&]() { t.hosvd(modes, ranks); });
+			}
+			add(results, "hosvd" + tag, s, 0, 0);
+		}
+	}
+
+	bool writeJson(const string& filename, const Options& opts, const vector<Result>& results) {
+		FILE* f = fopen(filename.c_str(), "w");
+		if( f == nullptr ) {
+			cerr << "Failed to write benchmark results to " << filename << endl;
+			return false;
+		}
+		fprintf(f, "{\n  \"benchmark\": \"TensorBench\",\n  \"type\": \"float\",\n");
+		fprintf(f, "  \"threads\": %d,\n  \"reps\": %d,\n  \"results\": [\n", TensorThreads::get(), opts.reps);
+		for(size_t i=0;i<results.size();i++) {
+			const Result& r = results[i];
+			// one result per line, readBaseline relies on it
+			fprintf(f, "    {\"name\": \"%s\", \"seconds\": %.9g", r.name.c_str(), r.seconds);
+			if( r.gbps > 0 ) fprintf(f, ", \"gbps\": %.6g", r.gbps);
+			if( r.gflops > 0 ) fprintf(f, ", \"gflops\": %.6g", r.gflops);
+			fprintf(f, "}%s\n", (i + 1 < results.size())?",":"");
+		}
+		fprintf(f, "  ]\n}\n");
+		fclose(f);
+		return true;
+	}
+
+	// name -> seconds from a report written by writeJson
+	bool readBaseline(const string& filename, map<string, double>& baseline) {
+		ifstream fin(filename);
+		if( !fin ) {
+			cerr << "Failed to read baseline " << filename << endl;
+			return false;
+		}
+		const string nameKey = "\"name\": \"", secondsKey = "\"seconds\": ";
+		string line;
+		while( getline(fin, line) ) {
+			size_t pn = line.find(nameKey), ps = line.find(secondsKey);
+			if( pn == string::npos || ps == string::npos ) continue;
+			pn += nameKey.size();
+			size_t end = line.find('"', pn);
+			if( end == string::npos ) continue;
+			baseline[line.substr(pn, end - pn)] = atof(line.c_str() + ps + secondsKey.size());
+		}
+		return true;
+	}
+
+	// returns the number of cases slower than baseline * (1 + tolerance)
+	int compare(const vector<Result>& results, const map<string, double>& baseline, double tolerance) {
+		int regressions = 0;
+		printf("\n%-40s %12s %12s %8s\n", "case", "baseline ms", "current ms", "speedup");
+		for(size_t i=0;i<results.size();i++) {
+			auto it = baseline.find(results[i].name);
+			if( it == baseline.end() ) continue;
+			double ratio = it->second / results[i].seconds;
+			bool slower = results[i].seconds > it->second * (1 + tolerance);
+			if( slower ) regressions++;
+			printf("%-40s %12.4f %12.4f %7.2fx%s\n", results[i].name.c_str(), it->second * 1e3,
+				results[i].seconds * 1e3, ratio, slower?"  REGRESSION":"");
+		}
+		printf("%d regression(s) beyond %.0f%%\n", regressions, tolerance * 100);
+		return regressions;
+	}
+
+	bool parseShape(const string& s, array<int, 3>& shape) {
+		return sscanf(s.c_str(), "%dx%dx%d", &shape[0], &shape[1], &shape[2]) == 3
+			&& shape[0] > 0 && shape[1] > 0 && shape[2] > 0;
+	}
+}
+
+int main(int argc, char** argv) {
+	Options opts;
+	bool quick = false;
+	for(int i=1;i<argc;i++) {
+		string arg = argv[i];
+		bool hasValue = (i + 1 < argc);
+		if( arg == "--quick" ) quick = true;
+		else if( arg == "--shape" && hasValue ) {
+			array<int, 3> shape;
+			if( !parseShape(argv[++i], shape) ) {
+				cerr << "Invalid shape " << argv[i] << endl;
+				return 2;
+			}
+			opts.shapes.push_back(shape);
+		}
+		else if( arg == "--reps" && hasValue ) opts.reps = max(1, atoi(argv[++i]));
+		else if( arg == "--threads" && hasValue ) opts.threads = atoi(argv[++i]);
+		else if( arg == "--rank" && hasValue ) opts.rank = max(1, atoi(argv[++i]));
+		else if( arg == "--json" && hasValue ) opts.json = argv[++i];
+		else if( arg == "--baseline" && hasValue ) opts.baseline = argv[++i];
+		else if( arg == "--tolerance" && hasValue ) opts.tolerance = atof(argv[++i]);
+		else if( arg == "--tmp" && hasValue ) opts.tmpfile = argv[++i];
+		else {
+			cerr << "usage: " << argv[0] << " [--quick] [--shape AxBxC]... [--reps N] [--threads N] [--rank R]"
+				<< " [--json out.json] [--baseline base.json] [--tolerance 0.1] [--tmp file]" << endl;
+			return 2;
+		}
+	}
+
+	if( opts.shapes.empty() ) {
+		// blendshape sized models, vertices x identities x expressions
+		array<int, 3> small = {{11000, 50, 25}}, large = {{34000, 150, 47}};
+		if( quick ) {
+			small[0] /= 10;
+			large[0] /= 10;
+		}
+		opts.shapes.push_back(small);
+		opts.shapes.push_back(large);
+	}
+	if( opts.threads > 0 ) TensorThreads::set(opts.threads);
+
+	vector<Result> results;
+	for(size_t i=0;i<opts.shapes.size();i++) run(opts.shapes[i], opts, results);
+
+	if( !opts.json.empty() && !writeJson(opts.json, opts, results) ) return 2;
+
+	if( !opts.baseline.empty() ) {
+		map<string, double> baseline;
+		if( !readBaseline(opts.baseline, baseline) ) return 2;
+		if( compare(results, baseline, opts.tolerance) > 0 ) return 1;
+	}
+	return 0;
+}
@@ -38,10 +38,10 @@ bool FileMapper::map()
 	std::wstring str(filename.begin(), filename.end());
 	TCHAR * lpcTheFile = (TCHAR*)str.c_str();
 
-	// open the file
+	// open the file read only, other processes may map it at the same time
 	hFile = CreateFile(lpcTheFile,
-		GENERIC_READ | GENERIC_WRITE,
-		0,
+		GENERIC_READ,
+		FILE_SHARE_READ,
 		NULL,
 		OPEN_EXISTING,
 		FILE_ATTRIBUTE_NORMAL,
@@ -67,7 +67,7 @@ bool FileMapper::map()
 	hMapFile = CreateFileMapping( 
 		hFile,          // current file handle
 		NULL,           // default security
-		PAGE_READWRITE, // read/write permission
+		PAGE_READONLY,  // read only, like the mmap path
 		0,              // size of mapping object, high
 		dwFileMapSize,  // size of mapping object, low
 		NULL			// name of mapping object
@@ -82,7 +82,7 @@ bool FileMapper::map()
 
 	lpMapAddress = MapViewOfFile(
 		hMapFile,				// handle to mapping object
-		FILE_MAP_ALL_ACCESS,	// read/write
+		FILE_MAP_READ,			// read only
 		0,						// high-order 32 bits of file offset
 		0,						// low-order 32 bits of file offset
 		dwMapViewSize			// number of bytes to map
@@ -97,6 +97,10 @@ bool FileMapper::map()
 
 	return true;
 }
+
+size_t FileMapper::size() const {
+	return dwFileSize;
+}
 #else
 
 // char * inPathName, void ** outDataPtr, size_t * outDataLength
@@ -158,6 +162,10 @@ bool FileMapper::unmap() {
     return (status == 0);
 }
 
+size_t FileMapper::size() const {
+    return fileSize;
+}
+
 #endif
 
 }
@@ -37,6 +37,9 @@ public:
 		return pData;
 	}
 
+	// size of the mapped file in bytes
+	size_t size() const;
+
 private:
 	string filename;
 
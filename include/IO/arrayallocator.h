@@ -1,7 +1,37 @@
+#pragma once
+
 #include "../phgutils.h"
 #include "../Utils/singleton.hpp"
 
-class MemoryCounter;
+class MemoryCounter : public Singleton<MemoryCounter>
+{
+public:
+    MemoryCounter():mPeakUsage(0), mTotalBytes(0){}
+    ~MemoryCounter(){}
+
+    void add(size_t size)
+    {
+        mTotalBytes += size;
+        if( mTotalBytes > mPeakUsage )
+            mPeakUsage = mTotalBytes;
+    }
+
+    void sub(size_t size){
+        mTotalBytes -= size;
+    }
+
+    double size_byte(){ return mTotalBytes; }
+    double size_kb(){ return mTotalBytes / 1024.0; }
+    double size_mb(){ return mTotalBytes / 1048576.0; }
+
+    double size_mb_peak(){ return mPeakUsage / 1048576.0; }
+    double size_byte_peak(){ return mPeakUsage; }
+    double size_kb_peak(){ return mPeakUsage / 1024.0; }
+
+private:
+    size_t mPeakUsage;
+    size_t mTotalBytes;
+};
 
 template <typename T>
 class ArrayAllocator : public Singleton<ArrayAllocator<T> >
@@ -38,33 +68,3 @@ public:
         }
     }
 };
-
-class MemoryCounter : public Singleton<MemoryCounter>
-{
-public:
-    MemoryCounter():mPeakUsage(0), mTotalBytes(0){}
-    ~MemoryCounter(){}
-
-    void add(size_t size)
-    {
-        mTotalBytes += size;
-        if( mTotalBytes > mPeakUsage )
-            mPeakUsage = mTotalBytes;
-    }
-
-    void sub(size_t size){
-        mTotalBytes -= size;
-    }
-
-    double size_byte(){ return mTotalBytes; }
-    double size_kb(){ return mTotalBytes / 1024.0; }
-    double size_mb(){ return mTotalBytes / 1048576.0; }
-
-    double size_mb_peak(){ return mPeakUsage / 1048576.0; }
-    double size_byte_peak(){ return mPeakUsage; }
-    double size_kb_peak(){ return mPeakUsage / 1024.0; }
-
-private:
-    size_t mPeakUsage;
-    size_t mTotalBytes;
-};
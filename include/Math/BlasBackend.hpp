@@ -0,0 +1,377 @@
+#pragma once
+
+// BLAS/LAPACK backend of the math code, chosen at compile time by defining
+// PHG_BLAS to one of the values below, e.g. DEFINES += PHG_BLAS=PHG_BLAS_OPENBLAS
+// in qmake. MKL stays the default; the built-in backend needs no library.
+#define PHG_BLAS_MKL 1
+#define PHG_BLAS_OPENBLAS 2
+#define PHG_BLAS_BUILTIN 3
+
+#ifndef PHG_BLAS
+#define PHG_BLAS PHG_BLAS_MKL
+#endif
+
+#if PHG_BLAS == PHG_BLAS_MKL
+#include <mkl.h>
+#elif PHG_BLAS == PHG_BLAS_OPENBLAS
+#include <cblas.h>
+#include <lapacke.h>
+#elif PHG_BLAS == PHG_BLAS_BUILTIN
+#include "GemmKernels.hpp"
+#else
+#error "Unknown PHG_BLAS backend"
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+// Every routine takes the storage order explicitly, so row major tensor code and
+// column major matrix code share one set of entry points
+namespace BlasBackend {
+	enum Layout { RowMajor, ColMajor };
+
+#if PHG_BLAS == PHG_BLAS_BUILTIN
+	// portable kernels, row major only, column major calls are mapped onto them
+	// through the transpose. Inner loops are written for omp simd
+	namespace Builtin {
+		const int NB = 1024;	// columns of y per thread in a transposed gemv
+
+		template <typename T>
+		inline T dot(int n, const T* x, const T* y) {
+			T s = 0;
+			#pragma omp simd reduction(+:s)
+			for(int i=0;i<n;i++) s += x[i] * y[i];
+			return s;
+		}
+
+		template <typename T>
+		inline void axpy(int n, T a, const T* x, T* y) {
+			#pragma omp simd
+			for(int i=0;i<n;i++) y[i] += a * x[i];
+		}
+
+		template <typename T>
+		inline void scale(int n, T beta, T* y) {
+			if( beta == T(0) ) memset(y, 0, sizeof(T) * n);
+			else if( beta != T(1) ) {
+				#pragma omp simd
+				for(int i=0;i<n;i++) y[i] *= beta;
+			}
+		}
+
+		// C = alpha * op(A) * op(B) + beta * C, packed and register blocked
+		template <typename T>
+		void gemm(bool transA, bool transB, int m, int n, int k, T alpha,
+			const T* A, int lda, const T* B, int ldb, T beta, T* C, int ldc)
+		{
+			GemmKernels::gemm(transA, transB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+		}
+
+		// y = alpha * op(A) * x + beta * y, A is m x n
+		template <typename T>
+		void gemv(bool trans, int m, int n, T alpha, const T* A, int lda, const T* x, T beta, T* y) {
+			if( !trans ) {
+				#pragma omp parallel for if(size_t(m) * n > 65536)
+				for(int i=0;i<m;i++) {
+					T v = alpha * dot(n, A + size_t(i) * lda, x);
+					y[i] = (beta == T(0)) ? v : (v + beta * y[i]);
+				}
+			}
+			else {
+				// blocks of y are independent, each one sweeps all rows of A
+				int nblocks = (n + NB - 1) / NB;
+				#pragma omp parallel for if(size_t(m) * n > 65536)
+				for(int b=0;b<nblocks;b++) {
+					int j0 = b * NB, nb = std::min(NB, n - j0);
+					scale(nb, beta, y + j0);
+					for(int i=0;i<m;i++) axpy(nb, alpha * x[i], A + size_t(i) * lda + j0, y + j0);
+				}
+			}
+		}
+
+		// one triangle of C = alpha * op(A) * op(A)' + beta * C, op(A) is n x k
+		template <typename T>
+		void syrk(bool upper, bool trans, int n, int k, T alpha, const T* A, int lda, T beta, T* C, int ldc) {
+			#pragma omp parallel for schedule(dynamic) if(size_t(n) * n * k > 65536)
+			for(int i=0;i<n;i++) {
+				int j0 = upper ? i : 0, j1 = upper ? n : (i + 1);
+				T* c = C + size_t(i) * ldc;
+				scale(j1 - j0, beta, c + j0);
+				if( !trans ) {
+					const T* ai = A + size_t(i) * lda;
+					for(int j=j0;j<j1;j++) c[j] += alpha * dot(k, ai, A + size_t(j) * lda);
+				}
+				else {
+					for(int l=0;l<k;l++) {
+						const T* al = A + size_t(l) * lda;
+						axpy(j1 - j0, alpha * al[i], al + j0, c + j0);
+					}
+				}
+			}
+		}
+
+		// Cholesky factor L of A = L * L', L(i, j) is at A[i * rs + j * cs] and
+		// only that triangle is read or written. Returns j + 1 if the leading
+		// minor of order j + 1 is not positive definite, like LAPACK
+		template <typename T>
+		int potrf(int n, T* A, size_t rs, size_t cs) {
+			for(int j=0;j<n;j++) {
+				T* lj = A + j * rs;
+				T d = lj[j * cs];
+				for(int l=0;l<j;l++) d -= lj[l * cs] * lj[l * cs];
+				if( !(d > T(0)) ) return j + 1;
+				d = std::sqrt(d);
+				lj[j * cs] = d;
+
+				#pragma omp parallel for if(size_t(n - j) * j > 65536)
+				for(int i=j+1;i<n;i++) {
+					T* li = A + i * rs;
+					T s = li[j * cs];
+					for(int l=0;l<j;l++) s -= li[l * cs] * lj[l * cs];
+					li[j * cs] = s / d;
+				}
+			}
+			return 0;
+		}
+
+		// solve L * L' * X = B with the factor from potrf, B(i, r) is at B[i * brs + r * bcs]
+		template <typename T>
+		void potrs(int n, int nrhs, const T* A, size_t rs, size_t cs, T* B, size_t brs, size_t bcs) {
+			for(int r=0;r<nrhs;r++) {
+				T* b = B + r * bcs;
+				for(int i=0;i<n;i++) {
+					T s = b[i * brs];
+					for(int l=0;l<i;l++) s -= A[i * rs + l * cs] * b[l * brs];
+					b[i * brs] = s / A[i * rs + i * cs];
+				}
+				for(int i=n-1;i>=0;i--) {
+					T s = b[i * brs];
+					for(int l=i+1;l<n;l++) s -= A[l * rs + i * cs] * b[l * brs];
+					b[i * brs] = s / A[i * rs + i * cs];
+				}
+			}
+		}
+
+		// orthonormal basis of the columns of the row major m x n matrix A, m >= n,
+		// by modified Gram-Schmidt applied twice. A dependent column is replaced
+		// by the unit vector with the largest component outside the current span
+		template <typename T>
+		int orthonormalize(int m, int n, T* A) {
+			std::vector<T> Q(size_t(n) * m);
+			for(int i=0;i<m;i++) {
+				for(int j=0;j<n;j++) Q[size_t(j) * m + i] = A[size_t(i) * n + j];
+			}
+
+			const T eps = std::numeric_limits<T>::epsilon();
+			std::vector<T> e(m);
+			for(int j=0;j<n;j++) {
+				T* q = &Q[size_t(j) * m];
+				T norm0 = std::sqrt(dot(m, q, q));
+				for(int pass=0;pass<2;pass++) {
+					for(int p=0;p<j;p++) axpy(m, -dot(m, &Q[size_t(p) * m], q), &Q[size_t(p) * m], q);
+				}
+				T norm = std::sqrt(dot(m, q, q));
+
+				if( !(norm > 100 * eps * norm0) || norm == T(0) ) {
+					T best = 0;
+					for(int u=0;u<m && best < T(0.5);u++) {
+						std::fill(e.begin(), e.end(), T(0));
+						e[u] = 1;
+						for(int pass=0;pass<2;pass++) {
+							for(int p=0;p<j;p++) axpy(m, -dot(m, &Q[size_t(p) * m], &e[0]), &Q[size_t(p) * m], &e[0]);
+						}
+						T en = std::sqrt(dot(m, &e[0], &e[0]));
+						if( en > best ) {
+							best = en;
+							std::copy(e.begin(), e.end(), q);
+						}
+					}
+					norm = best;
+				}
+				for(int i=0;i<m;i++) q[i] /= norm;
+			}
+
+			for(int i=0;i<m;i++) {
+				for(int j=0;j<n;j++) A[size_t(i) * n + j] = Q[size_t(j) * m + i];
+			}
+			return 0;
+		}
+
+		// eigen decomposition of the symmetric row major n x n matrix given by its
+		// upper triangle, cyclic Jacobi. Eigenvalues ascending in w, eigenvectors
+		// as the columns of A. Returns 1 if the sweeps did not converge
+		template <typename T>
+		int syev(int n, T* A, T* w) {
+			std::vector<T> a(size_t(n) * n), v(size_t(n) * n, T(0));
+			T total = 0;
+			for(int i=0;i<n;i++) {
+				v[size_t(i) * n + i] = 1;
+				for(int j=i;j<n;j++) {
+					a[size_t(i) * n + j] = a[size_t(j) * n + i] = A[size_t(i) * n + j];
+					total += (i == j ? 1 : 2) * A[size_t(i) * n + j] * A[size_t(i) * n + j];
+				}
+			}
+
+			const T eps = std::numeric_limits<T>::epsilon();
+			const int MAX_SWEEPS = 100;
+			bool converged = false;
+			for(int sweep=0;sweep<MAX_SWEEPS && !converged;sweep++) {
+				T off = 0;
+				for(int i=0;i<n;i++) {
+					for(int j=i+1;j<n;j++) off += a[size_t(i) * n + j] * a[size_t(i) * n + j];
+				}
+				if( off <= eps * eps * total ) {
+					converged = true;
+					break;
+				}
+
+				for(int p=0;p<n;p++) {
+					for(int q=p+1;q<n;q++) {
+						T apq = a[size_t(p) * n + q];
+						if( apq == T(0) ) continue;
+						T theta = (a[size_t(q) * n + q] - a[size_t(p) * n + p]) / (2 * apq);
+						T t = T(1) / (std::fabs(theta) + std::sqrt(theta * theta + 1));
+						if( theta < 0 ) t = -t;
+						T c = T(1) / std::sqrt(t * t + 1), s = t * c;
+
+						for(int k=0;k<n;k++) {
+							T akp = a[size_t(k) * n + p], akq = a[size_t(k) * n + q];
+							a[size_t(k) * n + p] = c * akp - s * akq;
+							a[size_t(k) * n + q] = s * akp + c * akq;
+						}
+						for(int k=0;k<n;k++) {
+							T apk = a[size_t(p) * n + k], aqk = a[size_t(q) * n + k];
+							a[size_t(p) * n + k] = c * apk - s * aqk;
+							a[size_t(q) * n + k] = s * apk + c * aqk;
+						}
+						for(int k=0;k<n;k++) {
+							T vkp = v[size_t(k) * n + p], vkq = v[size_t(k) * n + q];
+							v[size_t(k) * n + p] = c * vkp - s * vkq;
+							v[size_t(k) * n + q] = s * vkp + c * vkq;
+						}
+					}
+				}
+			}
+
+			std::vector<int> order(n);
+			for(int i=0;i<n;i++) order[i] = i;
+			std::sort(order.begin(), order.end(), [&](int x, int y) {
+				return a[size_t(x) * n + x] < a[size_t(y) * n + y];
+			});
+			for(int j=0;j<n;j++) {
+				w[j] = a[size_t(order[j]) * n + order[j]];
+				for(int i=0;i<n;i++) A[size_t(i) * n + j] = v[size_t(i) * n + order[j]];
+			}
+			return converged ? 0 : 1;
+		}
+
+		// dispatch on the layout, a column major matrix is the row major transpose
+		template <typename T>
+		void gemm(Layout layout, bool transA, bool transB, int m, int n, int k, T alpha,
+			const T* A, int lda, const T* B, int ldb, T beta, T* C, int ldc)
+		{
+			if( layout == RowMajor ) gemm(transA, transB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+			else gemm(transB, transA, n, m, k, alpha, B, ldb, A, lda, beta, C, ldc);
+		}
+
+		template <typename T>
+		void gemv(Layout layout, bool trans, int m, int n, T alpha, const T* A, int lda, const T* x, T beta, T* y) {
+			if( layout == RowMajor ) gemv(trans, m, n, alpha, A, lda, x, beta, y);
+			else gemv(!trans, n, m, alpha, A, lda, x, beta, y);
+		}
+
+		template <typename T>
+		void syrk(Layout layout, bool upper, bool trans, int n, int k, T alpha, const T* A, int lda, T beta, T* C, int ldc) {
+			if( layout == RowMajor ) syrk(upper, trans, n, k, alpha, A, lda, beta, C, ldc);
+			else syrk(!upper, !trans, n, k, alpha, A, lda, beta, C, ldc);
+		}
+
+		// L(i, j) lies along rows of the buffer for row major lower and column major upper
+		inline bool factorRows(Layout layout, bool upper) {
+			return (layout == RowMajor) != upper;
+		}
+
+		template <typename T>
+		int potrf(Layout layout, bool upper, int n, T* A, int lda) {
+			return factorRows(layout, upper) ? potrf(n, A, size_t(lda), 1) : potrf(n, A, 1, size_t(lda));
+		}
+
+		template <typename T>
+		int potrs(Layout layout, bool upper, int n, int nrhs, const T* A, int lda, T* B, int ldb) {
+			size_t rs = factorRows(layout, upper) ? size_t(lda) : 1, cs = factorRows(layout, upper) ? 1 : size_t(lda);
+			if( layout == RowMajor ) potrs(n, nrhs, A, rs, cs, B, size_t(ldb), 1);
+			else potrs(n, nrhs, A, rs, cs, B, 1, size_t(ldb));
+			return 0;
+		}
+	}
+
+#define PHG_BLAS_BUILTIN_OVERLOADS(T) \
+	inline void gemm(Layout layout, bool transA, bool transB, int m, int n, int k, T alpha, \
+		const T* A, int lda, const T* B, int ldb, T beta, T* C, int ldc) \
+	{ if( m > 0 && n > 0 ) Builtin::gemm(layout, transA, transB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc); } \
+	inline void gemv(Layout layout, bool trans, int m, int n, T alpha, const T* A, int lda, \
+		const T* x, T beta, T* y) \
+	{ Builtin::gemv(layout, trans, m, n, alpha, A, lda, x, beta, y); } \
+	inline void syrk(Layout layout, bool upper, bool trans, int n, int k, T alpha, const T* A, int lda, \
+		T beta, T* C, int ldc) \
+	{ Builtin::syrk(layout, upper, trans, n, k, alpha, A, lda, beta, C, ldc); } \
+	inline int potrf(Layout layout, bool upper, int n, T* A, int lda) \
+	{ return Builtin::potrf(layout, upper, n, A, lda); } \
+	inline int potrs(Layout layout, bool upper, int n, int nrhs, const T* A, int lda, T* B, int ldb) \
+	{ return Builtin::potrs(layout, upper, n, nrhs, A, lda, B, ldb); } \
+	inline int orthonormalize(int m, int n, T* A) { return Builtin::orthonormalize(m, n, A); } \
+	inline int syev(int n, T* A, T* w) { return Builtin::syev(n, A, w); } \
+	inline void copy(int n, const T* x, T* y) { memcpy(y, x, sizeof(T) * n); } \
+	inline void axpy(int n, T alpha, const T* x, T* y) { Builtin::axpy(n, alpha, x, y); } \
+	inline T nrm2(int n, const T* x) { return std::sqrt(Builtin::dot(n, x, x)); }
+
+	PHG_BLAS_BUILTIN_OVERLOADS(float)
+	PHG_BLAS_BUILTIN_OVERLOADS(double)
+#undef PHG_BLAS_BUILTIN_OVERLOADS
+
+#else
+	inline CBLAS_ORDER cblasOrder(Layout layout) { return (layout == RowMajor)?CblasRowMajor:CblasColMajor; }
+	inline CBLAS_TRANSPOSE cblasTrans(bool trans) { return trans?CblasTrans:CblasNoTrans; }
+	inline CBLAS_UPLO cblasUplo(bool upper) { return upper?CblasUpper:CblasLower; }
+	inline int lapackOrder(Layout layout) { return (layout == RowMajor)?LAPACK_ROW_MAJOR:LAPACK_COL_MAJOR; }
+
+	// P is the BLAS type prefix, s or d
+#define PHG_BLAS_VENDOR_OVERLOADS(T, P) \
+	inline void gemm(Layout layout, bool transA, bool transB, int m, int n, int k, T alpha, \
+		const T* A, int lda, const T* B, int ldb, T beta, T* C, int ldc) \
+	{ \
+		if( m == 0 || n == 0 ) return; \
+		cblas_##P##gemm(cblasOrder(layout), cblasTrans(transA), cblasTrans(transB), \
+			m, n, k, alpha, A, lda, B, ldb, beta, C, ldc); \
+	} \
+	inline void gemv(Layout layout, bool trans, int m, int n, T alpha, const T* A, int lda, \
+		const T* x, T beta, T* y) \
+	{ cblas_##P##gemv(cblasOrder(layout), cblasTrans(trans), m, n, alpha, A, lda, x, 1, beta, y, 1); } \
+	inline void syrk(Layout layout, bool upper, bool trans, int n, int k, T alpha, const T* A, int lda, \
+		T beta, T* C, int ldc) \
+	{ cblas_##P##syrk(cblasOrder(layout), cblasUplo(upper), cblasTrans(trans), n, k, alpha, A, lda, beta, C, ldc); } \
+	inline int potrf(Layout layout, bool upper, int n, T* A, int lda) \
+	{ return LAPACKE_##P##potrf(lapackOrder(layout), upper?'U':'L', n, A, lda); } \
+	inline int potrs(Layout layout, bool upper, int n, int nrhs, const T* A, int lda, T* B, int ldb) \
+	{ return LAPACKE_##P##potrs(lapackOrder(layout), upper?'U':'L', n, nrhs, A, lda, B, ldb); } \
+	inline int orthonormalize(int m, int n, T* A) \
+	{ \
+		std::vector<T> tau(n); \
+		int info = LAPACKE_##P##geqrf(LAPACK_ROW_MAJOR, m, n, A, n, tau.data()); \
+		if( info != 0 ) return info; \
+		return LAPACKE_##P##orgqr(LAPACK_ROW_MAJOR, m, n, n, A, n, tau.data()); \
+	} \
+	inline int syev(int n, T* A, T* w) \
+	{ return LAPACKE_##P##syevd(LAPACK_ROW_MAJOR, 'V', 'U', n, A, n, w); } \
+	inline void copy(int n, const T* x, T* y) { cblas_##P##copy(n, x, 1, y, 1); } \
+	inline void axpy(int n, T alpha, const T* x, T* y) { cblas_##P##axpy(n, alpha, x, 1, y, 1); } \
+	inline T nrm2(int n, const T* x) { return cblas_##P##nrm2(n, x, 1); }
+
+	PHG_BLAS_VENDOR_OVERLOADS(float, s)
+	PHG_BLAS_VENDOR_OVERLOADS(double, d)
+#undef PHG_BLAS_VENDOR_OVERLOADS
+#endif
+}
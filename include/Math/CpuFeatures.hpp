@@ -0,0 +1,82 @@
+#pragma once
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <cpuid.h>
+#define PHG_X86 1
+#define PHG_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#define PHG_X86 1
+#define PHG_TARGET(isa)
+#else
+#define PHG_X86 0
+#endif
+
+// Instruction set extensions of the CPU the program runs on. Kernels for an
+// extension are compiled with PHG_TARGET, without any -m flag for the whole
+// build, and picked at run time with has(), so one binary runs everywhere.
+namespace CpuFeatures {
+	enum Feature {
+		Avx = 1,
+		Avx2Fma = 2,		// AVX2 together with FMA3
+		F16c = 4,
+		Avx512 = 8			// AVX-512 F
+	};
+
+	inline unsigned detect() {
+		unsigned features = 0;
+#if PHG_X86
+		unsigned r[4] = {0, 0, 0, 0};
+#if defined(__GNUC__)
+		unsigned maxLeaf = __get_cpuid_max(0, nullptr);
+		__cpuid(1, r[0], r[1], r[2], r[3]);
+#else
+		int q[4];
+		__cpuid(q, 0);
+		unsigned maxLeaf = unsigned(q[0]);
+		__cpuid(q, 1);
+		for(int i=0;i<4;i++) r[i] = unsigned(q[i]);
+#endif
+		bool osxsave = ((r[2] >> 27) & 1) != 0, avx = ((r[2] >> 28) & 1) != 0;
+		bool fma = ((r[2] >> 12) & 1) != 0, f16c = ((r[2] >> 29) & 1) != 0;
+		if( !osxsave || !avx ) return 0;
+
+		// the OS has to save the ymm and zmm registers too
+#if defined(__GNUC__)
+		unsigned lo, hi;
+		__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		unsigned long long xcr0 = lo | ((unsigned long long)hi << 32);
+#else
+		unsigned long long xcr0 = _xgetbv(0);
+#endif
+		if( (xcr0 & 0x6) != 0x6 ) return 0;
+		features |= Avx;
+		if( f16c ) features |= F16c;
+
+		if( maxLeaf >= 7 ) {
+#if defined(__GNUC__)
+			__cpuid_count(7, 0, r[0], r[1], r[2], r[3]);
+#else
+			__cpuidex(q, 7, 0);
+			for(int i=0;i<4;i++) r[i] = unsigned(q[i]);
+#endif
+			bool avx2 = ((r[1] >> 5) & 1) != 0, avx512 = ((r[1] >> 16) & 1) != 0;
+			if( avx2 && fma ) features |= Avx2Fma;
+			if( avx512 && (xcr0 & 0xe6) == 0xe6 ) features |= Avx512;
+		}
+#endif
+		return features;
+	}
+
+	// checked once, the first call is thread safe
+	inline unsigned supported() {
+		static const unsigned features = detect();
+		return features;
+	}
+
+	inline bool has(Feature f) {
+		return (supported() & f) != 0;
+	}
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "../phgutils.h"
+#include "../Utils/utility.hpp"
+#include <type_traits>
+
+namespace PhGUtils {
+// Expression templates for element-wise DenseMatrix and DenseVector
+// arithmetic. The operators below only build a small tree of nodes, the work
+// happens when the tree is assigned to a matrix or vector: one loop over the
+// elements writes straight into the destination, so a + b*2 - c needs no
+// temporaries and a single pass over memory. Matrices are column major and
+// vectors are columns, so element i of every operand is simply its i-th
+// stored value. Assign the result to a DenseMatrix/DenseVector, do not keep
+// an expression around with auto, it refers to its operands.
+template <typename E>
+class DenseExpr
+{
+public:
+	// nodes are stored by value inside larger expressions, containers replace
+	// this with a light reference to their elements
+	typedef E node_t;
+
+	const E& self() const { return static_cast<const E&>(*this); }
+	const E& node() const { return self(); }
+};
+
+// operands of an expression that own their elements, i.e. DenseMatrix and DenseVector
+template <typename T>
+class DenseRef : public DenseExpr<DenseRef<T>>
+{
+public:
+	typedef T elem_t;
+
+	DenseRef(const T* elems, size_t rows, size_t cols):mElems(elems),mRows(rows),mCols(cols){}
+
+	T operator[](size_t i) const { return mElems[i]; }
+	size_t rows() const { return mRows; }
+	size_t cols() const { return mCols; }
+
+private:
+	const T* mElems;
+	size_t mRows, mCols;
+};
+
+struct DenseAdd { template <typename T> static T apply(T a, T b) { return a + b; } };
+struct DenseSub { template <typename T> static T apply(T a, T b) { return a - b; } };
+struct DenseMul { template <typename T> static T apply(T a, T b) { return a * b; } };
+struct DenseDiv { template <typename T> static T apply(T a, T b) { return a / b; } };
+struct DenseAssign { template <typename T> static T apply(T, T b) { return b; } };
+
+template <typename L, typename R, typename Op>
+class DenseBinaryExpr : public DenseExpr<DenseBinaryExpr<L, R, Op>>
+{
+public:
+	typedef typename L::elem_t elem_t;
+	static_assert(is_same<elem_t, typename R::elem_t>::value, "operands must have the same element type");
+
+	DenseBinaryExpr(const L& lhs, const R& rhs):mLhs(lhs.node()),mRhs(rhs.node()),mRows(mLhs.rows()),mCols(mLhs.cols()){
+		if( mRhs.rows() != mRows || mRhs.cols() != mCols )
+		{
+			// evaluates to an empty result, like the eager operators used to
+			fail("DenseExpr : input dimensions do not match");
+			mRows = mCols = 0;
+		}
+	}
+
+	elem_t operator[](size_t i) const { return Op::apply(mLhs[i], mRhs[i]); }
+	size_t rows() const { return mRows; }
+	size_t cols() const { return mCols; }
+
+private:
+	typename L::node_t mLhs;
+	typename R::node_t mRhs;
+	size_t mRows, mCols;
+};
+
+// expression op scalar
+template <typename E, typename Op>
+class DenseScalarExpr : public DenseExpr<DenseScalarExpr<E, Op>>
+{
+public:
+	typedef typename E::elem_t elem_t;
+
+	DenseScalarExpr(const E& e, elem_t s):mExpr(e.node()),mScalar(s){}
+
+	elem_t operator[](size_t i) const { return Op::apply(mExpr[i], mScalar); }
+	size_t rows() const { return mExpr.rows(); }
+	size_t cols() const { return mExpr.cols(); }
+
+private:
+	typename E::node_t mExpr;
+	elem_t mScalar;
+};
+
+namespace DenseExprEval {
+	const long long BLOCK = 4096;	// elements per parallel chunk
+
+	// dst[i] = Op(dst[i], e[i]) for all n elements of e
+	template <typename Op, typename T, typename E>
+	void run(T* dst, const E& e, size_t n) {
+		long long nblocks = ((long long)n + BLOCK - 1) / BLOCK;
+		#pragma omp parallel for if(nblocks > 16)
+		for(long long b=0;b<nblocks;b++) {
+			long long i0 = b * BLOCK, i1 = min((long long)n, i0 + BLOCK);
+			#pragma omp simd
+			for(long long i=i0;i<i1;i++) dst[i] = Op::apply(dst[i], e[size_t(i)]);
+		}
+	}
+}
+
+template <typename L, typename R>
+DenseBinaryExpr<L, R, DenseAdd> operator+(const DenseExpr<L>& lhs, const DenseExpr<R>& rhs) {
+	return DenseBinaryExpr<L, R, DenseAdd>(lhs.self(), rhs.self());
+}
+
+template <typename L, typename R>
+DenseBinaryExpr<L, R, DenseSub> operator-(const DenseExpr<L>& lhs, const DenseExpr<R>& rhs) {
+	return DenseBinaryExpr<L, R, DenseSub>(lhs.self(), rhs.self());
+}
+
+template <typename E>
+DenseScalarExpr<E, DenseMul> operator*(const DenseExpr<E>& e, typename E::elem_t s) {
+	return DenseScalarExpr<E, DenseMul>(e.self(), s);
+}
+
+template <typename E>
+DenseScalarExpr<E, DenseMul> operator*(typename E::elem_t s, const DenseExpr<E>& e) {
+	return DenseScalarExpr<E, DenseMul>(e.self(), s);
+}
+
+template <typename E>
+DenseScalarExpr<E, DenseDiv> operator/(const DenseExpr<E>& e, typename E::elem_t s) {
+	return DenseScalarExpr<E, DenseDiv>(e.self(), s);
+}
+
+template <typename E>
+DenseScalarExpr<E, DenseMul> operator-(const DenseExpr<E>& e) {
+	return DenseScalarExpr<E, DenseMul>(e.self(), typename E::elem_t(-1));
+}
+}
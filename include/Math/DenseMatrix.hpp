@@ -2,14 +2,20 @@
 
 #include "MatrixBase.hpp"
 #include "DenseVector.hpp"
+#include "DenseExpr.hpp"
+#include "DenseView.hpp"
+#include "../Utils/utility.hpp"
+#include "BlasBackend.hpp"
+#include <cstring>
 
 namespace PhGUtils {
 template <typename T>
-class DenseMatrix : public MatrixBase<T>
+class DenseMatrix : public MatrixBase<T>, public DenseExpr<DenseMatrix<T>>
 {
 public:
 	typedef typename MatrixBase<T>::elem_t elem_t;
 	typedef typename MatrixBase<T>::idx_t idx_t;
+	typedef DenseRef<T> node_t;
 
 public:
 	/// general constructors
@@ -22,6 +28,12 @@ public:
 	DenseMatrix(DenseMatrix&&);
 	DenseMatrix& operator=(DenseMatrix&&);
 
+	/// evaluate an element-wise expression, see DenseExpr.hpp
+	template <typename E>
+	DenseMatrix(const DenseExpr<E>&);
+	template <typename E>
+	DenseMatrix& operator=(const DenseExpr<E>&);
+
 	virtual ~DenseMatrix();
 
 	/// special constructors
@@ -37,21 +49,17 @@ public:
 	DenseMatrix inverted();
 
 	/// arithmetic operations
-	DenseMatrix operator+(const DenseMatrix&);
-	DenseMatrix& operator+=(const DenseMatrix&);
-	DenseMatrix operator-(const DenseMatrix&);
-	DenseMatrix& operator-=(const DenseMatrix&);
-	DenseMatrix operator*(double factor);
+	/// +, - and scaling by a scalar build expressions, see DenseExpr.hpp
+	template <typename E>
+	DenseMatrix& operator+=(const DenseExpr<E>&);
+	template <typename E>
+	DenseMatrix& operator-=(const DenseExpr<E>&);
+	DenseMatrix& operator*=(T factor);
+	DenseMatrix& operator/=(T factor);
 	DenseMatrix operator*(const DenseMatrix&);
-	DenseMatrix operator*=(double factor);
 
 	template <typename MT, typename VT>
 	friend DenseVector<VT> operator*(const DenseMatrix<MT>&, const DenseVector<VT>&);
-	template <typename MT>
-	friend DenseMatrix<MT> operator*(double factor, DenseMatrix<MT>&);
-
-	DenseMatrix operator/(double factor);
-	DenseMatrix operator/=(double factor);
 
 	/// element accessors
 	virtual const T& operator()(idx_t i, idx_t j) const;
@@ -70,6 +78,17 @@ public:
 
 	elem_t* ptr() {return mElems;}
 	const elem_t* ptr() const {return mElems;}
+	node_t node() const {return node_t(mElems, mRows, mCols);}
+
+	/// non-owning views of the storage, see DenseView.hpp
+	DenseMatrixView<T> view() {return DenseMatrixView<T>(mElems, mRows, mCols);}
+	DenseMatrixView<const T> view() const {return DenseMatrixView<const T>(mElems, mRows, mCols);}
+	DenseMatrixView<T> block(size_t r0, size_t c0, size_t numRows, size_t numCols) {return view().block(r0, c0, numRows, numCols);}
+	DenseMatrixView<const T> block(size_t r0, size_t c0, size_t numRows, size_t numCols) const {return view().block(r0, c0, numRows, numCols);}
+	DenseVectorView<T> col(size_t j) {return view().col(j);}
+	DenseVectorView<const T> col(size_t j) const {return view().col(j);}
+	DenseVectorView<T> row(size_t i) {return view().row(i);}
+	DenseVectorView<const T> row(size_t i) const {return view().row(i);}
 
 private:
 	size_t mRows, mCols;
@@ -78,18 +97,18 @@ private:
 
 template <typename T>
 DenseMatrix<T>::DenseMatrix():
+	MatrixBase<T>(MatrixBase<T>::Dense, MatrixBase<T>::ColumnMajor),
 	mRows(0),
 	mCols(0),
-	mElems(nullptr),
-	MatrixBase<T>(MatrixBase<T>::Dense, MatrixBase<T>::ColumnMajor)
+	mElems(nullptr)
 {}
 
 template <typename T>
 DenseMatrix<T>::DenseMatrix(size_t numRows, size_t numCols):
+	MatrixBase<T>(MatrixBase<T>::Dense, MatrixBase<T>::ColumnMajor),
 	mRows(numRows),
 	mCols(numCols),
-	mElems(nullptr),
-	MatrixBase<T>(MatrixBase<T>::Dense, MatrixBase<T>::ColumnMajor)
+	mElems(nullptr)
 {
 	if( numRows * numCols > 0 )
 	{
@@ -100,10 +119,10 @@ DenseMatrix<T>::DenseMatrix(size_t numRows, size_t numCols):
 
 template <typename T>
 DenseMatrix<T>::DenseMatrix(const DenseMatrix& other):
+	MatrixBase<T>(MatrixBase<T>::Dense, MatrixBase<T>::ColumnMajor),
 	mRows(other.mRows),
 	mCols(other.mCols),
-	mElems(ArrayAllocator<T>::instance().allocateother.mRows * other.mCols),
-	MatrixBase<T>(MatrixBase<T>::Dense, MatrixBase<T>::ColumnMajor)
+	mElems(ArrayAllocator<T>::instance().allocate(other.mRows * other.mCols))
 {
 	memcpy(mElems, other.mElems, sizeof(T)*other.mRows*other.mCols);
 }
@@ -114,15 +133,14 @@ DenseMatrix<T>& DenseMatrix<T>::operator=(const DenseMatrix& other)
 	if (this != &other)
 	{
 		// Free the existing resource.
-		if( mElems != nullptr )
-			delete[] mElems;
+		ArrayAllocator<T>::instance().release(mElems, mRows * mCols);
 
 		mRows = other.mRows;
 		mCols = other.mCols;
 		mElems = ArrayAllocator<T>::instance().allocate(mRows * mCols);
 
-		mType = other.mType;
-		mFormat = other.mFormat;
+		this->mType = other.mType;
+		this->mFormat = other.mFormat;
 
 		memcpy(mElems, other.mElems, sizeof(T)*other.mRows*other.mCols);
 	}
@@ -131,10 +149,10 @@ DenseMatrix<T>& DenseMatrix<T>::operator=(const DenseMatrix& other)
 
 template <typename T>
 DenseMatrix<T>::DenseMatrix(DenseMatrix&& other):
+	MatrixBase<T>(MatrixBase<T>::Dense, MatrixBase<T>::ColumnMajor),
 	mRows(0),
 	mCols(0),
-	mElems(nullptr),
-	MatrixBase<T>(MatrixBase<T>::Dense, MatrixBase<T>::ColumnMajor)
+	mElems(nullptr)
 {
 	mRows = other.mRows;
 	mCols = other.mCols;
@@ -151,15 +169,14 @@ DenseMatrix<T>& DenseMatrix<T>::operator=(DenseMatrix&& other)
 	if (this != &other)
 	{
 		// Free the existing resource.
-		if( mElems != nullptr )
-			delete[] mElems;
+		ArrayAllocator<T>::instance().release(mElems, mRows * mCols);
 
 		mRows = other.mRows;
 		mCols = other.mCols;
 		mElems = other.mElems;
 
-		mType = other.mType;
-		mFormat = other.mFormat;
+		this->mType = other.mType;
+		this->mFormat = other.mFormat;
 
 		other.mElems = nullptr;
 		other.mRows = 0;
@@ -241,61 +258,73 @@ DenseMatrix<T> DenseMatrix<T>::transposed() {
 }
 
 template <typename T>
-DenseMatrix<T> DenseMatrix<T>::operator +(const DenseMatrix<T> &rhs)
+template <typename E>
+DenseMatrix<T>::DenseMatrix(const DenseExpr<E>& e):
+	MatrixBase<T>(MatrixBase<T>::Dense, MatrixBase<T>::ColumnMajor),
+	mRows(e.self().node().rows()),
+	mCols(e.self().node().cols()),
+	mElems(nullptr)
 {
-	// check if the dimension matches
-	if( !isValid() || !rhs.isValid() )
+	if( mRows * mCols > 0 )
 	{
-		Utility::fail("DenseMatrix::operator* : input is invalid!");
-		return DenseMatrix<T>();
+		mElems = ArrayAllocator<T>::instance().allocate(mRows * mCols);
+		DenseExprEval::run<DenseAssign>(mElems, e.self().node(), mRows * mCols);
 	}
-	else if( rhs.rows() != mRows || rhs.cols() != mCols )
+}
+
+template <typename T>
+template <typename E>
+DenseMatrix<T>& DenseMatrix<T>::operator=(const DenseExpr<E>& e)
+{
+	const typename E::node_t& x = e.self().node();
+	if( x.rows() != mRows || x.cols() != mCols )
 	{
-		Utility::fail("DenseMatrix::operator* : input dimensions do not match");
-		return DenseMatrix<T>();
+		// the expression may read the current elements, evaluate it first
+		DenseMatrix<T> result(e);
+		*this = std::move(result);
 	}
 	else
-	{
-		DenseMatrix<T> result(mRows, rhs.cols());
+		DenseExprEval::run<DenseAssign>(mElems, x, mRows * mCols);
 
-		idx_t count = mRows * mCols;
-		T* resptr = result.ptr();
-		const T* rhsptr = rhs.ptr();
-		for(idx_t i=0;i<count;i++) {
-			resptr[i] = mElems[i] + rhsptr[i];
-		}
+	return (*this);
+}
 
-		return result;
-	}
+template <typename T>
+template <typename E>
+DenseMatrix<T>& DenseMatrix<T>::operator+=(const DenseExpr<E>& e)
+{
+	const typename E::node_t& x = e.self().node();
+	if( x.rows() != mRows || x.cols() != mCols )
+		fail("DenseMatrix::operator+= : input dimensions do not match");
+	else
+		DenseExprEval::run<DenseAdd>(mElems, x, mRows * mCols);
+
+	return (*this);
 }
 
 template <typename T>
-DenseMatrix<T> DenseMatrix<T>::operator -(const DenseMatrix<T> &rhs)
+template <typename E>
+DenseMatrix<T>& DenseMatrix<T>::operator-=(const DenseExpr<E>& e)
 {
-	// check if the dimension matches
-	if( !isValid() || !rhs.isValid() )
-	{
-		Utility::fail("DenseMatrix::operator* : input is invalid!");
-		return DenseMatrix<T>();
-	}
-	else if( rhs.rows() != mRows || rhs.cols() != mCols )
-	{
-		Utility::fail("DenseMatrix::operator* : input dimensions do not match");
-		return DenseMatrix<T>();
-	}
+	const typename E::node_t& x = e.self().node();
+	if( x.rows() != mRows || x.cols() != mCols )
+		fail("DenseMatrix::operator-= : input dimensions do not match");
 	else
-	{
-		DenseMatrix<T> result(mRows, rhs.cols());
+		DenseExprEval::run<DenseSub>(mElems, x, mRows * mCols);
 
-		idx_t count = mRows * mCols;
-		T* resptr = result.ptr();
-		const T* rhsptr = rhs.ptr();
-		for(idx_t i=0;i<count;i++) {
-			resptr[i] = mElems[i] - rhsptr[i];
-		}
+	return (*this);
+}
 
-		return result;
-	}
+template <typename T>
+DenseMatrix<T>& DenseMatrix<T>::operator*=(T factor)
+{
+	return (*this) = (*this) * factor;
+}
+
+template <typename T>
+DenseMatrix<T>& DenseMatrix<T>::operator/=(T factor)
+{
+	return (*this) = (*this) / factor;
 }
 
 template <typename MT, typename T>
@@ -327,6 +356,33 @@ DenseVector<T> operator*(const DenseMatrix<MT>& m, const DenseVector<T>& v) {
 	}
 }
 
+namespace DenseMatrixProduct {
+	// C(m x n) = A(m x k) * B(k x n), all column major and C zeroed. float and
+	// double go to the blocked GEMM of the BLAS backend
+	inline void multiply(size_t m, size_t n, size_t k, const float* A, const float* B, float* C) {
+		BlasBackend::gemm(BlasBackend::ColMajor, false, false, int(m), int(n), int(k), 1.0f,
+			A, int(m), B, int(k), 0.0f, C, int(m));
+	}
+
+	inline void multiply(size_t m, size_t n, size_t k, const double* A, const double* B, double* C) {
+		BlasBackend::gemm(BlasBackend::ColMajor, false, false, int(m), int(n), int(k), 1.0,
+			A, int(m), B, int(k), 0.0, C, int(m));
+	}
+
+	// any other element type, every column of C is a sum of columns of A
+	template <typename T>
+	void multiply(size_t m, size_t n, size_t k, const T* A, const T* B, T* C) {
+		for(size_t c=0;c<n;c++) {
+			T* dst = C + c * m;
+			for(size_t l=0;l<k;l++) {
+				T b = B[c * k + l];
+				const T* src = A + l * m;
+				for(size_t r=0;r<m;r++) dst[r] += src[r] * b;
+			}
+		}
+	}
+}
+
 template <typename T>
 DenseMatrix<T> DenseMatrix<T>::operator *(const DenseMatrix<T> &rhs)
 {
@@ -344,17 +400,7 @@ DenseMatrix<T> DenseMatrix<T>::operator *(const DenseMatrix<T> &rhs)
 	else
 	{
 		DenseMatrix<T> result(mRows, rhs.cols());
-
-		for(idx_t c=0;c<rhs.cols();c++) {
-			for(idx_t r=0;r<mRows;r++) {
-				T val = 0;
-				for(idx_t k=0;k<mCols;k++) {
-					val += (*this)(r, k) * rhs(k, c);
-				}
-				result(r, c) = val;
-			}
-		}
-
+		DenseMatrixProduct::multiply(mRows, rhs.cols(), mCols, mElems, rhs.ptr(), result.ptr());
 		return result;
 	}
 }
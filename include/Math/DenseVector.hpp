@@ -1,15 +1,19 @@
 #pragma once
 
 #include "VectorBase.hpp"
+#include "DenseExpr.hpp"
+#include "DenseView.hpp"
 #include <fstream>
+#include <cstring>
 
 namespace PhGUtils {
 template <typename T>
-class DenseVector : public VectorBase<T>
+class DenseVector : public VectorBase<T>, public DenseExpr<DenseVector<T>>
 {
 public:
     typedef typename VectorBase<T>::idx_t idx_t;
     typedef typename VectorBase<T>::elem_t elem_t;
+    typedef DenseRef<T> node_t;
 
     DenseVector();
     DenseVector(size_t length);
@@ -20,13 +24,19 @@ public:
     DenseVector& operator=(DenseVector&&);
     virtual ~DenseVector();
 
-    DenseVector operator+(const DenseVector&);
-    DenseVector operator+=(const DenseVector&);
-    DenseVector operator-(const DenseVector&);
-    DenseVector operator-=(const DenseVector&);
-    DenseVector operator*(double);
-    DenseVector operator*=(double);
-    DenseVector operator/(double);
+    // evaluate an element-wise expression, see DenseExpr.hpp
+    template <typename E>
+    DenseVector(const DenseExpr<E>&);
+    template <typename E>
+    DenseVector& operator=(const DenseExpr<E>&);
+
+    // +, - and scaling by a scalar build expressions
+    template <typename E>
+    DenseVector& operator+=(const DenseExpr<E>&);
+    template <typename E>
+    DenseVector& operator-=(const DenseExpr<E>&);
+    DenseVector& operator*=(T);
+    DenseVector& operator/=(T);
 
 	void resize(size_t s);
 
@@ -35,6 +45,13 @@ public:
 
     elem_t* ptr() { return mElems; }
     const elem_t* ptr() const { return mElems; }
+    node_t node() const { return node_t(mElems, mLength, 1); }
+
+    // non-owning views of the storage, see DenseView.hpp
+    DenseVectorView<T> view() { return DenseVectorView<T>(mElems, mLength); }
+    DenseVectorView<const T> view() const { return DenseVectorView<const T>(mElems, mLength); }
+    DenseVectorView<T> segment(size_t start, size_t length) { return view().segment(start, length); }
+    DenseVectorView<const T> segment(size_t start, size_t length) const { return view().segment(start, length); }
 
     virtual const T& operator() (idx_t i) const;
     virtual T& operator() (idx_t i);
@@ -52,16 +69,16 @@ private:
 
 template <typename T>
 DenseVector<T>::DenseVector():
+    VectorBase<T>(VectorBase<T>::Dense),
     mLength(0),
-    mElems(nullptr),
-    VectorBase<T>(VectorBase<T>::Dense)
+    mElems(nullptr)
 {}
 
 template <typename T>
 DenseVector<T>::DenseVector(size_t length):
+    VectorBase<T>(VectorBase<T>::Dense),
     mLength(length),
-    mElems(nullptr),
-    VectorBase<T>(VectorBase<T>::Dense)
+    mElems(nullptr)
 {
     mElems = ArrayAllocator<elem_t>::instance().allocate(length);
     memset(mElems, 0, sizeof(elem_t) * length);
@@ -69,18 +86,18 @@ DenseVector<T>::DenseVector(size_t length):
 
 template <typename T>
 DenseVector<T>::DenseVector(const elem_t *elems, size_t length):
+    VectorBase<T>(VectorBase<T>::Dense),
     mLength(length),
-    mElems(ArrayAllocator<elem_t>::instance().allocate(length)),
-    VectorBase<T>(VectorBase<T>::Dense)
+    mElems(ArrayAllocator<elem_t>::instance().allocate(length))
 {
     memcpy(mElems, elems, sizeof(elem_t) * length);
 }
 
 template <typename T>
 DenseVector<T>::DenseVector(const DenseVector<T> &other):
+    VectorBase<T>(VectorBase<T>::Dense),
     mLength(other.mLength),
-    mElems(ArrayAllocator<elem_t>::instance().allocate(other.mLength)),
-    VectorBase<T>(VectorBase<T>::Dense)
+    mElems(ArrayAllocator<elem_t>::instance().allocate(other.mLength))
 {
     memcpy(mElems, other.mElems, sizeof(elem_t) * other.length());
 }
@@ -107,9 +124,9 @@ DenseVector<T>& DenseVector<T>::operator=(const DenseVector<T>& other)
 
 template <typename T>
 DenseVector<T>::DenseVector(DenseVector<T> &&other):
+    VectorBase<T>(VectorBase<T>::Dense),
     mLength(0),
-    mElems(nullptr),
-    VectorBase<T>(VectorBase<T>::Dense)
+    mElems(nullptr)
 {
     mLength = other.mLength;
     mElems = other.mElems;
@@ -159,24 +176,77 @@ void DenseVector<T>::resize( size_t length )
 }
 
 template <typename T>
-DenseVector<T> DenseVector<T>::operator-(const DenseVector &rhs)
+template <typename E>
+DenseVector<T>::DenseVector(const DenseExpr<E>& e):
+    VectorBase<T>(VectorBase<T>::Dense),
+    mLength(0),
+    mElems(nullptr)
 {
-    if( rhs.length() != mLength )
+    const typename E::node_t& x = e.self().node();
+    if( x.cols() != 1 )
     {
-        cerr << "lengths do not match!" << endl;
-        return DenseVector<T>();
+        cerr << "expression is not a column vector!" << endl;
+        return;
     }
-    else
-    {
-        DenseVector<T> res((*this));
 
-        for(size_t i=0;i<res.length();i++)
-        {
-            res(i) -= rhs(i);
-        }
+    mLength = x.rows();
+    mElems = ArrayAllocator<elem_t>::instance().allocate(mLength);
+    DenseExprEval::run<DenseAssign>(mElems, x, mLength);
+}
 
-        return res;
+template <typename T>
+template <typename E>
+DenseVector<T>& DenseVector<T>::operator=(const DenseExpr<E>& e)
+{
+    const typename E::node_t& x = e.self().node();
+    if( x.rows() != mLength || x.cols() != 1 )
+    {
+        // the expression may read the current elements, evaluate it first
+        DenseVector<T> res(e);
+        *this = std::move(res);
     }
+    else
+        DenseExprEval::run<DenseAssign>(mElems, x, mLength);
+
+    return (*this);
+}
+
+template <typename T>
+template <typename E>
+DenseVector<T>& DenseVector<T>::operator+=(const DenseExpr<E>& e)
+{
+    const typename E::node_t& x = e.self().node();
+    if( x.rows() != mLength || x.cols() != 1 )
+        cerr << "lengths do not match!" << endl;
+    else
+        DenseExprEval::run<DenseAdd>(mElems, x, mLength);
+
+    return (*this);
+}
+
+template <typename T>
+template <typename E>
+DenseVector<T>& DenseVector<T>::operator-=(const DenseExpr<E>& e)
+{
+    const typename E::node_t& x = e.self().node();
+    if( x.rows() != mLength || x.cols() != 1 )
+        cerr << "lengths do not match!" << endl;
+    else
+        DenseExprEval::run<DenseSub>(mElems, x, mLength);
+
+    return (*this);
+}
+
+template <typename T>
+DenseVector<T>& DenseVector<T>::operator*=(T factor)
+{
+    return (*this) = (*this) * factor;
+}
+
+template <typename T>
+DenseVector<T>& DenseVector<T>::operator/=(T factor)
+{
+    return (*this) = (*this) / factor;
 }
 
 template <typename T>
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "../phgutils.h"
+#include "BlasBackend.hpp"
+#include <cassert>
+#include <cstring>
+#include <type_traits>
+
+namespace PhGUtils {
+// Non-owning windows into column major storage, e.g. a block, row or column
+// of a DenseMatrix, or a piece of any external buffer. A matrix view is
+// pointer, size and leading dimension, exactly what BLAS and LAPACK take, so
+// a block can be handed to them without copying. A vector view is pointer,
+// length and stride. Views never allocate, the memory has to outlive them.
+// Use T = const elem_t for read-only views.
+template <typename T>
+class DenseVectorView
+{
+public:
+	typedef typename std::remove_const<T>::type elem_t;
+
+	DenseVectorView():mElems(nullptr),mLength(0),mStride(1){}
+	DenseVectorView(T* elems, size_t length, size_t stride = 1):mElems(elems),mLength(length),mStride(stride){}
+	// mutable to read-only
+	template <typename U>
+	DenseVectorView(const DenseVectorView<U>& other,
+		typename std::enable_if<std::is_convertible<U*, T*>::value>::type* = nullptr):
+		mElems(other.ptr()),mLength(other.length()),mStride(other.stride()){}
+
+	T& operator()(size_t i) const { return mElems[i * mStride]; }
+
+	size_t length() const { return mLength; }
+	size_t stride() const { return mStride; }
+	T* ptr() const { return mElems; }
+	bool isValid() const { return (mElems != nullptr) && (mLength != 0); }
+	bool isContiguous() const { return mStride == 1; }
+
+	DenseVectorView segment(size_t start, size_t length) const {
+		assert(start + length <= mLength);
+		return DenseVectorView(mElems + start * mStride, length, mStride);
+	}
+
+	void fill(elem_t value) const {
+		for(size_t i=0;i<mLength;i++) mElems[i * mStride] = value;
+	}
+
+	// element-wise copy, the lengths must match
+	void assign(const DenseVectorView<const elem_t>& other) const {
+		assert(other.length() == mLength);
+		if( mStride == 1 && other.stride() == 1 ) memcpy(mElems, other.ptr(), sizeof(elem_t) * mLength);
+		else for(size_t i=0;i<mLength;i++) mElems[i * mStride] = other(i);
+	}
+
+private:
+	T* mElems;
+	size_t mLength, mStride;
+};
+
+template <typename T>
+class DenseMatrixView
+{
+public:
+	typedef typename std::remove_const<T>::type elem_t;
+
+	DenseMatrixView():mElems(nullptr),mRows(0),mCols(0),mLd(1){}
+	// ld is the distance between two columns, at least rows
+	DenseMatrixView(T* elems, size_t rows, size_t cols, size_t ld):mElems(elems),mRows(rows),mCols(cols),mLd(ld){
+		assert(ld >= rows);
+	}
+	DenseMatrixView(T* elems, size_t rows, size_t cols):mElems(elems),mRows(rows),mCols(cols),mLd(rows > 0 ? rows : 1){}
+	template <typename U>
+	DenseMatrixView(const DenseMatrixView<U>& other,
+		typename std::enable_if<std::is_convertible<U*, T*>::value>::type* = nullptr):
+		mElems(other.ptr()),mRows(other.rows()),mCols(other.cols()),mLd(other.ld()){}
+
+	T& operator()(size_t i, size_t j) const { return mElems[j * mLd + i]; }
+
+	size_t rows() const { return mRows; }
+	size_t cols() const { return mCols; }
+	size_t ld() const { return mLd; }
+	T* ptr() const { return mElems; }
+	bool isValid() const { return (mElems != nullptr) && (mRows > 0) && (mCols > 0); }
+	// no gaps between the columns, e.g. a whole matrix or a range of columns
+	bool isContiguous() const { return mLd == mRows || mCols <= 1; }
+
+	DenseMatrixView block(size_t r0, size_t c0, size_t rows, size_t cols) const {
+		assert(r0 + rows <= mRows && c0 + cols <= mCols);
+		return DenseMatrixView(mElems + c0 * mLd + r0, rows, cols, mLd);
+	}
+	DenseMatrixView colRange(size_t c0, size_t cols) const { return block(0, c0, mRows, cols); }
+	DenseMatrixView rowRange(size_t r0, size_t rows) const { return block(r0, 0, rows, mCols); }
+	DenseVectorView<T> col(size_t j) const {
+		assert(j < mCols);
+		return DenseVectorView<T>(mElems + j * mLd, mRows, 1);
+	}
+	DenseVectorView<T> row(size_t i) const {
+		assert(i < mRows);
+		return DenseVectorView<T>(mElems + i, mCols, mLd);
+	}
+
+	void fill(elem_t value) const {
+		for(size_t j=0;j<mCols;j++) {
+			T* c = mElems + j * mLd;
+			for(size_t i=0;i<mRows;i++) c[i] = value;
+		}
+	}
+
+	// column by column copy, the sizes must match
+	void assign(const DenseMatrixView<const elem_t>& other) const {
+		assert(other.rows() == mRows && other.cols() == mCols);
+		for(size_t j=0;j<mCols;j++) memcpy(mElems + j * mLd, other.ptr() + j * other.ld(), sizeof(elem_t) * mRows);
+	}
+
+private:
+	T* mElems;
+	size_t mRows, mCols, mLd;
+};
+
+// BLAS on views, column major with the leading dimension of every view.
+// The vectors of gemv have to be contiguous
+#define PHG_DENSE_VIEW_BLAS(T) \
+	inline void gemm(bool transA, bool transB, T alpha, const DenseMatrixView<const T>& A, \
+		const DenseMatrixView<const T>& B, T beta, const DenseMatrixView<T>& C) \
+	{ \
+		size_t k = transA ? A.rows() : A.cols(); \
+		assert(C.rows() == (transA ? A.cols() : A.rows()) && C.cols() == (transB ? B.rows() : B.cols())); \
+		assert(k == (transB ? B.cols() : B.rows())); \
+		BlasBackend::gemm(BlasBackend::ColMajor, transA, transB, int(C.rows()), int(C.cols()), int(k), alpha, \
+			A.ptr(), int(A.ld()), B.ptr(), int(B.ld()), beta, C.ptr(), int(C.ld())); \
+	} \
+	inline void gemv(bool trans, T alpha, const DenseMatrixView<const T>& A, const DenseVectorView<const T>& x, \
+		T beta, const DenseVectorView<T>& y) \
+	{ \
+		assert(x.isContiguous() && y.isContiguous()); \
+		assert(x.length() == (trans ? A.rows() : A.cols()) && y.length() == (trans ? A.cols() : A.rows())); \
+		BlasBackend::gemv(BlasBackend::ColMajor, trans, int(A.rows()), int(A.cols()), alpha, A.ptr(), int(A.ld()), \
+			x.ptr(), beta, y.ptr()); \
+	}
+
+PHG_DENSE_VIEW_BLAS(float)
+PHG_DENSE_VIEW_BLAS(double)
+#undef PHG_DENSE_VIEW_BLAS
+}
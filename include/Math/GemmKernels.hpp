@@ -0,0 +1,226 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "CpuFeatures.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Packed GEMM for row major matrices, C = alpha * op(A) * op(B) + beta * C.
+// op(B) is packed into KC x NC panels of NR wide strips and op(A) into MC x KC
+// blocks of MR tall strips, then a register blocked MR x NR micro-kernel runs
+// over every pair of strips with the whole tile of C held in registers. The
+// micro-kernel is chosen at run time from what the CPU supports: AVX-512,
+// AVX2 with FMA, or portable code, so one binary runs everywhere.
+namespace GemmKernels {
+	enum Isa { Generic = 0, Avx2 = 1, Avx512 = 2 };
+
+	const int KC = 256;			// depth of the packed panels, one B strip stays in L1
+	const int MC = 120;			// rows of a packed A block, about half of L2
+	const int NC = 4096;		// columns of a packed B panel, in L3
+
+	inline Isa detectIsa() {
+		if( CpuFeatures::has(CpuFeatures::Avx512) ) return Avx512;
+		if( CpuFeatures::has(CpuFeatures::Avx2Fma) ) return Avx2;
+		return Generic;
+	}
+
+	inline Isa& activeIsa() {
+		static Isa isa = detectIsa();
+		return isa;
+	}
+
+	// limit the kernels to isa, e.g. to compare them; levels the CPU lacks are ignored
+	inline void setIsa(Isa isa) {
+		activeIsa() = std::min(isa, detectIsa());
+	}
+
+	// c(MR x NR, row stride ldc) += alpha * a * b, a is a packed kc x MR strip
+	// stored column by column, b a packed kc x NR strip stored row by row
+	template <typename T>
+	struct MicroKernel {
+		int mr, nr;
+		void (*run)(int kc, const T* a, const T* b, T* c, size_t ldc, T alpha);
+	};
+
+	template <typename T, int MR, int NR>
+	void kernelGeneric(int kc, const T* a, const T* b, T* c, size_t ldc, T alpha) {
+		T acc[MR][NR] = {};
+		for(int l=0;l<kc;l++, a+=MR, b+=NR) {
+			for(int i=0;i<MR;i++) {
+				T ai = a[i];
+				#pragma omp simd
+				for(int j=0;j<NR;j++) acc[i][j] += ai * b[j];
+			}
+		}
+		for(int i=0;i<MR;i++) {
+			for(int j=0;j<NR;j++) c[i * ldc + j] += alpha * acc[i][j];
+		}
+	}
+
+#if PHG_X86
+	// 6 rows of 2 vectors each, 12 accumulators plus 2 for B and 1 broadcast
+#define PHG_GEMM_ROW(i, SET1, FMA) \
+	x = SET1(a[i]); \
+	c##i##0 = FMA(x, b0, c##i##0); \
+	c##i##1 = FMA(x, b1, c##i##1);
+#define PHG_GEMM_STORE(i, W, LOAD, STORE, FMA) \
+	STORE(c + i * ldc, FMA(al, c##i##0, LOAD(c + i * ldc))); \
+	STORE(c + i * ldc + W, FMA(al, c##i##1, LOAD(c + i * ldc + W)));
+#define PHG_GEMM_KERNEL(NAME, T, V, W, ISA, ZERO, SET1, LOAD, STORE, FMA) \
+	PHG_TARGET(ISA) \
+	inline void NAME(int kc, const T* a, const T* b, T* c, size_t ldc, T alpha) { \
+		V c00 = ZERO(), c01 = ZERO(), c10 = ZERO(), c11 = ZERO(), c20 = ZERO(), c21 = ZERO(); \
+		V c30 = ZERO(), c31 = ZERO(), c40 = ZERO(), c41 = ZERO(), c50 = ZERO(), c51 = ZERO(); \
+		for(int l=0;l<kc;l++, a+=6, b+=2*W) { \
+			V b0 = LOAD(b), b1 = LOAD(b + W), x; \
+			PHG_GEMM_ROW(0, SET1, FMA) PHG_GEMM_ROW(1, SET1, FMA) PHG_GEMM_ROW(2, SET1, FMA) \
+			PHG_GEMM_ROW(3, SET1, FMA) PHG_GEMM_ROW(4, SET1, FMA) PHG_GEMM_ROW(5, SET1, FMA) \
+		} \
+		V al = SET1(alpha); \
+		PHG_GEMM_STORE(0, W, LOAD, STORE, FMA) PHG_GEMM_STORE(1, W, LOAD, STORE, FMA) \
+		PHG_GEMM_STORE(2, W, LOAD, STORE, FMA) PHG_GEMM_STORE(3, W, LOAD, STORE, FMA) \
+		PHG_GEMM_STORE(4, W, LOAD, STORE, FMA) PHG_GEMM_STORE(5, W, LOAD, STORE, FMA) \
+	}
+
+	PHG_GEMM_KERNEL(kernelAvx2, float, __m256, 8, "avx2,fma",
+		_mm256_setzero_ps, _mm256_set1_ps, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_fmadd_ps)
+	PHG_GEMM_KERNEL(kernelAvx2, double, __m256d, 4, "avx2,fma",
+		_mm256_setzero_pd, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_fmadd_pd)
+	PHG_GEMM_KERNEL(kernelAvx512, float, __m512, 16, "avx512f",
+		_mm512_setzero_ps, _mm512_set1_ps, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_fmadd_ps)
+	PHG_GEMM_KERNEL(kernelAvx512, double, __m512d, 8, "avx512f",
+		_mm512_setzero_pd, _mm512_set1_pd, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_fmadd_pd)
+
+#undef PHG_GEMM_KERNEL
+#undef PHG_GEMM_STORE
+#undef PHG_GEMM_ROW
+#endif
+
+	inline MicroKernel<float> microKernel(Isa isa, float) {
+#if PHG_X86
+		if( isa == Avx512 ) { MicroKernel<float> k = {6, 32, &kernelAvx512}; return k; }
+		if( isa == Avx2 ) { MicroKernel<float> k = {6, 16, &kernelAvx2}; return k; }
+#endif
+		MicroKernel<float> k = {4, 8, &kernelGeneric<float, 4, 8>};
+		return k;
+	}
+
+	inline MicroKernel<double> microKernel(Isa isa, double) {
+#if PHG_X86
+		if( isa == Avx512 ) { MicroKernel<double> k = {6, 16, &kernelAvx512}; return k; }
+		if( isa == Avx2 ) { MicroKernel<double> k = {6, 8, &kernelAvx2}; return k; }
+#endif
+		MicroKernel<double> k = {4, 4, &kernelGeneric<double, 4, 4>};
+		return k;
+	}
+
+	// rows i0 .. i0 + mc of op(A), columns l0 .. l0 + kc, as mr tall strips,
+	// the last strip is padded with zeros
+	template <typename T>
+	void packA(bool trans, const T* A, int lda, int i0, int mc, int l0, int kc, int mr, T* buf) {
+		for(int s=0;s<mc;s+=mr) {
+			int rows = std::min(mr, mc - s);
+			T* dst = buf + size_t(s) * kc;
+			for(int l=0;l<kc;l++, dst+=mr) {
+				for(int r=0;r<rows;r++) {
+					int i = i0 + s + r;
+					dst[r] = trans ? A[size_t(l0 + l) * lda + i] : A[size_t(i) * lda + l0 + l];
+				}
+				for(int r=rows;r<mr;r++) dst[r] = T(0);
+			}
+		}
+	}
+
+	// strip t of the packed panel, rows l0 .. l0 + kc of op(B) and columns
+	// j0 + t * nr onwards, padded with zeros past nc
+	template <typename T>
+	void packB(bool trans, const T* B, int ldb, int l0, int kc, int j0, int nc, int nr, int t, T* buf) {
+		int j = t * nr, cols = std::min(nr, nc - j);
+		T* dst = buf + size_t(t) * kc * nr;
+		for(int l=0;l<kc;l++, dst+=nr) {
+			if( trans ) {
+				for(int c=0;c<cols;c++) dst[c] = B[size_t(j0 + j + c) * ldb + l0 + l];
+			}
+			else memcpy(dst, B + size_t(l0 + l) * ldb + j0 + j, sizeof(T) * cols);
+			for(int c=cols;c<nr;c++) dst[c] = T(0);
+		}
+	}
+
+	template <typename T>
+	void gemm(bool transA, bool transB, int m, int n, int k, T alpha,
+		const T* A, int lda, const T* B, int ldb, T beta, T* C, int ldc)
+	{
+		bool parallel = double(m) * n * k > 262144.0;
+
+		if( beta != T(1) ) {
+			#pragma omp parallel for if(parallel)
+			for(int i=0;i<m;i++) {
+				T* c = C + size_t(i) * ldc;
+				if( beta == T(0) ) memset(c, 0, sizeof(T) * n);
+				else for(int j=0;j<n;j++) c[j] *= beta;
+			}
+		}
+		if( m == 0 || n == 0 || k == 0 || alpha == T(0) ) return;
+
+		const MicroKernel<T> uk = microKernel(activeIsa(), T());
+		const int mr = uk.mr, nr = uk.nr;
+		const int mc = std::max(mr, MC / mr * mr);
+		const int ncmax = (std::min(NC, n) + nr - 1) / nr * nr;
+		std::vector<T> bpack(size_t(KC) * ncmax);
+
+		#pragma omp parallel if(parallel)
+		{
+			std::vector<T> apack(size_t(mc) * KC);
+			T edge[6 * 32];
+
+			for(int j0=0;j0<n;j0+=NC) {
+				int nc = std::min(NC, n - j0);
+				int nstrips = (nc + nr - 1) / nr;
+				for(int l0=0;l0<k;l0+=KC) {
+					int kc = std::min(KC, k - l0);
+
+					#pragma omp for schedule(static)
+					for(int t=0;t<nstrips;t++) packB(transB, B, ldb, l0, kc, j0, nc, nr, t, &bpack[0]);
+
+					// one task per A block and group of B strips, a thread packs
+					// an A block once for all the groups it gets in a row
+					int mblocks = (m + mc - 1) / mc;
+					int group = std::max(1, std::min(nstrips, 16));
+					int ngroups = (nstrips + group - 1) / group;
+					int packed = -1;
+					#pragma omp for schedule(static)
+					for(int task=0;task<mblocks*ngroups;task++) {
+						int ib = task / ngroups, g = task % ngroups;
+						int i0 = ib * mc, rows = std::min(mc, m - i0);
+						if( packed != ib ) {
+							packA(transA, A, lda, i0, rows, l0, kc, mr, &apack[0]);
+							packed = ib;
+						}
+						int t1 = std::min(nstrips, (g + 1) * group);
+						for(int t=g*group;t<t1;t++) {
+							int j = t * nr, cols = std::min(nr, nc - j);
+							const T* b = &bpack[size_t(t) * kc * nr];
+							for(int s=0;s<rows;s+=mr) {
+								int h = std::min(mr, rows - s);
+								const T* a = &apack[size_t(s) * kc];
+								T* c = C + size_t(i0 + s) * ldc + j0 + j;
+								if( h == mr && cols == nr ) uk.run(kc, a, b, c, ldc, alpha);
+								else {
+									// partial tile, computed in full and added where it fits
+									memset(edge, 0, sizeof(T) * mr * nr);
+									uk.run(kc, a, b, edge, nr, alpha);
+									for(int r=0;r<h;r++) {
+										for(int q=0;q<cols;q++) c[size_t(r) * ldc + q] += edge[r * nr + q];
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+}
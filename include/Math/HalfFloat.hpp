@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include "CpuFeatures.hpp"
+
+// 16-bit floating point storage types. They only hold values, arithmetic is
+// done in float after conversion, which is what the tensor kernels do on load.
+// Single values use F16C when the build targets it, arrays go through
+// HalfConvert below, which checks the CPU at run time.
+
+// IEEE 754 binary16: 1 sign, 5 exponent and 10 mantissa bits
+struct Half {
+	uint16_t bits;
+
+	Half(void) = default;
+	Half(float f):bits(fromFloat(f)){}
+	operator float() const { return toFloat(bits); }
+
+	// round to nearest even, overflow goes to infinity
+	static uint16_t fromFloat(float f) {
+#if defined(__F16C__)
+		return _cvtss_sh(f, 0);
+#else
+		uint32_t x;
+		memcpy(&x, &f, sizeof(float));
+		uint16_t sign = (x >> 16) & 0x8000;
+		uint32_t absx = x & 0x7FFFFFFF;
+
+		// inf and nan, keep nan quiet
+		if( absx >= 0x7F800000 ) return sign | 0x7C00 | ((absx > 0x7F800000)?0x200:0);
+		// 65536 and above
+		if( absx >= 0x47800000 ) return sign | 0x7C00;
+		// below 2^-14, subnormal or zero
+		if( absx < 0x38800000 ) {
+			if( absx < 0x33000000 ) return sign;
+			uint32_t e = absx >> 23;
+			uint32_t m = (absx & 0x7FFFFF) | 0x800000;
+			uint32_t shift = 126 - e;
+			uint32_t h = m >> shift, rem = m & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+			if( rem > halfway || (rem == halfway && (h & 1)) ) h++;
+			return sign | uint16_t(h);
+		}
+		// normal, rebias the exponent from 127 to 15, rounding may carry into inf
+		uint32_t h = (absx - 0x38000000) >> 13, rem = absx & 0x1FFF;
+		if( rem > 0x1000 || (rem == 0x1000 && (h & 1)) ) h++;
+		return sign | uint16_t(h);
+#endif
+	}
+
+	static float toFloat(uint16_t h) {
+#if defined(__F16C__)
+		return _cvtsh_ss(h);
+#else
+		uint32_t sign = uint32_t(h & 0x8000) << 16;
+		uint32_t e = (h >> 10) & 0x1F, m = h & 0x3FF;
+		uint32_t x;
+		if( e == 0 ) {
+			if( m == 0 ) x = sign;
+			else {
+				// subnormal, normalize the mantissa
+				e = 113;
+				while( !(m & 0x400) ) { m <<= 1; e--; }
+				x = sign | (e << 23) | ((m & 0x3FF) << 13);
+			}
+		}
+		else if( e == 31 ) x = sign | 0x7F800000 | (m << 13);
+		else x = sign | ((e + 112) << 23) | (m << 13);
+
+		float f;
+		memcpy(&f, &x, sizeof(float));
+		return f;
+#endif
+	}
+};
+
+// bfloat16: the upper half of a float, 8 exponent and 7 mantissa bits
+struct BFloat16 {
+	uint16_t bits;
+
+	BFloat16(void) = default;
+	BFloat16(float f):bits(fromFloat(f)){}
+	operator float() const { return toFloat(bits); }
+
+	// round to nearest even
+	static uint16_t fromFloat(float f) {
+		uint32_t x;
+		memcpy(&x, &f, sizeof(float));
+		if( (x & 0x7FFFFFFF) > 0x7F800000 ) return uint16_t((x >> 16) | 0x40);
+		return uint16_t((x + 0x7FFF + ((x >> 16) & 1)) >> 16);
+	}
+
+	static float toFloat(uint16_t b) {
+		uint32_t x = uint32_t(b) << 16;
+		float f;
+		memcpy(&f, &x, sizeof(float));
+		return f;
+	}
+};
+
+// bulk conversions between Half and float, F16C when the CPU has it
+namespace HalfConvert {
+#if PHG_X86
+	PHG_TARGET("avx,f16c")
+	inline void toFloatF16c(const Half* src, float* dst, size_t n) {
+		size_t i = 0;
+		for(;i+8<=n;i+=8) {
+			_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+		}
+		for(;i<n;i++) dst[i] = _cvtsh_ss(src[i].bits);
+	}
+
+	PHG_TARGET("avx,f16c")
+	inline void fromFloatF16c(const float* src, Half* dst, size_t n) {
+		size_t i = 0;
+		for(;i+8<=n;i+=8) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+		}
+		for(;i<n;i++) dst[i].bits = _cvtss_sh(src[i], _MM_FROUND_TO_NEAREST_INT);
+	}
+#endif
+
+	inline void toFloat(const Half* src, float* dst, size_t n) {
+#if PHG_X86
+		if( CpuFeatures::has(CpuFeatures::F16c) ) { toFloatF16c(src, dst, n); return; }
+#endif
+		for(size_t i=0;i<n;i++) dst[i] = Half::toFloat(src[i].bits);
+	}
+
+	inline void fromFloat(const float* src, Half* dst, size_t n) {
+#if PHG_X86
+		if( CpuFeatures::has(CpuFeatures::F16c) ) { fromFloatF16c(src, dst, n); return; }
+#endif
+		for(size_t i=0;i<n;i++) dst[i].bits = Half::fromFloat(src[i]);
+	}
+}
+
+static_assert(sizeof(Half) == 2 && sizeof(BFloat16) == 2, "16-bit storage types must be packed");
+static_assert(std::is_trivial<Half>::value && std::is_trivial<BFloat16>::value, "16-bit storage types must be trivial, tensors memset and memcpy them");
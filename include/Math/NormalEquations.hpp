@@ -0,0 +1,239 @@
+#pragma once
+
+#include "DenseMatrix.hpp"
+#include "DenseVector.hpp"
+#include "DenseView.hpp"
+#include "BlasBackend.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace PhGUtils {
+/// streaming least squares: min |A x - b| with A fed in blocks of rows
+///
+/// Only A'A, A'b and b'b are kept, so memory grows with the number of
+/// unknowns squared and not with the number of observations, and A can be
+/// read from disk block by block. Every block is one SYRK and one GEMV into
+/// per-thread partial sums; large blocks are split between the threads. The
+/// partial sums are added up when the normal equations are needed. Separate
+/// producers can each fill an accumulator and merge them at the end.
+/// Sums over tens of millions of rows lose precision in float, use double.
+template <typename T>
+class NormalEquationAccumulator
+{
+	static_assert(is_same<T, float>::value || is_same<T, double>::value, "NormalEquationAccumulator works on float or double");
+
+public:
+	NormalEquationAccumulator(int numUnknowns = 0) { reset(numUnknowns); }
+
+	/// drop all rows and start over with numUnknowns columns
+	void reset(int numUnknowns);
+
+	/// add k rows of A and the matching k values of b. A is k x n with leading
+	/// dimension lda in the given storage order, so a row major buffer of
+	/// observations goes in without a transpose
+	void addRows(BlasBackend::Layout layout, int k, const T* A, int lda, const T* b);
+	/// a column major block, e.g. a view into a DenseMatrix
+	void addRows(const DenseMatrixView<const T>& A, const DenseVectorView<const T>& b);
+	void addRow(const T* a, T b) { addRows(BlasBackend::RowMajor, 1, a, mN, &b); }
+
+	/// add the rows seen by another accumulator of the same size
+	void merge(const NormalEquationAccumulator& other);
+
+	int unknowns() const { return mN; }
+	size_t observations() const { return mRows; }
+
+	/// the accumulated sums, A'A with both triangles filled
+	const DenseMatrix<T>& AtA() const { reduce(); return mAtA; }
+	const DenseVector<T>& Atb() const { reduce(); return mAtb; }
+	T btb() const { reduce(); return mBtb; }
+
+	/// x = (A'A + damping * I) \ A'b by Cholesky, false if not positive definite
+	bool solve(DenseVector<T>& x, T damping = 0) const;
+	/// |A x - b|^2 from the sums, without the rows
+	T residualNorm2(const DenseVector<T>& x) const;
+
+private:
+	struct Partial
+	{
+		vector<T> AtA, Atb;		// lower triangle of A'A, column major
+		T btb;
+	};
+
+	Partial& partial(int t);
+	void addRows(Partial& p, BlasBackend::Layout layout, int k, const T* A, int lda, const T* b);
+	void reduce() const;
+
+private:
+	static const int MIN_ROWS_PER_THREAD = 256;
+
+	int mN;
+	size_t mRows;
+	vector<Partial> mPartials;
+
+	// sums of the partials, rebuilt after new rows came in
+	mutable bool mDirty;
+	mutable DenseMatrix<T> mAtA;
+	mutable DenseVector<T> mAtb;
+	mutable T mBtb;
+};
+
+template <typename T>
+void NormalEquationAccumulator<T>::reset(int numUnknowns)
+{
+	mN = numUnknowns;
+	mRows = 0;
+	mPartials.clear();
+	mDirty = true;
+	mAtA = DenseMatrix<T>();
+	mAtb = DenseVector<T>();
+	mBtb = 0;
+}
+
+template <typename T>
+typename NormalEquationAccumulator<T>::Partial& NormalEquationAccumulator<T>::partial(int t)
+{
+	Partial& p = mPartials[t];
+	if( p.AtA.empty() )
+	{
+		p.AtA.assign(size_t(mN) * mN, T(0));
+		p.Atb.assign(mN, T(0));
+		p.btb = 0;
+	}
+	return p;
+}
+
+template <typename T>
+void NormalEquationAccumulator<T>::addRows(Partial& p, BlasBackend::Layout layout, int k, const T* A, int lda, const T* b)
+{
+	// A'A += A'A of the block, A'b += A'b of the block. The upper triangle of
+	// a row major n x n is the lower triangle of the same column major buffer
+	BlasBackend::syrk(layout, layout == BlasBackend::RowMajor, true, mN, k, T(1),
+		A, lda, T(1), &p.AtA[0], mN);
+	BlasBackend::gemv(layout, true, k, mN, T(1), A, lda, b, T(1), &p.Atb[0]);
+	for(int i=0;i<k;i++) p.btb += b[i] * b[i];
+}
+
+template <typename T>
+void NormalEquationAccumulator<T>::addRows(BlasBackend::Layout layout, int k, const T* A, int lda, const T* b)
+{
+	if( k <= 0 || mN <= 0 ) return;
+
+	int nt = 1;
+#ifdef _OPENMP
+	nt = max(1, min(omp_get_max_threads(), k / MIN_ROWS_PER_THREAD));
+#endif
+	if( int(mPartials.size()) < nt ) mPartials.resize(nt);
+
+	if( nt == 1 ) addRows(partial(0), layout, k, A, lda, b);
+	else
+	{
+		for(int t=0;t<nt;t++) partial(t);
+		// contiguous row ranges, one per thread and partial sum
+		#pragma omp parallel for num_threads(nt) schedule(static, 1)
+		for(int t=0;t<nt;t++)
+		{
+			int r0 = int(size_t(k) * t / nt), r1 = int(size_t(k) * (t + 1) / nt);
+			const T* At = (layout == BlasBackend::RowMajor) ? A + size_t(r0) * lda : A + r0;
+			addRows(mPartials[t], layout, r1 - r0, At, lda, b + r0);
+		}
+	}
+	mRows += k;
+	mDirty = true;
+}
+
+template <typename T>
+void NormalEquationAccumulator<T>::addRows(const DenseMatrixView<const T>& A, const DenseVectorView<const T>& b)
+{
+	if( int(A.cols()) != mN || A.rows() != b.length() )
+	{
+		fail("NormalEquationAccumulator::addRows : input dimensions do not match");
+		return;
+	}
+	if( !b.isContiguous() )
+	{
+		fail("NormalEquationAccumulator::addRows : b has to be contiguous");
+		return;
+	}
+	addRows(BlasBackend::ColMajor, int(A.rows()), A.ptr(), int(A.ld()), b.ptr());
+}
+
+template <typename T>
+void NormalEquationAccumulator<T>::merge(const NormalEquationAccumulator& other)
+{
+	if( other.mN != mN )
+	{
+		fail("NormalEquationAccumulator::merge : number of unknowns does not match");
+		return;
+	}
+	if( mPartials.empty() ) mPartials.resize(1);
+	Partial& p = partial(0);
+	for(size_t t=0;t<other.mPartials.size();t++)
+	{
+		const Partial& q = other.mPartials[t];
+		if( q.AtA.empty() ) continue;
+		BlasBackend::axpy(mN * mN, T(1), &q.AtA[0], &p.AtA[0]);
+		BlasBackend::axpy(mN, T(1), &q.Atb[0], &p.Atb[0]);
+		p.btb += q.btb;
+	}
+	mRows += other.mRows;
+	mDirty = true;
+}
+
+template <typename T>
+void NormalEquationAccumulator<T>::reduce() const
+{
+	if( !mDirty ) return;
+
+	mAtA = DenseMatrix<T>(mN, mN);
+	mAtb = DenseVector<T>(mN);
+	mBtb = 0;
+	for(size_t t=0;t<mPartials.size();t++)
+	{
+		const Partial& q = mPartials[t];
+		if( q.AtA.empty() ) continue;
+		BlasBackend::axpy(mN * mN, T(1), &q.AtA[0], mAtA.ptr());
+		BlasBackend::axpy(mN, T(1), &q.Atb[0], mAtb.ptr());
+		mBtb += q.btb;
+	}
+
+	// mirror the lower triangle
+	for(int j=0;j<mN;j++)
+	{
+		for(int i=j+1;i<mN;i++) mAtA(j, i) = mAtA(i, j);
+	}
+	mDirty = false;
+}
+
+template <typename T>
+bool NormalEquationAccumulator<T>::solve(DenseVector<T>& x, T damping) const
+{
+	reduce();
+	if( mN <= 0 ) return false;
+
+	DenseMatrix<T> L(mAtA);
+	for(int i=0;i<mN;i++) L(i, i) += damping;
+	if( BlasBackend::potrf(BlasBackend::ColMajor, false, mN, L.ptr(), mN) != 0 )
+	{
+		cerr << "NormalEquationAccumulator::solve : A'A is not positive definite" << endl;
+		return false;
+	}
+	x = mAtb;
+	return BlasBackend::potrs(BlasBackend::ColMajor, false, mN, 1, L.ptr(), mN, x.ptr(), mN) == 0;
+}
+
+template <typename T>
+T NormalEquationAccumulator<T>::residualNorm2(const DenseVector<T>& x) const
+{
+	reduce();
+	if( int(x.length()) != mN )
+	{
+		fail("NormalEquationAccumulator::residualNorm2 : input dimensions do not match");
+		return T(0);
+	}
+	// |A x - b|^2 = x'A'A x - 2 x'A'b + b'b
+	DenseVector<T> Ax(mN);
+	BlasBackend::gemv(BlasBackend::ColMajor, false, mN, mN, T(1), mAtA.ptr(), mN, x.ptr(), T(0), Ax.ptr());
+	return x.dot(Ax) - 2 * x.dot(mAtb) + mBtb;
+}
+}
@@ -1,7 +1,27 @@
 ﻿#include "../phgutils.h"
-#include "mkl.h"
+#include "BlasBackend.hpp"
 
 namespace PhGUtils {
+	// one Gauss-Newton update x -= delta * (J'J)^-1 J'r, J is n x m row major, i.e.
+	// row i holds the derivatives of r(i) with respect to the m parameters.
+	// JtJ (m x m) and deltaX (m) are workspace, deltaX returns the step
+	template <typename T>
+	void GaussNewtonStep(T *x, const T *r, const T *J, int m, int n, T delta, T *JtJ, T *deltaX)
+	{
+		// compute JtJ
+		BlasBackend::syrk(BlasBackend::ColMajor, true, false, m, n, T(1), J, m, T(0), JtJ, m);
+
+		// compute Jtr
+		BlasBackend::gemv(BlasBackend::ColMajor, false, m, n, T(1), J, m, r, T(0), deltaX);
+
+		// compute deltaX
+		BlasBackend::potrf(BlasBackend::ColMajor, true, m, JtJ, m);
+		BlasBackend::potrs(BlasBackend::ColMajor, true, m, 1, JtJ, m, deltaX, m);
+
+		// update x
+		BlasBackend::axpy(m, -delta, deltaX, x);
+	}
+
 	template <typename T>
 	int GaussNewton(
 		void (*func)(T *x, T *r, int m, int n, void *adata),
@@ -36,7 +56,7 @@ namespace PhGUtils {
 
 		T* deltaX = new T[m];	// also for Jtr
 		memset(deltaX, 0, sizeof(T)*m);
-		cblas_scopy(m, x, 1, deltaX, 1);
+		BlasBackend::copy(m, x, deltaX);
 
 		T* JtJ = new T[m * m];
 		memset(JtJ, 0, sizeof(T)*m*m);
@@ -63,12 +83,12 @@ namespace PhGUtils {
 		//printArray(r, n);
 
 		// do iteration
-		while( (cblas_snrm2(m, deltaX, 1) > DIFF_THRES && cblas_snrm2(n, r, 1) > R_THRES && iters < itmax) || iters < 1 ) {
+		while( (BlasBackend::nrm2(m, deltaX) > DIFF_THRES && BlasBackend::nrm2(n, r) > R_THRES && iters < itmax) || iters < 1 ) {
 			// compute Jacobian
 			jacf(x, J, m, n, adata);
 
 			// store old value
-			cblas_scopy(m, x, 1, x0, 1);
+			BlasBackend::copy(m, x, x0);
 
 			//ofstream fout1("J.txt");
 			//print2DArray(J, n, m, fout1);
@@ -76,26 +96,7 @@ namespace PhGUtils {
 
 			//::system("pause");
 
-			// compute JtJ
-			cblas_ssyrk (CblasColMajor, CblasUpper, CblasNoTrans, m, n, 1.0, J, m, 0, JtJ, m);
-
-			//ofstream fout("JtJ.txt");
-			//print2DArray(JtJ, m, m, fout);
-			//fout.close();
-
-			// compute Jtr
-			cblas_sgemv (CblasColMajor, CblasNoTrans, m, n, 1.0, J, m, r, 1, 0, deltaX, 1);
-			
-			// compute deltaX
-			LAPACKE_spotrf( LAPACK_COL_MAJOR, 'U', m, JtJ, m );
-			LAPACKE_spotrs( LAPACK_COL_MAJOR, 'U', m, 1, JtJ, m, deltaX, m );
-
-			//ofstream fout2("deltaX.txt");
-			//printArray(deltaX, m, fout2);
-			//fout2.close();
-
-			// update x
-			cblas_saxpy(m, -delta, deltaX, 1, x, 1);
+			GaussNewtonStep(x, r, J, m, n, T(delta), JtJ, deltaX);
 
 			// update residue
 			func(x, r, m, n, adata);
@@ -118,4 +119,37 @@ namespace PhGUtils {
 		return iters;
 	}
 
+	// GaussNewton with one callback that evaluates the residue r and the
+	// Jacobian J at x together, for models where both share their partial
+	// results, e.g. Tensor3::contractWithJacobian. J has the layout jacf uses
+	// above, and is evaluated once per iteration at the updated x
+	template <typename T>
+	int GaussNewton(
+		void (*funcjac)(T *x, T *r, T *J, int m, int n, void *adata),
+		T *x, T *r, T* J, int m, int n, int itmax, 
+		T *opts,	/* delta,  r_threshold, diff_threshold */
+		void *adata)
+	{
+		T delta = 1.0, R_THRES = 1e-6, DIFF_THRES = 1e-6;
+		if( opts != NULL ) {
+			delta = opts[0]; R_THRES = opts[1]; DIFF_THRES = opts[2];
+		}
+
+		vector<T> rbuf, Jbuf;
+		if( r == NULL ) { rbuf.resize(n); r = &rbuf[0]; }
+		if( J == NULL ) { Jbuf.resize(size_t(m) * n); J = &Jbuf[0]; }
+		vector<T> JtJ(size_t(m) * m), deltaX(x, x + m);
+
+		funcjac(x, r, J, m, n, adata);
+
+		int iters = 0;
+		while( (BlasBackend::nrm2(m, &deltaX[0]) > DIFF_THRES && BlasBackend::nrm2(n, r) > R_THRES && iters < itmax) || iters < 1 ) {
+			GaussNewtonStep(x, r, J, m, n, delta, &JtJ[0], &deltaX[0]);
+			funcjac(x, r, J, m, n, adata);
+			iters++;
+		}
+
+		return iters;
+	}
+
 }
\ No newline at end of file
@@ -0,0 +1,427 @@
+#pragma once
+
+#include "Tensor.hpp"
+#include "CpuFeatures.hpp"
+#include <cmath>
+#include <cstdint>
+
+// int8 kernels, the quantized operand is widened to float on load. The AVX2
+// versions are picked at run time when the CPU has AVX2 and FMA
+namespace QuantizedKernels {
+#if PHG_X86
+	PHG_TARGET("avx2,fma")
+	inline float dotAvx2(const int8_t* q, const float* b, int n) {
+		int i = 0;
+		__m256 acc = _mm256_setzero_ps();
+		for(;i+8<=n;i+=8) {
+			__m256 x = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(q + i))));
+			acc = _mm256_fmadd_ps(x, _mm256_loadu_ps(b + i), acc);
+		}
+		float lanes[8];
+		_mm256_storeu_ps(lanes, acc);
+		float sum = 0;
+		for(int l=0;l<8;l++) sum += lanes[l];
+		for(;i<n;i++) sum += float(q[i]) * b[i];
+		return sum;
+	}
+
+	PHG_TARGET("avx2,fma")
+	inline void axpyAvx2(float alpha, const int8_t* q, float* y, int n) {
+		int i = 0;
+		__m256 a = _mm256_set1_ps(alpha);
+		for(;i+8<=n;i+=8) {
+			__m256 x = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(q + i))));
+			_mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, x, _mm256_loadu_ps(y + i)));
+		}
+		for(;i<n;i++) y[i] += alpha * float(q[i]);
+	}
+#endif
+
+	// sum_i q(i) * b(i)
+	inline float dot(const int8_t* q, const float* b, int n) {
+#if PHG_X86
+		if( CpuFeatures::has(CpuFeatures::Avx2Fma) ) return dotAvx2(q, b, n);
+#endif
+		float sum = 0;
+		#pragma omp simd reduction(+:sum)
+		for(int i=0;i<n;i++) sum += float(q[i]) * b[i];
+		return sum;
+	}
+
+	// y += alpha * q
+	inline void axpy(float alpha, const int8_t* q, float* y, int n) {
+#if PHG_X86
+		if( CpuFeatures::has(CpuFeatures::Avx2Fma) ) { axpyAvx2(alpha, q, y, n); return; }
+#endif
+		#pragma omp simd
+		for(int i=0;i<n;i++) y[i] += alpha * float(q[i]);
+	}
+
+	inline float sum(const float* b, int n) {
+		float s = 0;
+		#pragma omp simd reduction(+:s)
+		for(int i=0;i<n;i++) s += b[i];
+		return s;
+	}
+}
+
+// accuracy of a quantized tensor against the tensor it was made from
+struct QuantizationReport {
+	double maxAbsError;
+	double rmsError;
+	double relativeError;		// ||T - Q||_F / ||T||_F
+	double sqnr;				// signal to quantization noise ratio, in dB
+	size_t originalBytes;
+	size_t quantizedBytes;		// values plus scales and zero points
+
+	void print() const {
+		cout << "max abs error = " << maxAbsError
+			 << ", rms error = " << rmsError
+			 << ", relative error = " << relativeError
+			 << ", sqnr = " << sqnr << " dB"
+			 << ", size = " << quantizedBytes << " / " << originalBytes << " bytes" << endl;
+	}
+};
+
+// Order 3 tensor stored as int8 with an affine map per group of elements,
+// T(i, j, k) ~ scale * (q(i, j, k) - zero). A group is either one mode-2
+// fiber or one mode-0 slice. Same row major layout as Tensor3, and the vector
+// mode products and contractions run on the int8 values directly, the scale
+// and zero point are applied once per fiber instead of per element.
+class QuantizedTensor3
+{
+public:
+	enum Granularity {
+		PER_FIBER,		// one scale per mode-2 fiber T(i, j, :)
+		PER_SLICE		// one scale per mode-0 slice T(i, :, :)
+	};
+
+	QuantizedTensor3(void):granularity(PER_FIBER),data(nullptr){
+		d[0] = d[1] = d[2] = 0;
+	}
+	template <typename T>
+	QuantizedTensor3(const Tensor3<T>& t, Granularity g = PER_FIBER, QuantizationReport* report = nullptr):data(nullptr){
+		d[0] = d[1] = d[2] = 0;
+		quantize(t, g, report);
+	}
+	QuantizedTensor3(const QuantizedTensor3& other):data(nullptr) {
+		d[0] = d[1] = d[2] = 0;
+		(*this) = other;
+	}
+	QuantizedTensor3(QuantizedTensor3&& other):data(nullptr) {
+		d[0] = d[1] = d[2] = 0;
+		(*this) = std::move(other);
+	}
+	~QuantizedTensor3(void){
+		TensorStorage::release(data);
+	}
+
+	QuantizedTensor3& operator=(const QuantizedTensor3& other) {
+		if( this != &other ) {
+			resize(other.d[0], other.d[1], other.d[2], other.granularity);
+			memcpy(data, other.data, size());
+			scales = other.scales;
+			zeros = other.zeros;
+		}
+		return (*this);
+	}
+
+	QuantizedTensor3& operator=(QuantizedTensor3&& other) {
+		if( this != &other ) {
+			TensorStorage::release(data);
+			d[0] = other.d[0]; d[1] = other.d[1]; d[2] = other.d[2];
+			granularity = other.granularity;
+			data = other.data;
+			scales.swap(other.scales);
+			zeros.swap(other.zeros);
+			other.data = nullptr;
+			other.d[0] = other.d[1] = other.d[2] = 0;
+		}
+		return (*this);
+	}
+
+	// quantize t, the error report is filled if one is given
+	template <typename T>
+	void quantize(const Tensor3<T>& t, Granularity g = PER_FIBER, QuantizationReport* report = nullptr) {
+		resize(t.dim(0), t.dim(1), t.dim(2), g);
+		const T* src = t.rawptr();
+		int ngroups = groups();
+		size_t glen = groupSize();
+
+		// error sums per group, added up in order afterwards
+		vector<double> err2(ngroups), sig2(ngroups), errmax(ngroups);
+
+		#pragma omp parallel for num_threads(TensorThreads::get())
+		for(int gi=0;gi<ngroups;gi++) {
+			const T* x = src + gi * glen;
+			int8_t* q = data + gi * glen;
+
+			// the range always includes 0 so that zeros stay exact
+			float lo = 0, hi = 0;
+			for(size_t e=0;e<glen;e++) {
+				float v = float(x[e]);
+				lo = min(lo, v); hi = max(hi, v);
+			}
+			float scale = (hi - lo) / 255.0f;
+			int zero = 0;
+			if( scale > 0 ) zero = clamp(int(lround(-128.0 - lo / scale)));
+			else scale = 1.0f;
+			scales[gi] = scale;
+			zeros[gi] = zero;
+
+			double e2 = 0, s2 = 0, em = 0;
+			for(size_t e=0;e<glen;e++) {
+				float v = float(x[e]);
+				q[e] = int8_t(clamp(int(lround(v / scale)) + zero));
+				double err = double(v) - double(scale) * (int(q[e]) - zero);
+				e2 += err * err; s2 += double(v) * v; em = max(em, fabs(err));
+			}
+			err2[gi] = e2; sig2[gi] = s2; errmax[gi] = em;
+		}
+
+		if( report ) {
+			double e2 = 0, s2 = 0, em = 0;
+			for(int gi=0;gi<ngroups;gi++) {
+				e2 += err2[gi]; s2 += sig2[gi]; em = max(em, errmax[gi]);
+			}
+			report->maxAbsError = em;
+			report->rmsError = size() ? sqrt(e2 / size()) : 0;
+			report->relativeError = s2 > 0 ? sqrt(e2 / s2) : 0;
+			report->sqnr = e2 > 0 ? 10.0 * log10(s2 / e2) : HUGE_VAL;
+			report->originalBytes = sizeof(T) * size();
+			report->quantizedBytes = bytes();
+		}
+	}
+
+	// back to floating point
+	template <typename T>
+	Tensor3<T> dequantize() const {
+		Tensor3<T> t(d[0], d[1], d[2]);
+		T* dst = t.rawptr();
+		int ngroups = groups();
+		size_t glen = groupSize();
+		#pragma omp parallel for num_threads(TensorThreads::get())
+		for(int gi=0;gi<ngroups;gi++) {
+			for(size_t e=gi*glen;e<(gi+1)*glen;e++) dst[e] = T(scales[gi] * (int(data[e]) - zeros[gi]));
+		}
+		return t;
+	}
+
+	float operator()(int i, int j, int k) const {
+		int gi = group(i, j);
+		return scales[gi] * (int(data[(size_t(i) * d[1] + j) * d[2] + k]) - zeros[gi]);
+	}
+
+	// mode product with a vector, same conventions as Tensor3::modeProduct.
+	// Each output element is summed in a fixed order by one thread
+	int modeProduct(const Tensor1<float>& v, int mid, Tensor2<float>& t2) const {
+		const float* pv = v.rawptr();
+		float* out = t2.rawptr();
+		int nthreads = TensorThreads::get();
+
+		switch( mid ) {
+		case 0:
+			{
+				assert(v.length() == d[0]);
+				assert(t2.dim(0) == d[1] && t2.dim(1) == d[2]);
+
+				// row j of t2 = sum_i v(i) * scale_ij * (q(i, j, :) - zero_ij)
+				#pragma omp parallel for num_threads(nthreads) schedule(static)
+				for(int j=0;j<d[1];j++) {
+					float* dst = out + j * d[2];
+					memset(dst, 0, sizeof(float) * d[2]);
+					float offset = 0;
+					for(int i=0;i<d[0];i++) {
+						int gi = group(i, j);
+						float a = pv[i] * scales[gi];
+						QuantizedKernels::axpy(a, fiber(i, j), dst, d[2]);
+						offset += a * zeros[gi];
+					}
+					for(int k=0;k<d[2];k++) dst[k] -= offset;
+				}
+				return 0;
+			}
+		case 1:
+			{
+				assert(v.length() == d[1]);
+				assert(t2.dim(0) == d[0] && t2.dim(1) == d[2]);
+
+				#pragma omp parallel for num_threads(nthreads) schedule(static)
+				for(int i=0;i<d[0];i++) {
+					float* dst = out + i * d[2];
+					memset(dst, 0, sizeof(float) * d[2]);
+					float offset = 0;
+					for(int j=0;j<d[1];j++) {
+						int gi = group(i, j);
+						float a = pv[j] * scales[gi];
+						QuantizedKernels::axpy(a, fiber(i, j), dst, d[2]);
+						offset += a * zeros[gi];
+					}
+					for(int k=0;k<d[2];k++) dst[k] -= offset;
+				}
+				return 0;
+			}
+		case 2:
+			{
+				assert(v.length() == d[2]);
+				assert(t2.dim(0) == d[0] && t2.dim(1) == d[1]);
+
+				// scale * (q . v - zero * sum(v)) per fiber
+				float vsum = QuantizedKernels::sum(pv, d[2]);
+				int n = d[0] * d[1];
+				#pragma omp parallel for num_threads(nthreads) schedule(static)
+				for(int r=0;r<n;r++) {
+					int gi = group(r / d[1], r % d[1]);
+					out[r] = scales[gi] * (QuantizedKernels::dot(data + size_t(r) * d[2], pv, d[2]) - zeros[gi] * vsum);
+				}
+				return 0;
+			}
+		default:
+			throw "Invalid mode!";
+		}
+	}
+
+	Tensor2<float> modeProduct(const Tensor1<float>& v, int mid) const {
+		Tensor2<float> t2;
+		switch( mid ) {
+		case 0:
+			t2.resize(d[1], d[2]);
+			break;
+		case 1:
+			t2.resize(d[0], d[2]);
+			break;
+		case 2:
+			t2.resize(d[0], d[1]);
+			break;
+		default:
+			throw "Invalid mode!";
+		}
+		modeProduct(v, mid, t2);
+		return t2;
+	}
+
+	// fused contraction of the two modes other than mid, same conventions as
+	// Tensor3::contract, out must hold dim(mid) elements
+	int contract(const Tensor1<float>& w0, const Tensor1<float>& w1, int mid, float* out) const {
+		int nthreads = TensorThreads::get();
+
+		switch( mid ) {
+		case 0:
+		case 1:
+			{
+				// out(a) = sum_b w(b) * scale_ab * (q(a, b, :) . w2 - zero_ab * sum(w2))
+				// with (a, b) = (i, j) for mid 0 and (j, i) for mid 1
+				assert(w0.length() == d[1-mid] && w1.length() == d[2]);
+				const float* pw0 = w0.rawptr();
+				const float* pw1 = w1.rawptr();
+				float wsum = QuantizedKernels::sum(pw1, d[2]);
+				int n = d[mid], m = d[1-mid];
+
+				#pragma omp parallel for num_threads(nthreads) schedule(static)
+				for(int a=0;a<n;a++) {
+					float val = 0;
+					for(int b=0;b<m;b++) {
+						int i = (mid == 0)?a:b, j = (mid == 0)?b:a;
+						int gi = group(i, j);
+						val += pw0[b] * scales[gi] * (QuantizedKernels::dot(fiber(i, j), pw1, d[2]) - zeros[gi] * wsum);
+					}
+					out[a] = val;
+				}
+				return 0;
+			}
+		case 2:
+			{
+				// out = sum_ij w0(i) w1(j) scale_ij (q(i, j, :) - zero_ij), split
+				// over blocks of slices summed in order afterwards like Tensor3::contract
+				assert(w0.length() == d[0] && w1.length() == d[1]);
+				const float* pw0 = w0.rawptr();
+				const float* pw1 = w1.rawptr();
+				const int BLOCK = 64;
+				int n = d[2];
+				int nblocks = (d[0] + BLOCK - 1) / BLOCK;
+				vector<float> partial(size_t(nblocks) * n, 0.0f);
+				vector<float> offsets(nblocks, 0.0f);
+
+				#pragma omp parallel for num_threads(nthreads)
+				for(int b=0;b<nblocks;b++) {
+					float* pb = &partial[size_t(b) * n];
+					int iend = min(d[0], (b + 1) * BLOCK);
+					for(int i=b*BLOCK;i<iend;i++) {
+						for(int j=0;j<d[1];j++) {
+							int gi = group(i, j);
+							float a = pw0[i] * pw1[j] * scales[gi];
+							QuantizedKernels::axpy(a, fiber(i, j), pb, n);
+							offsets[b] += a * zeros[gi];
+						}
+					}
+				}
+
+				float offset = 0;
+				memset(out, 0, sizeof(float) * n);
+				for(int b=0;b<nblocks;b++) {
+					TensorKernels::axpy(1.0f, &partial[size_t(b) * n], out, n);
+					offset += offsets[b];
+				}
+				for(int k=0;k<n;k++) out[k] -= offset;
+				return 0;
+			}
+		default:
+			throw "Invalid mode!";
+		}
+	}
+
+	int contract(const Tensor1<float>& w0, const Tensor1<float>& w1, int mid, Tensor1<float>& t1) const {
+		assert(t1.length() == d[mid]);
+		return contract(w0, w1, mid, t1.rawptr());
+	}
+
+	Tensor1<float> contract(const Tensor1<float>& w0, const Tensor1<float>& w1, int mid) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		Tensor1<float> t1(d[mid]);
+		contract(w0, w1, mid, t1.rawptr());
+		return t1;
+	}
+
+	int dim(int mid) const { return d[mid]; }
+	size_t size() const { return size_t(d[0]) * d[1] * d[2]; }
+	Granularity quantization() const { return granularity; }
+	int groups() const { return (granularity == PER_FIBER)?(d[0] * d[1]):d[0]; }
+	size_t groupSize() const { return (granularity == PER_FIBER)?size_t(d[2]):size_t(d[1]) * d[2]; }
+
+	// resident size of the values, scales and zero points
+	size_t bytes() const { return size() + scales.size() * (sizeof(float) + sizeof(int)); }
+
+	const int8_t* rawptr() const { return data; }
+	const float* scaleptr() const { return scales.data(); }
+	const int* zeroptr() const { return zeros.data(); }
+
+private:
+	void resize(int l, int m, int n, Granularity g) {
+		TensorStorage::reserve(data, size_t(l) * m * n);
+		d[0] = l; d[1] = m; d[2] = n;
+		granularity = g;
+		scales.resize(groups());
+		zeros.resize(groups());
+	}
+
+	int group(int i, int j) const {
+		return (granularity == PER_FIBER)?(i * d[1] + j):i;
+	}
+
+	const int8_t* fiber(int i, int j) const {
+		return data + (size_t(i) * d[1] + j) * d[2];
+	}
+
+	static int clamp(int q) {
+		return max(-128, min(127, q));
+	}
+
+private:
+	int d[3];
+	Granularity granularity;
+
+	// row major int8 values, one scale and zero point per group
+	int8_t* data;
+	vector<float> scales;
+	vector<int> zeros;
+};
@@ -0,0 +1,553 @@
+#pragma once
+
+#include "MatrixBase.hpp"
+#include "DenseMatrix.hpp"
+#include "DenseVector.hpp"
+#include "DenseView.hpp"
+#include "../Utils/utility.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace PhGUtils {
+/// one entry of a sparse matrix in coordinate form
+template <typename T>
+struct SparseTriplet
+{
+	SparseTriplet(){}
+	SparseTriplet(int r, int c, T v):row(r),col(c),value(v){}
+
+	int row, col;
+	T value;
+};
+
+/// compressed sparse matrix in CSR or CSC format
+///
+/// CSR stores the matrix row by row: the entries of row i are
+/// mValues[mOuter[i] .. mOuter[i+1]) with their column indices in mInner.
+/// CSC is the same with rows and columns swapped, so the CSC arrays of A are
+/// the CSR arrays of A'. Indices within a row (column) are sorted and unique.
+template <typename T>
+class SparseMatrix : public MatrixBase<T>
+{
+public:
+	typedef typename MatrixBase<T>::elem_t elem_t;
+	typedef typename MatrixBase<T>::idx_t idx_t;
+	typedef typename MatrixBase<T>::MatrixFormat MatrixFormat;
+	typedef SparseTriplet<T> triplet_t;
+
+public:
+	/// general constructors, the matrix is empty, i.e. all zeros
+	SparseMatrix();
+	SparseMatrix(size_t numRows, size_t numCols, MatrixFormat format = MatrixBase<T>::CSR);
+
+	/// build from triplets, entries at the same position are summed
+	static SparseMatrix fromTriplets(size_t numRows, size_t numCols, const vector<triplet_t>& triplets,
+		MatrixFormat format = MatrixBase<T>::CSR);
+	void setFromTriplets(const vector<triplet_t>& triplets);
+
+	/// conversions
+	SparseMatrix toFormat(MatrixFormat format) const;
+	SparseMatrix transposed() const;
+	DenseMatrix<T> toDense() const;
+
+	/// products
+	/// y = alpha * A * x + beta * y
+	void multiply(const DenseVectorView<const T>& x, const DenseVectorView<T>& y, T alpha = 1, T beta = 0) const;
+	/// y = alpha * A' * x + beta * y
+	void multiplyTransposed(const DenseVectorView<const T>& x, const DenseVectorView<T>& y, T alpha = 1, T beta = 0) const;
+	/// Y = alpha * A * X + beta * Y, X and Y are dense column major blocks
+	void multiply(const DenseMatrixView<const T>& X, const DenseMatrixView<T>& Y, T alpha = 1, T beta = 0) const;
+	/// A' * A as a symmetric sparse matrix in CSR format
+	SparseMatrix AtA() const;
+
+	template <typename MT, typename VT>
+	friend DenseVector<VT> operator*(const SparseMatrix<MT>&, const DenseVector<VT>&);
+
+	/// value of entry (i, j), zero when it is not stored
+	T coeff(idx_t i, idx_t j) const;
+	/// stored entry (i, j) for writing, throws when (i, j) is not stored
+	T& coeffRef(idx_t i, idx_t j);
+
+	/// element accessors, the const one reads any entry, the other one is coeffRef
+	virtual const T& operator()(idx_t i, idx_t j) const;
+	virtual T& operator()(idx_t i, idx_t j) { return coeffRef(i, j); }
+
+	virtual const size_t& rows() const;
+	virtual const size_t& cols() const;
+	size_t nonZeros() const { return mValues.size(); }
+
+	/// raw compressed arrays, e.g. for an external sparse BLAS
+	const size_t* outerIndex() const { return &mOuter[0]; }
+	const int* innerIndex() const { return mInner.empty() ? nullptr : &mInner[0]; }
+	T* valuePtr() { return mValues.empty() ? nullptr : &mValues[0]; }
+	const T* valuePtr() const { return mValues.empty() ? nullptr : &mValues[0]; }
+
+	/// misc operations
+	virtual bool isValid() const;
+	virtual void print(const string& title = "", ostream& os = std::cout) const;
+
+private:
+	bool isRowMajor() const { return this->mFormat == MatrixBase<T>::CSR; }
+	size_t outerSize() const { return isRowMajor() ? mRows : mCols; }
+	size_t innerSize() const { return isRowMajor() ? mCols : mRows; }
+	long long find(idx_t i, idx_t j) const;
+
+private:
+	size_t mRows, mCols;
+	vector<size_t> mOuter;
+	vector<int> mInner;
+	vector<T> mValues;
+};
+
+namespace SparseKernels {
+	const size_t PARALLEL_NNZ = 65536;	// smallest product worth a thread team
+
+	inline int threads(size_t work) {
+#ifdef _OPENMP
+		return (work > PARALLEL_NNZ) ? omp_get_max_threads() : 1;
+#else
+		return 1;
+#endif
+	}
+
+	// y(o) = beta * y(o) + alpha * sum over the entries of outer slice o
+	template <typename T>
+	void gather(size_t nouter, const size_t* outer, const int* inner, const T* values,
+		const DenseVectorView<const T>& x, const DenseVectorView<T>& y, T alpha, T beta)
+	{
+		#pragma omp parallel for schedule(dynamic, 256) num_threads(threads(outer[nouter]))
+		for(long long o=0;o<(long long)nouter;o++) {
+			T s = 0;
+			for(size_t k=outer[o];k<outer[o+1];k++) s += values[k] * x(inner[k]);
+			y(o) = (beta == T(0)) ? alpha * s : alpha * s + beta * y(o);
+		}
+	}
+
+	// y(inner) += alpha * value * x(o), the slices write to overlapping parts
+	// of y so every thread sums into its own copy and the copies are added up
+	template <typename T>
+	void scatter(size_t nouter, size_t ninner, const size_t* outer, const int* inner, const T* values,
+		const DenseVectorView<const T>& x, const DenseVectorView<T>& y, T alpha, T beta)
+	{
+		if( beta == T(0) ) y.fill(0);
+		else if( beta != T(1) ) for(size_t i=0;i<ninner;i++) y(i) *= beta;
+
+		int nt = threads(outer[nouter]);
+		if( nt == 1 ) {
+			for(size_t o=0;o<nouter;o++) {
+				T xo = alpha * x(o);
+				for(size_t k=outer[o];k<outer[o+1];k++) y(inner[k]) += values[k] * xo;
+			}
+			return;
+		}
+
+		vector<T> partial(size_t(nt) * ninner, T(0));
+		#pragma omp parallel num_threads(nt)
+		{
+#ifdef _OPENMP
+			T* acc = &partial[size_t(omp_get_thread_num()) * ninner];
+#else
+			T* acc = &partial[0];
+#endif
+			#pragma omp for schedule(static)
+			for(long long o=0;o<(long long)nouter;o++) {
+				T xo = alpha * x(o);
+				for(size_t k=outer[o];k<outer[o+1];k++) acc[inner[k]] += values[k] * xo;
+			}
+
+			#pragma omp for schedule(static)
+			for(long long i=0;i<(long long)ninner;i++) {
+				T s = 0;
+				for(int t=0;t<nt;t++) s += partial[size_t(t) * ninner + i];
+				y(i) += s;
+			}
+		}
+	}
+}
+
+template <typename T>
+SparseMatrix<T>::SparseMatrix():
+	MatrixBase<T>(MatrixBase<T>::Sparse, MatrixBase<T>::CSR),
+	mRows(0),
+	mCols(0),
+	mOuter(1, 0)
+{
+	this->mSymmetric = false;
+}
+
+template <typename T>
+SparseMatrix<T>::SparseMatrix(size_t numRows, size_t numCols, MatrixFormat format):
+	MatrixBase<T>(MatrixBase<T>::Sparse, format),
+	mRows(numRows),
+	mCols(numCols)
+{
+	if( format != MatrixBase<T>::CSR && format != MatrixBase<T>::CSC )
+	{
+		fail("SparseMatrix : only CSR and CSC are supported, using CSR");
+		this->mFormat = MatrixBase<T>::CSR;
+	}
+	this->mSymmetric = false;
+	mOuter.assign(outerSize() + 1, 0);
+}
+
+template <typename T>
+SparseMatrix<T> SparseMatrix<T>::fromTriplets(size_t numRows, size_t numCols, const vector<triplet_t>& triplets,
+	MatrixFormat format)
+{
+	SparseMatrix<T> mat(numRows, numCols, format);
+	mat.setFromTriplets(triplets);
+	return mat;
+}
+
+template <typename T>
+void SparseMatrix<T>::setFromTriplets(const vector<triplet_t>& triplets)
+{
+	bool rowMajor = isRowMajor();
+	size_t nouter = outerSize();
+
+	// bucket the triplets by outer index
+	vector<size_t> count(nouter + 1, 0);
+	for(size_t t=0;t<triplets.size();t++)
+	{
+		const triplet_t& e = triplets[t];
+		if( e.row < 0 || size_t(e.row) >= mRows || e.col < 0 || size_t(e.col) >= mCols )
+		{
+			fail("SparseMatrix::setFromTriplets : index out of range");
+			mOuter.assign(nouter + 1, 0);
+			mInner.clear();
+			mValues.clear();
+			return;
+		}
+		count[(rowMajor ? e.row : e.col) + 1]++;
+	}
+	for(size_t o=0;o<nouter;o++) count[o+1] += count[o];
+
+	vector<int> inner(triplets.size());
+	vector<T> values(triplets.size());
+	{
+		vector<size_t> pos(count.begin(), count.end() - 1);
+		for(size_t t=0;t<triplets.size();t++)
+		{
+			const triplet_t& e = triplets[t];
+			size_t p = pos[rowMajor ? e.row : e.col]++;
+			inner[p] = rowMajor ? e.col : e.row;
+			values[p] = e.value;
+		}
+	}
+
+	// sort every slice and merge duplicates in place
+	vector<size_t> unique(nouter + 1, 0);
+	#pragma omp parallel for schedule(dynamic, 256) num_threads(SparseKernels::threads(triplets.size()))
+	for(long long o=0;o<(long long)nouter;o++)
+	{
+		size_t b = count[o], e = count[o+1];
+		vector<pair<int, T>> slice(e - b);
+		for(size_t k=b;k<e;k++) slice[k-b] = make_pair(inner[k], values[k]);
+		stable_sort(slice.begin(), slice.end(),
+			[](const pair<int, T>& x, const pair<int, T>& y) { return x.first < y.first; });
+		size_t n = 0;
+		for(size_t k=0;k<slice.size();k++)
+		{
+			if( n > 0 && inner[b+n-1] == slice[k].first ) values[b+n-1] += slice[k].second;
+			else
+			{
+				inner[b+n] = slice[k].first;
+				values[b+n] = slice[k].second;
+				n++;
+			}
+		}
+		unique[o+1] = n;
+	}
+
+	mOuter.assign(nouter + 1, 0);
+	for(size_t o=0;o<nouter;o++) mOuter[o+1] = mOuter[o] + unique[o+1];
+	mInner.resize(mOuter[nouter]);
+	mValues.resize(mOuter[nouter]);
+	for(size_t o=0;o<nouter;o++)
+	{
+		size_t n = unique[o+1];
+		copy(inner.begin() + count[o], inner.begin() + count[o] + n, mInner.begin() + mOuter[o]);
+		copy(values.begin() + count[o], values.begin() + count[o] + n, mValues.begin() + mOuter[o]);
+	}
+}
+
+template <typename T>
+SparseMatrix<T> SparseMatrix<T>::transposed() const
+{
+	// the CSR arrays of A are the CSC arrays of A'
+	SparseMatrix<T> result(*this);
+	result.mRows = mCols;
+	result.mCols = mRows;
+	result.mFormat = isRowMajor() ? MatrixBase<T>::CSC : MatrixBase<T>::CSR;
+	return result;
+}
+
+template <typename T>
+SparseMatrix<T> SparseMatrix<T>::toFormat(MatrixFormat format) const
+{
+	if( format == this->mFormat ) return (*this);
+	if( format != MatrixBase<T>::CSR && format != MatrixBase<T>::CSC )
+	{
+		fail("SparseMatrix::toFormat : only CSR and CSC are supported");
+		return (*this);
+	}
+
+	// counting sort of the entries by inner index, which keeps the new inner
+	// indices sorted since the old outer slices are visited in order
+	SparseMatrix<T> result(mRows, mCols, format);
+	size_t nouter = outerSize(), ninner = innerSize();
+	vector<size_t>& outer = result.mOuter;
+	for(size_t k=0;k<mInner.size();k++) outer[mInner[k] + 1]++;
+	for(size_t i=0;i<ninner;i++) outer[i+1] += outer[i];
+
+	result.mInner.resize(mInner.size());
+	result.mValues.resize(mValues.size());
+	vector<size_t> pos(outer.begin(), outer.end() - 1);
+	for(size_t o=0;o<nouter;o++)
+	{
+		for(size_t k=mOuter[o];k<mOuter[o+1];k++)
+		{
+			size_t p = pos[mInner[k]]++;
+			result.mInner[p] = int(o);
+			result.mValues[p] = mValues[k];
+		}
+	}
+	result.mSymmetric = this->mSymmetric;
+	return result;
+}
+
+template <typename T>
+DenseMatrix<T> SparseMatrix<T>::toDense() const
+{
+	DenseMatrix<T> result(mRows, mCols);
+	for(size_t o=0;o<outerSize();o++)
+	{
+		for(size_t k=mOuter[o];k<mOuter[o+1];k++)
+		{
+			if( isRowMajor() ) result(o, mInner[k]) = mValues[k];
+			else result(mInner[k], o) = mValues[k];
+		}
+	}
+	return result;
+}
+
+template <typename T>
+void SparseMatrix<T>::multiply(const DenseVectorView<const T>& x, const DenseVectorView<T>& y, T alpha, T beta) const
+{
+	if( x.length() != mCols || y.length() != mRows )
+	{
+		fail("SparseMatrix::multiply : input dimensions do not match");
+		return;
+	}
+	if( isRowMajor() ) SparseKernels::gather(mRows, &mOuter[0], innerIndex(), valuePtr(), x, y, alpha, beta);
+	else SparseKernels::scatter(mCols, mRows, &mOuter[0], innerIndex(), valuePtr(), x, y, alpha, beta);
+}
+
+template <typename T>
+void SparseMatrix<T>::multiplyTransposed(const DenseVectorView<const T>& x, const DenseVectorView<T>& y, T alpha, T beta) const
+{
+	if( x.length() != mRows || y.length() != mCols )
+	{
+		fail("SparseMatrix::multiplyTransposed : input dimensions do not match");
+		return;
+	}
+	if( isRowMajor() ) SparseKernels::scatter(mRows, mCols, &mOuter[0], innerIndex(), valuePtr(), x, y, alpha, beta);
+	else SparseKernels::gather(mCols, &mOuter[0], innerIndex(), valuePtr(), x, y, alpha, beta);
+}
+
+template <typename T>
+void SparseMatrix<T>::multiply(const DenseMatrixView<const T>& X, const DenseMatrixView<T>& Y, T alpha, T beta) const
+{
+	if( X.rows() != mCols || Y.rows() != mRows || X.cols() != Y.cols() )
+	{
+		fail("SparseMatrix::multiply : input dimensions do not match");
+		return;
+	}
+	if( !isRowMajor() )
+	{
+		for(size_t c=0;c<X.cols();c++) multiply(X.col(c), Y.col(c), alpha, beta);
+		return;
+	}
+
+	// row by row, every entry of A is read once for all columns of X
+	size_t ncols = X.cols();
+	#pragma omp parallel for schedule(dynamic, 256) num_threads(SparseKernels::threads(nonZeros() * ncols))
+	for(long long r=0;r<(long long)mRows;r++)
+	{
+		for(size_t c=0;c<ncols;c++)
+		{
+			const T* x = X.ptr() + c * X.ld();
+			T s = 0;
+			for(size_t k=mOuter[r];k<mOuter[r+1];k++) s += mValues[k] * x[mInner[k]];
+			T& y = Y(r, c);
+			y = (beta == T(0)) ? alpha * s : alpha * s + beta * y;
+		}
+	}
+}
+
+template <typename T>
+SparseMatrix<T> SparseMatrix<T>::AtA() const
+{
+	// row i of A'A = sum over the entries A(k, i) of column i of A(k, i) * row k,
+	// Gustavson style with a dense accumulator per thread; a symbolic pass
+	// counts the entries of every row so both passes can run in parallel
+	SparseMatrix<T> a = toFormat(MatrixBase<T>::CSR), at = toFormat(MatrixBase<T>::CSC);
+	size_t n = mCols;
+	SparseMatrix<T> result(n, n, MatrixBase<T>::CSR);
+	result.mSymmetric = true;
+	int nt = SparseKernels::threads(nonZeros() * 4);
+
+	vector<size_t> count(n + 1, 0);
+	#pragma omp parallel num_threads(nt)
+	{
+		vector<long long> marker(n, -1);
+		#pragma omp for schedule(dynamic, 64)
+		for(long long i=0;i<(long long)n;i++)
+		{
+			size_t c = 0;
+			for(size_t p=at.mOuter[i];p<at.mOuter[i+1];p++)
+			{
+				int k = at.mInner[p];
+				for(size_t q=a.mOuter[k];q<a.mOuter[k+1];q++)
+				{
+					int j = a.mInner[q];
+					if( marker[j] != i ) { marker[j] = i; c++; }
+				}
+			}
+			count[i+1] = c;
+		}
+	}
+
+	for(size_t i=0;i<n;i++) count[i+1] += count[i];
+	result.mOuter = count;
+	result.mInner.resize(count[n]);
+	result.mValues.resize(count[n]);
+
+	#pragma omp parallel num_threads(nt)
+	{
+		vector<T> acc(n, T(0));
+		vector<long long> marker(n, -1);
+		#pragma omp for schedule(dynamic, 64)
+		for(long long i=0;i<(long long)n;i++)
+		{
+			int* idx = result.mInner.empty() ? nullptr : &result.mInner[count[i]];
+			size_t c = 0;
+			for(size_t p=at.mOuter[i];p<at.mOuter[i+1];p++)
+			{
+				int k = at.mInner[p];
+				T aki = at.mValues[p];
+				for(size_t q=a.mOuter[k];q<a.mOuter[k+1];q++)
+				{
+					int j = a.mInner[q];
+					if( marker[j] != i ) { marker[j] = i; idx[c++] = j; }
+					acc[j] += aki * a.mValues[q];
+				}
+			}
+			sort(idx, idx + c);
+			for(size_t t=0;t<c;t++)
+			{
+				result.mValues[count[i] + t] = acc[idx[t]];
+				acc[idx[t]] = T(0);
+			}
+		}
+	}
+	return result;
+}
+
+template <typename MT, typename T>
+DenseVector<T> operator*(const SparseMatrix<MT>& m, const DenseVector<T>& v) {
+	// check if the dimension matches
+	if( !m.isValid() || !v.isValid() )
+	{
+		fail("SparseMatrix::operator* : input is invalid!");
+		return DenseVector<T>();
+	}
+	else if( v.length() != m.cols() )
+	{
+		fail("SparseMatrix::operator* : input dimensions do not match");
+		return DenseVector<T>();
+	}
+	else
+	{
+		DenseVector<T> result(m.rows());
+		m.multiply(v.view(), result.view());
+		return result;
+	}
+}
+
+template <typename T>
+long long SparseMatrix<T>::find(idx_t i, idx_t j) const
+{
+	size_t o = isRowMajor() ? i : j;
+	int in = int(isRowMajor() ? j : i);
+	const int* b = innerIndex() + mOuter[o];
+	const int* e = innerIndex() + mOuter[o+1];
+	const int* p = lower_bound(b, e, in);
+	return (p != e && *p == in) ? (long long)(p - innerIndex()) : -1;
+}
+
+template <typename T>
+const T& SparseMatrix<T>::operator()(idx_t i, idx_t j) const
+{
+	static const T zero = T(0);
+	long long k = find(i, j);
+	return (k >= 0) ? mValues[k] : zero;
+}
+
+template <typename T>
+T SparseMatrix<T>::coeff(idx_t i, idx_t j) const
+{
+	long long k = find(i, j);
+	return (k >= 0) ? mValues[k] : T(0);
+}
+
+template <typename T>
+T& SparseMatrix<T>::coeffRef(idx_t i, idx_t j)
+{
+	long long k = find(i, j);
+	// zeros have no storage to refer to, and inserting would change the pattern
+	if( k < 0 ) throw "SparseMatrix::coeffRef : entry is not stored";
+	return mValues[k];
+}
+
+template <typename T>
+const size_t& SparseMatrix<T>::rows() const
+{
+	return mRows;
+}
+
+template <typename T>
+const size_t& SparseMatrix<T>::cols() const
+{
+	return mCols;
+}
+
+template <typename T>
+bool SparseMatrix<T>::isValid() const
+{
+	return (mRows > 0) && (mCols > 0) && (mOuter.size() == outerSize() + 1);
+}
+
+template <typename T>
+void SparseMatrix<T>::print(const string& title, ostream& os) const
+{
+	if( title != "" )
+		os << title << " = " << std::endl;
+
+	os << mRows << " x " << mCols << ", " << nonZeros() << " nonzeros, "
+		<< (isRowMajor() ? "CSR" : "CSC") << std::endl;
+
+	for(size_t o=0;o<outerSize();o++)
+	{
+		for(size_t k=mOuter[o];k<mOuter[o+1];k++)
+		{
+			size_t r = isRowMajor() ? o : mInner[k], c = isRowMajor() ? mInner[k] : o;
+			os << "(" << r << ", " << c << ")\t" << mValues[k] << std::endl;
+		}
+	}
+}
+
+typedef SparseMatrix<float> SparseMatrixf;
+typedef SparseMatrix<double> SparseMatrixd;
+}
@@ -0,0 +1,619 @@
+#pragma once
+
+#include "SparseMatrix.hpp"
+
+namespace PhGUtils {
+// Solvers for sparse symmetric positive definite systems, e.g. normal
+// equations A'A x = A'b built with SparseMatrix::AtA. The matrices have to
+// store both triangles, as AtA does; since they are symmetric the compressed
+// arrays read the same as CSR or CSC.
+
+namespace SparseOrdering {
+	// reverse Cuthill-McKee: breadth first from a pseudo-peripheral vertex,
+	// neighbours by increasing degree, then reversed. Keeps the profile and
+	// with it the fill of a Cholesky factor small on mesh-like problems
+	inline vector<int> reverseCuthillMcKee(int n, const size_t* outer, const int* inner) {
+		vector<int> order, degree(n), level(n);
+		order.reserve(n);
+		vector<bool> visited(n, false);
+		for(int i=0;i<n;i++) degree[i] = int(outer[i+1] - outer[i]);
+
+		// the vertices of a breadth first search from root, the last one is
+		// in the last level
+		auto bfs = [&](int root, vector<int>& out, vector<bool>& seen, bool sorted) {
+			size_t head = out.size();
+			out.push_back(root);
+			seen[root] = true;
+			level[root] = 0;
+			while( head < out.size() ) {
+				int v = out[head++];
+				size_t first = out.size();
+				for(size_t p=outer[v];p<outer[v+1];p++) {
+					int u = inner[p];
+					if( !seen[u] ) {
+						seen[u] = true;
+						level[u] = level[v] + 1;
+						out.push_back(u);
+					}
+				}
+				if( sorted ) sort(out.begin() + first, out.end(), [&](int a, int b) { return degree[a] < degree[b]; });
+			}
+		};
+
+		for(int start=0;start<n;start++) {
+			if( visited[start] ) continue;
+
+			// pseudo-peripheral root: repeat the search from the farthest
+			// vertex of least degree while the depth keeps growing
+			int root = start, depth = -1;
+			vector<int> comp;
+			for(int pass=0;pass<8;pass++) {
+				comp.clear();
+				bfs(root, comp, visited, false);
+				for(size_t i=0;i<comp.size();i++) visited[comp[i]] = false;
+				int last = level[comp.back()];
+				if( last <= depth ) break;
+				depth = last;
+				int next = comp.back();
+				for(size_t i=0;i<comp.size();i++) {
+					if( level[comp[i]] == last && degree[comp[i]] < degree[next] ) next = comp[i];
+				}
+				root = next;
+			}
+			bfs(root, order, visited, true);
+		}
+		reverse(order.begin(), order.end());
+		return order;
+	}
+
+	// minimum degree on the quotient graph: every eliminated vertex becomes an
+	// element standing for the clique of its neighbours, elements adjacent to
+	// the pivot are absorbed into the new one and the degrees of the touched
+	// vertices are recounted exactly. Much less fill than a profile ordering
+	// on 2D and 3D meshes
+	inline vector<int> minimumDegree(int n, const size_t* outer, const int* inner) {
+		vector<vector<int>> vars(n), elems(n), members(n);
+		vector<char> eliminated(n, 0), alive(n, 0);
+		vector<int> mark(n, -1), degree(n);
+		int stamp = 0;
+		set<pair<int, int>> queue;
+		for(int v=0;v<n;v++) {
+			for(size_t p=outer[v];p<outer[v+1];p++) {
+				if( inner[p] != v ) vars[v].push_back(inner[p]);
+			}
+			degree[v] = int(vars[v].size());
+			queue.insert(make_pair(degree[v], v));
+		}
+
+		vector<int> order;
+		order.reserve(n);
+		while( !queue.empty() ) {
+			int p = queue.begin()->second;
+			queue.erase(queue.begin());
+			order.push_back(p);
+
+			// the new element: all uneliminated neighbours of p, directly or
+			// through its elements, which are absorbed
+			int lstamp = ++stamp;
+			mark[p] = lstamp;
+			vector<int> lp;
+			for(size_t i=0;i<vars[p].size();i++) {
+				int u = vars[p][i];
+				if( !eliminated[u] && mark[u] != lstamp ) { mark[u] = lstamp; lp.push_back(u); }
+			}
+			for(size_t i=0;i<elems[p].size();i++) {
+				int e = elems[p][i];
+				if( !alive[e] ) continue;
+				for(size_t j=0;j<members[e].size();j++) {
+					int u = members[e][j];
+					if( !eliminated[u] && mark[u] != lstamp ) { mark[u] = lstamp; lp.push_back(u); }
+				}
+				alive[e] = 0;
+				vector<int>().swap(members[e]);
+			}
+			eliminated[p] = 1;
+			alive[p] = 1;
+			vector<int>().swap(vars[p]);
+			vector<int>().swap(elems[p]);
+
+			// neighbours inside the element are reached through it now
+			for(size_t i=0;i<lp.size();i++) {
+				int v = lp[i];
+				vector<int>& vv = vars[v];
+				vv.erase(remove_if(vv.begin(), vv.end(), [&](int u) { return eliminated[u] || mark[u] == lstamp; }), vv.end());
+				vector<int>& ev = elems[v];
+				ev.erase(remove_if(ev.begin(), ev.end(), [&](int e) { return !alive[e]; }), ev.end());
+				ev.push_back(p);
+			}
+			members[p] = lp;
+
+			for(size_t i=0;i<lp.size();i++) {
+				int v = lp[i], dstamp = ++stamp, d = 0;
+				mark[v] = dstamp;
+				for(size_t j=0;j<vars[v].size();j++) {
+					int u = vars[v][j];
+					if( mark[u] != dstamp ) { mark[u] = dstamp; d++; }
+				}
+				for(size_t j=0;j<elems[v].size();j++) {
+					const vector<int>& m = members[elems[v][j]];
+					for(size_t t=0;t<m.size();t++) {
+						if( !eliminated[m[t]] && mark[m[t]] != dstamp ) { mark[m[t]] = dstamp; d++; }
+					}
+				}
+				queue.erase(make_pair(degree[v], v));
+				degree[v] = d;
+				queue.insert(make_pair(d, v));
+			}
+		}
+		return order;
+	}
+}
+
+/// sparse LDL' factorization, P A P' = L D L' with unit lower triangular L
+///
+/// analyzePattern orders the unknowns and computes the elimination tree and
+/// the column counts of L; factorize only does the numeric work, so a
+/// sequence of matrices with one sparsity pattern, e.g. a per-frame
+/// deformation, pays for the analysis once. Up-looking algorithm after
+/// T. Davis, "Algorithm 849: A concise sparse Cholesky factorization package"
+template <typename T>
+class SparseCholesky
+{
+public:
+	enum Ordering { Natural, RCM, MinimumDegree };
+
+	SparseCholesky(Ordering ordering = MinimumDegree):mOrdering(ordering),mN(0),mFactorized(false){}
+
+	/// symbolic analysis, reusable for every matrix with the same pattern
+	bool analyzePattern(const SparseMatrix<T>& A);
+	/// numeric factorization, A has to have the analyzed pattern
+	bool factorize(const SparseMatrix<T>& A);
+	bool compute(const SparseMatrix<T>& A) { return analyzePattern(A) && factorize(A); }
+
+	/// x = A \ b, x and b may be the same vector
+	bool solve(const DenseVectorView<const T>& b, const DenseVectorView<T>& x) const;
+	DenseVector<T> solve(const DenseVector<T>& b) const;
+
+	bool isFactorized() const { return mFactorized; }
+	/// whether A has exactly the pattern of the last analyzePattern
+	bool matchesPattern(const SparseMatrix<T>& A) const;
+	size_t factorNonZeros() const { return mLp.empty() ? 0 : mLp[mN]; }
+	const vector<int>& permutation() const { return mP; }
+
+private:
+	Ordering mOrdering;
+	int mN;
+	bool mFactorized;
+
+	// symbolic, with the analyzed pattern of A for factorize to check against
+	vector<size_t> mAp;
+	vector<int> mAi;
+	vector<int> mP, mPinv, mParent;
+	vector<size_t> mLp;
+	// numeric
+	vector<int> mLi;
+	vector<T> mLx, mD;
+};
+
+template <typename T>
+bool SparseCholesky<T>::analyzePattern(const SparseMatrix<T>& A)
+{
+	mFactorized = false;
+	if( A.rows() != A.cols() )
+	{
+		fail("SparseCholesky::analyzePattern : matrix is not square");
+		return false;
+	}
+	int n = int(A.rows());
+	const size_t* Ap = A.outerIndex();
+	const int* Ai = A.innerIndex();
+	mN = n;
+	mAp.assign(Ap, Ap + n + 1);
+	mAi.assign(Ai, Ai + Ap[n]);
+
+	if( mOrdering == MinimumDegree ) mP = SparseOrdering::minimumDegree(n, Ap, Ai);
+	else if( mOrdering == RCM ) mP = SparseOrdering::reverseCuthillMcKee(n, Ap, Ai);
+	else
+	{
+		mP.resize(n);
+		for(int i=0;i<n;i++) mP[i] = i;
+	}
+	mPinv.resize(n);
+	for(int k=0;k<n;k++) mPinv[mP[k]] = k;
+
+	// elimination tree and nonzeros per column of L, from the upper triangle
+	// of the permuted matrix
+	mParent.assign(n, -1);
+	vector<int> flag(n);
+	vector<size_t> lnz(n, 0);
+	for(int k=0;k<n;k++)
+	{
+		flag[k] = k;
+		int kk = mP[k];
+		for(size_t p=Ap[kk];p<Ap[kk+1];p++)
+		{
+			int i = mPinv[Ai[p]];
+			if( i >= k ) continue;
+			// walk up the tree from i until a node already in row k
+			for(;flag[i] != k;i = mParent[i])
+			{
+				if( mParent[i] == -1 ) mParent[i] = k;
+				lnz[i]++;
+				flag[i] = k;
+			}
+		}
+	}
+
+	mLp.assign(n + 1, 0);
+	for(int k=0;k<n;k++) mLp[k+1] = mLp[k] + lnz[k];
+	return true;
+}
+
+template <typename T>
+bool SparseCholesky<T>::matchesPattern(const SparseMatrix<T>& A) const
+{
+	if( mLp.empty() || A.rows() != size_t(mN) || A.cols() != size_t(mN) || A.nonZeros() != mAi.size() ) return false;
+	return equal(mAp.begin(), mAp.end(), A.outerIndex()) && equal(mAi.begin(), mAi.end(), A.innerIndex());
+}
+
+template <typename T>
+bool SparseCholesky<T>::factorize(const SparseMatrix<T>& A)
+{
+	mFactorized = false;
+	// a different pattern would overrun the columns of L sized by the analysis
+	if( !matchesPattern(A) )
+	{
+		fail("SparseCholesky::factorize : pattern differs from the analyzed one");
+		return false;
+	}
+	int n = mN;
+	const size_t* Ap = A.outerIndex();
+	const int* Ai = A.innerIndex();
+	const T* Ax = A.valuePtr();
+
+	mLi.resize(mLp[n]);
+	mLx.resize(mLp[n]);
+	mD.resize(n);
+	vector<T> y(n, T(0));
+	vector<int> pattern(n), flag(n);
+	vector<size_t> lnz(n, 0);
+
+	for(int k=0;k<n;k++)
+	{
+		// nonzero pattern of row k of L, in topological order, and the
+		// scattered column k of the upper triangle
+		int top = n;
+		flag[k] = k;
+		int kk = mP[k];
+		for(size_t p=Ap[kk];p<Ap[kk+1];p++)
+		{
+			int i = mPinv[Ai[p]];
+			if( i > k ) continue;
+			y[i] += Ax[p];
+			int len = 0;
+			for(;flag[i] != k;i = mParent[i])
+			{
+				pattern[len++] = i;
+				flag[i] = k;
+			}
+			while( len > 0 ) pattern[--top] = pattern[--len];
+		}
+
+		// sparse triangular solve for row k of L and the pivot D(k)
+		T d = y[k];
+		y[k] = T(0);
+		for(;top<n;top++)
+		{
+			int i = pattern[top];
+			T yi = y[i];
+			y[i] = T(0);
+			size_t p2 = mLp[i] + lnz[i];
+			for(size_t p=mLp[i];p<p2;p++) y[mLi[p]] -= mLx[p] * yi;
+			T lki = yi / mD[i];
+			d -= lki * yi;
+			mLi[p2] = k;
+			mLx[p2] = lki;
+			lnz[i]++;
+		}
+		if( d == T(0) )
+		{
+			fail("SparseCholesky::factorize : zero pivot, matrix is singular");
+			return false;
+		}
+		mD[k] = d;
+	}
+
+	mFactorized = true;
+	return true;
+}
+
+template <typename T>
+bool SparseCholesky<T>::solve(const DenseVectorView<const T>& b, const DenseVectorView<T>& x) const
+{
+	if( !mFactorized || int(b.length()) != mN || int(x.length()) != mN )
+	{
+		fail("SparseCholesky::solve : not factorized or dimensions do not match");
+		return false;
+	}
+	int n = mN;
+	vector<T> y(n);
+	for(int k=0;k<n;k++) y[k] = b(mP[k]);
+
+	// L y = P b, column by column
+	for(int j=0;j<n;j++)
+	{
+		T yj = y[j];
+		for(size_t p=mLp[j];p<mLp[j+1];p++) y[mLi[p]] -= mLx[p] * yj;
+	}
+	for(int j=0;j<n;j++) y[j] /= mD[j];
+	// L' z = y
+	for(int j=n-1;j>=0;j--)
+	{
+		T yj = y[j];
+		for(size_t p=mLp[j];p<mLp[j+1];p++) yj -= mLx[p] * y[mLi[p]];
+		y[j] = yj;
+	}
+
+	for(int k=0;k<n;k++) x(mP[k]) = y[k];
+	return true;
+}
+
+template <typename T>
+DenseVector<T> SparseCholesky<T>::solve(const DenseVector<T>& b) const
+{
+	DenseVector<T> x(b.length());
+	if( !solve(b.view(), x.view()) ) return DenseVector<T>();
+	return x;
+}
+
+/// preconditioned conjugate gradient for sparse symmetric positive definite
+/// systems. compute builds the preconditioner, solve starts from the given x,
+/// so the previous solution of a slowly changing system is a good guess
+template <typename T>
+class ConjugateGradient
+{
+public:
+	enum Preconditioner { Identity, Jacobi, IncompleteCholesky };
+
+	ConjugateGradient(Preconditioner precond = Jacobi):
+		mRequested(precond),mPrecond(precond),mTolerance(T(1e-6)),mMaxIterations(1000),mIterations(0),mError(0),mA(nullptr){}
+
+	void setTolerance(T tol) { mTolerance = tol; }
+	void setMaxIterations(int iters) { mMaxIterations = iters; }
+
+	/// A has to outlive the solver
+	bool compute(const SparseMatrix<T>& A);
+
+	/// iterate until |b - A x| <= tolerance * |b|, returns whether it converged
+	bool solve(const DenseVectorView<const T>& b, const DenseVectorView<T>& x);
+
+	/// the preconditioner in effect, Jacobi if IC(0) broke down on the last matrix
+	Preconditioner preconditioner() const { return mPrecond; }
+	int iterations() const { return mIterations; }
+	/// relative residual of the last solve
+	T error() const { return mError; }
+
+private:
+	bool computeIncompleteCholesky(const SparseMatrix<T>& A);
+	void applyPreconditioner(const T* r, T* z) const;
+
+	static T dot(const T* x, const T* y, int n) {
+		T s = 0;
+		#pragma omp parallel for reduction(+:s) if(n > 65536)
+		for(int i=0;i<n;i++) s += x[i] * y[i];
+		return s;
+	}
+
+private:
+	// asked for in the constructor, and the one used for the current matrix
+	Preconditioner mRequested, mPrecond;
+	T mTolerance;
+	int mMaxIterations, mIterations;
+	T mError;
+	const SparseMatrix<T>* mA;
+
+	vector<T> mInvDiag;
+	// IC(0) factor, lower triangle by rows with the diagonal last in every row
+	vector<size_t> mLp;
+	vector<int> mLi;
+	vector<T> mLx;
+};
+
+template <typename T>
+bool ConjugateGradient<T>::compute(const SparseMatrix<T>& A)
+{
+	if( A.rows() != A.cols() )
+	{
+		fail("ConjugateGradient::compute : matrix is not square");
+		return false;
+	}
+	mA = &A;
+	int n = int(A.rows());
+	const size_t* Ap = A.outerIndex();
+	const int* Ai = A.innerIndex();
+	const T* Ax = A.valuePtr();
+
+	mInvDiag.assign(n, T(1));
+	for(int i=0;i<n;i++)
+	{
+		for(size_t p=Ap[i];p<Ap[i+1];p++)
+		{
+			if( Ai[p] == i && Ax[p] != T(0) ) mInvDiag[i] = T(1) / Ax[p];
+		}
+	}
+
+	mPrecond = mRequested;
+	if( mPrecond == IncompleteCholesky && !computeIncompleteCholesky(A) )
+	{
+		cerr << "Incomplete Cholesky broke down, using the Jacobi preconditioner." << endl;
+		mPrecond = Jacobi;
+	}
+	return true;
+}
+
+template <typename T>
+bool ConjugateGradient<T>::computeIncompleteCholesky(const SparseMatrix<T>& A)
+{
+	// zero fill: L has the pattern of the lower triangle of A. A breakdown
+	// on a positive definite matrix is retried with a growing diagonal shift
+	int n = int(A.rows());
+	const size_t* Ap = A.outerIndex();
+	const int* Ai = A.innerIndex();
+	const T* Ax = A.valuePtr();
+
+	mLp.assign(n + 1, 0);
+	mLi.clear();
+	vector<T> lower;
+	for(int i=0;i<n;i++)
+	{
+		bool diag = false;
+		for(size_t p=Ap[i];p<Ap[i+1] && Ai[p] <= i;p++)
+		{
+			mLi.push_back(Ai[p]);
+			lower.push_back(Ax[p]);
+			diag = diag || (Ai[p] == i);
+		}
+		if( !diag )
+		{
+			mLi.push_back(i);
+			lower.push_back(T(0));
+		}
+		mLp[i+1] = mLi.size();
+	}
+
+	T shift = 0;
+	for(int attempt=0;attempt<10;attempt++, shift = (shift == T(0)) ? T(1e-3) : shift * 4)
+	{
+		mLx = lower;
+		bool ok = true;
+		for(int i=0;i<n && ok;i++)
+		{
+			for(size_t p=mLp[i];p<mLp[i+1];p++)
+			{
+				int j = mLi[p];
+				// s = a_ij - sum over k < j of L_ik L_jk, a merge of rows i and j
+				T s = mLx[p];
+				if( j == i ) s *= (1 + shift);
+				size_t a = mLp[i], b = mLp[j];
+				while( a < p && b < mLp[j+1] - 1 )
+				{
+					if( mLi[a] < mLi[b] ) a++;
+					else if( mLi[a] > mLi[b] ) b++;
+					else s -= mLx[a++] * mLx[b++];
+				}
+				if( j < i ) mLx[p] = s / mLx[mLp[j+1] - 1];
+				else if( s > T(0) ) mLx[p] = sqrt(s);
+				else ok = false;
+			}
+		}
+		if( ok ) return true;
+	}
+	return false;
+}
+
+template <typename T>
+void ConjugateGradient<T>::applyPreconditioner(const T* r, T* z) const
+{
+	int n = int(mInvDiag.size());
+	if( mPrecond == Identity )
+	{
+		memcpy(z, r, sizeof(T) * n);
+	}
+	else if( mPrecond == Jacobi )
+	{
+		#pragma omp parallel for if(n > 65536)
+		for(int i=0;i<n;i++) z[i] = r[i] * mInvDiag[i];
+	}
+	else
+	{
+		// L y = r, then L' z = y
+		for(int i=0;i<n;i++)
+		{
+			T s = r[i];
+			size_t d = mLp[i+1] - 1;
+			for(size_t p=mLp[i];p<d;p++) s -= mLx[p] * z[mLi[p]];
+			z[i] = s / mLx[d];
+		}
+		for(int i=n-1;i>=0;i--)
+		{
+			size_t d = mLp[i+1] - 1;
+			T zi = z[i] / mLx[d];
+			z[i] = zi;
+			for(size_t p=mLp[i];p<d;p++) z[mLi[p]] -= mLx[p] * zi;
+		}
+	}
+}
+
+template <typename T>
+bool ConjugateGradient<T>::solve(const DenseVectorView<const T>& b, const DenseVectorView<T>& x)
+{
+	if( mA == nullptr || b.length() != mA->rows() || x.length() != mA->rows() )
+	{
+		fail("ConjugateGradient::solve : not computed or dimensions do not match");
+		return false;
+	}
+	int n = int(b.length());
+	DenseVector<T> xv(n), r(n), z(n), p(n), q(n);
+	for(int i=0;i<n;i++) { xv(i) = x(i); r(i) = b(i); }
+
+	T bnorm = sqrt(dot(r.ptr(), r.ptr(), n));
+	if( bnorm == T(0) ) bnorm = 1;
+
+	// r = b - A x
+	mA->multiply(xv.view(), r.view(), T(-1), T(1));
+	applyPreconditioner(r.ptr(), z.ptr());
+	memcpy(p.ptr(), z.ptr(), sizeof(T) * n);
+	T rz = dot(r.ptr(), z.ptr(), n);
+
+	mIterations = 0;
+	mError = sqrt(dot(r.ptr(), r.ptr(), n)) / bnorm;
+	while( mError > mTolerance && mIterations < mMaxIterations )
+	{
+		mA->multiply(p.view(), q.view());
+		T alpha = rz / dot(p.ptr(), q.ptr(), n);
+		T* px = xv.ptr(); T* pr = r.ptr(); const T* pp = p.ptr(); const T* pq = q.ptr();
+		#pragma omp parallel for if(n > 65536)
+		for(int i=0;i<n;i++)
+		{
+			px[i] += alpha * pp[i];
+			pr[i] -= alpha * pq[i];
+		}
+		mIterations++;
+		mError = sqrt(dot(pr, pr, n)) / bnorm;
+		if( mError <= mTolerance ) break;
+
+		applyPreconditioner(r.ptr(), z.ptr());
+		T rzNew = dot(r.ptr(), z.ptr(), n);
+		T beta = rzNew / rz;
+		rz = rzNew;
+		// p = z + beta * p
+		p = z + p * beta;
+	}
+
+	for(int i=0;i<n;i++) x(i) = xv(i);
+	return mError <= mTolerance;
+}
+
+/// least squares with the sparse normal equations, x = (A'A) \ A'b. The
+/// analysis of the solver is kept while A'A keeps its pattern, so pass the
+/// same solver for a sequence of problems that share the sparsity pattern of A
+template <typename T>
+bool leastsquare_normalmat(const SparseMatrix<T>& A, const DenseVector<T>& b, DenseVector<T>& x,
+	SparseCholesky<T>& solver)
+{
+	if( b.length() != A.rows() )
+	{
+		fail("leastsquare_normalmat : input dimensions do not match");
+		return false;
+	}
+	SparseMatrix<T> AtA = A.AtA();
+	DenseVector<T> Atb(A.cols());
+	A.multiplyTransposed(b.view(), Atb.view());
+	if( x.length() != A.cols() ) x.resize(A.cols());
+	if( !solver.matchesPattern(AtA) )
+	{
+		if( !solver.analyzePattern(AtA) ) return false;
+	}
+	return solver.factorize(AtA) && solver.solve(Atb.view(), x.view());
+}
+}
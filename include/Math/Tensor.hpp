@@ -1,13 +1,486 @@
 #pragma once
 
 #include "../phgutils.h"
+#include "../IO/FileMapper.h"
+#include "TensorFile.hpp"
+#include "HalfFloat.hpp"
 
 #define USE_ARMADILLO 0
 
 #if USE_ARMADILLO
 #include <armadillo>
 #endif
-#include <mkl.h>
+#include "BlasBackend.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <type_traits>
+#ifdef WIN32
+#include <malloc.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "CpuFeatures.hpp"
+
+// aligned storage shared by the tensor classes. Blocks come in power of two
+// size classes and every thread keeps a few freed blocks of each class, so the
+// temporaries of a tracking loop stop reaching the system allocator once the
+// first frame has run. Each block starts with a one cache line header holding
+// its capacity, which lets resize reuse a block that is already big enough.
+namespace TensorStorage {
+	// one cache line, also the width of an AVX-512 register
+	const size_t ALIGNMENT = 64;
+	// classes from 64 bytes to 64 MB, larger blocks bypass the caches
+	const int NUM_CLASSES = 21;
+	// blocks kept per class and thread
+	const int CACHE_DEPTH = 8;
+
+	struct BlockHeader {
+		size_t bytes;
+		int cls;
+		BlockHeader* next;
+	};
+
+	inline void systemRelease(BlockHeader* h) {
+#ifdef WIN32
+		_aligned_free(h);
+#else
+		free(h);
+#endif
+	}
+
+	// the free lists of one thread, returned to the system when the thread exits
+	struct ThreadCache {
+		BlockHeader* head[NUM_CLASSES];
+		int count[NUM_CLASSES];
+		// set once destroyed, blocks freed later by other thread_local
+		// destructors then go straight back to the system
+		bool closed;
+
+		ThreadCache():closed(false) {
+			for(int i=0;i<NUM_CLASSES;i++) { head[i] = nullptr; count[i] = 0; }
+		}
+		~ThreadCache() {
+			clear();
+			closed = true;
+		}
+
+		void clear() {
+			for(int i=0;i<NUM_CLASSES;i++) {
+				while( head[i] != nullptr ) {
+					BlockHeader* h = head[i];
+					head[i] = h->next;
+					systemRelease(h);
+				}
+				count[i] = 0;
+			}
+		}
+	};
+
+	inline ThreadCache& threadCache() {
+		static thread_local ThreadCache cache;
+		return cache;
+	}
+
+	// 0: blocks handed out, 1: blocks that came from the system allocator
+	inline atomic<size_t>& counter(int which) {
+		static atomic<size_t> counters[2];
+		return counters[which];
+	}
+
+	// total number of allocations, and how many of them missed the caches
+	inline size_t allocations() { return counter(0).load(memory_order_relaxed); }
+	inline size_t systemAllocations() { return counter(1).load(memory_order_relaxed); }
+
+	// the smallest class holding bytes, -1 if the block is too large for the caches
+	inline int sizeClass(size_t bytes) {
+		int cls = 0;
+		for(size_t c = ALIGNMENT;c < bytes;c <<= 1) cls++;
+		return (cls < NUM_CLASSES)?cls:-1;
+	}
+
+	inline BlockHeader* header(const void* ptr) {
+		return reinterpret_cast<BlockHeader*>(const_cast<char*>(reinterpret_cast<const char*>(ptr)) - ALIGNMENT);
+	}
+
+	inline void* allocateBytes(size_t bytes) {
+		counter(0).fetch_add(1, memory_order_relaxed);
+		int cls = sizeClass(bytes);
+		ThreadCache& cache = threadCache();
+		BlockHeader* h = nullptr;
+		if( cls >= 0 && !cache.closed && cache.head[cls] != nullptr ) {
+			h = cache.head[cls];
+			cache.head[cls] = h->next;
+			cache.count[cls]--;
+		}
+		else {
+			counter(1).fetch_add(1, memory_order_relaxed);
+			size_t capacity = (cls >= 0)?(ALIGNMENT << cls):((bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT);
+			void* ptr = nullptr;
+#ifdef WIN32
+			ptr = _aligned_malloc(capacity + ALIGNMENT, ALIGNMENT);
+#else
+			if( posix_memalign(&ptr, ALIGNMENT, capacity + ALIGNMENT) != 0 ) ptr = nullptr;
+#endif
+			if( ptr == nullptr ) throw bad_alloc();
+			h = reinterpret_cast<BlockHeader*>(ptr);
+			h->bytes = capacity;
+			h->cls = cls;
+		}
+		h->next = nullptr;
+		return reinterpret_cast<char*>(h) + ALIGNMENT;
+	}
+
+	inline void releaseBytes(void* ptr) {
+		if( ptr == nullptr ) return;
+		BlockHeader* h = header(ptr);
+		ThreadCache& cache = threadCache();
+		if( h->cls >= 0 && !cache.closed && cache.count[h->cls] < CACHE_DEPTH ) {
+			h->next = cache.head[h->cls];
+			cache.head[h->cls] = h;
+			cache.count[h->cls]++;
+		}
+		else systemRelease(h);
+	}
+
+	// hand the cached blocks of the calling thread back to the system now
+	// instead of when the thread exits
+	inline void trim() {
+		threadCache().clear();
+	}
+
+	template <typename T>
+	T* allocate(size_t n) {
+		if( n == 0 ) return nullptr;
+		return reinterpret_cast<T*>(allocateBytes(sizeof(T) * n));
+	}
+
+	template <typename T>
+	void release(T* ptr) {
+		releaseBytes(const_cast<typename remove_const<T>::type*>(ptr));
+	}
+
+	// number of elements the block at ptr can hold
+	template <typename T>
+	size_t capacity(const T* ptr) {
+		return (ptr == nullptr)?0:(header(ptr)->bytes / sizeof(T));
+	}
+
+	// make ptr hold at least n elements, the block is kept when it is big enough,
+	// otherwise it is replaced and the old contents are lost
+	template <typename T>
+	void reserve(T*& ptr, size_t n) {
+		if( n <= capacity(ptr) ) return;
+		release(ptr);
+		ptr = nullptr;
+		ptr = allocate<T>(n);
+	}
+
+	// counts the allocations made by all threads since construction or restart,
+	// e.g. systemCount around a tracking frame should read zero once warmed up
+	class AllocationCounter {
+	public:
+		AllocationCounter(void) { restart(); }
+		void restart() {
+			start = allocations();
+			startSystem = systemAllocations();
+		}
+		size_t count() const { return allocations() - start; }
+		size_t systemCount() const { return systemAllocations() - startSystem; }
+	private:
+		size_t start, startSystem;
+	};
+}
+
+// row major shorthands for the BlasBackend routines used by the tensor classes
+namespace TensorBlas {
+	// C = alpha * op(A) * op(B) + beta * C, op(A) is m x k and op(B) is k x n
+	template <typename T>
+	inline void gemm(bool transA, bool transB, int m, int n, int k,
+		T alpha, const T* A, int lda, const T* B, int ldb,
+		T beta, T* C, int ldc)
+	{
+		BlasBackend::gemm(BlasBackend::RowMajor, transA, transB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+	}
+
+	// y = alpha * op(A) * x + beta * y, A is m x n
+	template <typename T>
+	inline void gemv(bool transA, int m, int n, T alpha, const T* A, int lda,
+		const T* x, T beta, T* y)
+	{
+		BlasBackend::gemv(BlasBackend::RowMajor, transA, m, n, alpha, A, lda, x, beta, y);
+	}
+
+	// upper triangle of C = alpha * op(A) * op(A)' + beta * C, C is n x n
+	template <typename T>
+	inline void syrk(bool transA, int n, int k, T alpha, const T* A, int lda,
+		T beta, T* C, int ldc)
+	{
+		BlasBackend::syrk(BlasBackend::RowMajor, true, transA, n, k, alpha, A, lda, beta, C, ldc);
+	}
+
+	// replace the columns of the m x n matrix A, m >= n, with an orthonormal basis of their span
+	template <typename T>
+	inline int orthonormalize(int m, int n, T* A) {
+		return BlasBackend::orthonormalize(m, n, A);
+	}
+
+	// eigen decomposition of the symmetric n x n matrix A, given by its upper triangle,
+	// eigenvalues go to w in ascending order and A is overwritten with the eigenvectors as columns
+	template <typename T>
+	inline int syev(int n, T* A, T* w) {
+		return BlasBackend::syev(n, A, w);
+	}
+}
+
+// number of threads used by the tensor kernels
+namespace TensorThreads {
+	// 0 leaves the choice to OpenMP
+	inline int& requested() {
+		static int n = 0;
+		return n;
+	}
+
+	inline void set(int n) {
+		requested() = n;
+	}
+
+	inline int get() {
+#ifdef _OPENMP
+		return (requested() > 0)?requested():omp_get_max_threads();
+#else
+		return 1;
+#endif
+	}
+}
+
+// type used for arithmetic on tensors stored as T, 16-bit storage computes in float
+template <typename T> struct TensorCompute { typedef T type; };
+template <> struct TensorCompute<Half> { typedef float type; };
+template <> struct TensorCompute<BFloat16> { typedef float type; };
+
+// inner loops shared by the tensor contractions, kept simple enough to vectorize
+namespace TensorKernels {
+	template <typename T>
+	inline T dot(const T* a, const T* b, int n) {
+		T sum = 0;
+		#pragma omp simd reduction(+:sum)
+		for(int i=0;i<n;i++) sum += a[i] * b[i];
+		return sum;
+	}
+
+	// y += alpha * x
+	template <typename T>
+	inline void axpy(T alpha, const T* x, T* y, int n) {
+		#pragma omp simd
+		for(int i=0;i<n;i++) y[i] += alpha * x[i];
+	}
+
+	// convert n stored values to the compute type
+	template <typename S, typename A>
+	inline void widen(const S* src, A* dst, int n) {
+		for(int i=0;i<n;i++) dst[i] = A(src[i]);
+	}
+
+	inline void widen(const Half* src, float* dst, int n) {
+		HalfConvert::toFloat(src, dst, size_t(n));
+	}
+
+	inline void widen(const BFloat16* src, float* dst, int n) {
+		for(int i=0;i<n;i++) {
+			uint32_t x = uint32_t(src[i].bits) << 16;
+			memcpy(dst + i, &x, sizeof(float));
+		}
+	}
+
+	// element-wise conversion between storage types, e.g. float to Half
+	template <typename S, typename D>
+	inline void convert(const S* src, D* dst, size_t n) {
+		for(size_t i=0;i<n;i++) dst[i] = D(src[i]);
+	}
+
+	inline void convert(const Half* src, float* dst, size_t n) {
+		HalfConvert::toFloat(src, dst, n);
+	}
+
+	inline void convert(const float* src, Half* dst, size_t n) {
+		HalfConvert::fromFloat(src, dst, n);
+	}
+
+	// the same in parallel, in chunks of CHUNK elements
+	template <typename S, typename D>
+	inline void convertParallel(const S* src, D* dst, size_t n) {
+		const size_t CHUNK = 1 << 16;
+		long long nchunks = (long long)((n + CHUNK - 1) / CHUNK);
+		#pragma omp parallel for num_threads(TensorThreads::get()) if(nchunks > 1)
+		for(long long c=0;c<nchunks;c++) {
+			size_t offset = size_t(c) * CHUNK;
+			convert(src + offset, dst + offset, min(CHUNK, n - offset));
+		}
+	}
+
+	// GEMM on 16-bit storage widens one panel of the operand at a time into a
+	// per-thread buffer of about PANEL_ELEMS values, never the whole tensor
+	const int PANEL_ELEMS = 1 << 16;
+
+	// columns per panel when a panel spans rows rows
+	inline int panelWidth(int rows) {
+		return max(16, min(256, PANEL_ELEMS / max(rows, 1)));
+	}
+
+	// dst(rows x cols, row major and packed) = src(rows x cols, leading dimension ld)
+	template <typename S, typename A>
+	inline void widenPanel(const S* src, int ld, A* dst, int rows, int cols) {
+		for(int r=0;r<rows;r++) widen(src + size_t(r) * ld, dst + size_t(r) * cols, cols);
+	}
+
+	// mixed precision versions, the S operand is widened to A in small chunks
+	// on load and everything accumulates in A
+	const int WIDEN_CHUNK = 256;
+
+	template <typename S, typename A>
+	inline A dot(const S* a, const A* b, int n) {
+		A buf[WIDEN_CHUNK];
+		A sum = 0;
+		for(int offset=0;offset<n;offset+=WIDEN_CHUNK) {
+			int len = min(WIDEN_CHUNK, n - offset);
+			widen(a + offset, buf, len);
+			sum += dot(static_cast<const A*>(buf), b + offset, len);
+		}
+		return sum;
+	}
+
+	template <typename S, typename A>
+	inline void axpy(A alpha, const S* x, A* y, int n) {
+		A buf[WIDEN_CHUNK];
+		for(int offset=0;offset<n;offset+=WIDEN_CHUNK) {
+			int len = min(WIDEN_CHUNK, n - offset);
+			widen(x + offset, buf, len);
+			axpy(alpha, static_cast<const A*>(buf), y + offset, len);
+		}
+	}
+}
+
+// cache blocked out-of-place transposes, the unfoldings of a row major order 3
+// tensor are all plain copies or batches of 2d transposes
+namespace TensorTranspose {
+	// a TILE x TILE block of source and destination stays in L1
+	const int TILE = 32;
+
+	// dst(c, r) = src(r, c) for a rows x cols block
+	template <typename T>
+	inline void scalar(int rows, int cols, const T* src, size_t lds, T* dst, size_t ldd) {
+		for(int r=0;r<rows;r++) {
+			for(int c=0;c<cols;c++) dst[c * ldd + r] = src[r * lds + c];
+		}
+	}
+
+	// in-register W x W transpose, W = 0 when there is none for T. The AVX
+	// versions are used when the CPU has AVX, see tile()
+	template <typename T>
+	struct Block {
+		static const int W = 0;
+		static void run(const T*, size_t, T*, size_t) {}
+	};
+
+#if PHG_X86
+	template <>
+	struct Block<float> {
+		static const int W = 8;
+		PHG_TARGET("avx")
+		static void run(const float* src, size_t lds, float* dst, size_t ldd) {
+			__m256 r0 = _mm256_loadu_ps(src), r1 = _mm256_loadu_ps(src + lds),
+				r2 = _mm256_loadu_ps(src + 2 * lds), r3 = _mm256_loadu_ps(src + 3 * lds),
+				r4 = _mm256_loadu_ps(src + 4 * lds), r5 = _mm256_loadu_ps(src + 5 * lds),
+				r6 = _mm256_loadu_ps(src + 6 * lds), r7 = _mm256_loadu_ps(src + 7 * lds);
+			__m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1),
+				t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3),
+				t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5),
+				t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+			r0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+			r1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+			r2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+			r3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+			r4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+			r5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+			r6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+			r7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+			_mm256_storeu_ps(dst, _mm256_permute2f128_ps(r0, r4, 0x20));
+			_mm256_storeu_ps(dst + ldd, _mm256_permute2f128_ps(r1, r5, 0x20));
+			_mm256_storeu_ps(dst + 2 * ldd, _mm256_permute2f128_ps(r2, r6, 0x20));
+			_mm256_storeu_ps(dst + 3 * ldd, _mm256_permute2f128_ps(r3, r7, 0x20));
+			_mm256_storeu_ps(dst + 4 * ldd, _mm256_permute2f128_ps(r0, r4, 0x31));
+			_mm256_storeu_ps(dst + 5 * ldd, _mm256_permute2f128_ps(r1, r5, 0x31));
+			_mm256_storeu_ps(dst + 6 * ldd, _mm256_permute2f128_ps(r2, r6, 0x31));
+			_mm256_storeu_ps(dst + 7 * ldd, _mm256_permute2f128_ps(r3, r7, 0x31));
+		}
+	};
+
+	template <>
+	struct Block<double> {
+		static const int W = 4;
+		PHG_TARGET("avx")
+		static void run(const double* src, size_t lds, double* dst, size_t ldd) {
+			__m256d r0 = _mm256_loadu_pd(src), r1 = _mm256_loadu_pd(src + lds),
+				r2 = _mm256_loadu_pd(src + 2 * lds), r3 = _mm256_loadu_pd(src + 3 * lds);
+			__m256d t0 = _mm256_unpacklo_pd(r0, r1), t1 = _mm256_unpackhi_pd(r0, r1),
+				t2 = _mm256_unpacklo_pd(r2, r3), t3 = _mm256_unpackhi_pd(r2, r3);
+			_mm256_storeu_pd(dst, _mm256_permute2f128_pd(t0, t2, 0x20));
+			_mm256_storeu_pd(dst + ldd, _mm256_permute2f128_pd(t1, t3, 0x20));
+			_mm256_storeu_pd(dst + 2 * ldd, _mm256_permute2f128_pd(t0, t2, 0x31));
+			_mm256_storeu_pd(dst + 3 * ldd, _mm256_permute2f128_pd(t1, t3, 0x31));
+		}
+	};
+#endif
+
+	// one tile, whole W x W blocks in registers and the ragged edges scalar
+	template <typename T>
+	inline void tile(int rows, int cols, const T* src, size_t lds, T* dst, size_t ldd) {
+		const int W = CpuFeatures::has(CpuFeatures::Avx) ? Block<T>::W : 0;
+		int rb = 0, cb = 0;
+		if( W > 0 ) {
+			rb = rows / W * W;
+			cb = cols / W * W;
+			for(int r=0;r<rb;r+=W) {
+				for(int c=0;c<cb;c+=W) Block<T>::run(src + r * lds + c, lds, dst + c * ldd + r, ldd);
+			}
+		}
+		scalar(rb, cols - cb, src + cb, lds, dst + cb * ldd, ldd);
+		scalar(rows - rb, cols, src + rb * lds, lds, dst + rb, ldd);
+	}
+
+	// transpose a batch of rows x cols matrices, matrix b starts at src + b * sbs
+	// and goes to dst + b * dbs. The tiles of all matrices are split among threads
+	template <typename T>
+	void run(int batch, int rows, int cols, const T* src, size_t sbs, size_t lds,
+		T* dst, size_t dbs, size_t ldd)
+	{
+		long long tr = (rows + TILE - 1) / TILE, tc = (cols + TILE - 1) / TILE;
+		long long ntasks = batch * tr * tc;
+		#pragma omp parallel for num_threads(TensorThreads::get()) schedule(static)
+		for(long long t=0;t<ntasks;t++) {
+			long long b = t / (tr * tc), rem = t % (tr * tc);
+			int r = int(rem / tc) * TILE, c = int(rem % tc) * TILE;
+			tile(min(TILE, rows - r), min(TILE, cols - c), src + b * sbs + r * lds + c, lds,
+				dst + b * dbs + c * ldd + r, ldd);
+		}
+	}
+
+	// parallel copy for the mode 0 unfolding
+	template <typename T>
+	void copy(const T* src, T* dst, size_t n) {
+		const size_t CHUNK = (1 << 20) / sizeof(T);
+		long long nchunks = (n + CHUNK - 1) / CHUNK;
+		#pragma omp parallel for num_threads(TensorThreads::get()) schedule(static)
+		for(long long c=0;c<nchunks;c++) {
+			size_t offset = c * CHUNK;
+			memcpy(dst + offset, src + offset, sizeof(T) * min(CHUNK, n - offset));
+		}
+	}
+}
 
 template <typename T>
 class Tensor1
@@ -15,13 +488,13 @@ class Tensor1
 public:
 	Tensor1(void):n(0),data(nullptr){}
 	Tensor1(int n):n(n) { 
-		data = new T[n];
+		data = TensorStorage::allocate<T>(n);
 		memset(data, 0, sizeof(T)*n);
 	}
 	Tensor1(const Tensor1& other):
 		n(other.n)
 	{
-		data = new T[n];
+		data = TensorStorage::allocate<T>(n);
 		memcpy(data, other.data, sizeof(T)*n);
 	}
 	Tensor1(Tensor1&& other):
@@ -31,14 +504,13 @@ public:
 		other.data = nullptr;
 	}
 	~Tensor1(){
-		if( data != nullptr ) delete[] data;
+		TensorStorage::release(data);
 	}
 
 	Tensor1<T>& operator=(const Tensor1<T>& other) {
 		if( this != &other ) {
 			n = other.n;
-			if( data ) delete[] data;
-			data = new T[n];
+			TensorStorage::reserve(data, n);
 			memcpy(data, other.data, sizeof(T)*n);
 		}
 		return (*this);
@@ -47,7 +519,7 @@ public:
 	Tensor1<T>& operator=(Tensor1<T>&& other) {
 		if( this != &other ) {
 			n = other.n;
-			if( data ) delete[] data;
+			TensorStorage::release(data);
 			data = other.data;
 			other.data = nullptr;
 		}
@@ -64,10 +536,10 @@ public:
 	int length() const {
 		return n;
 	}
+	// keeps the buffer when it can hold size elements
 	void resize(int size){
 		n = size;
-		if( data ) delete[] data;
-		data = new T[n];
+		TensorStorage::reserve(data, n);
 		memset(data, 0, sizeof(T)*n);
 	}
 
@@ -82,6 +554,14 @@ public:
 	vector<T> toStdVector() const {
 		return vector<T>(data, data+n);
 	}
+
+	// element-wise copy into another storage type, e.g. float to Half
+	template <typename U>
+	Tensor1<U> convert() const {
+		Tensor1<U> t(n);
+		TensorKernels::convert(data, t.rawptr(), size_t(n));
+		return t;
+	}
 private:
 	int n;
 	T* data;
@@ -100,35 +580,32 @@ template <typename T>
 class Tensor2
 {
 public:
-	Tensor2(void):data(nullptr){ d[0] = d[1] = 0; }
-	Tensor2(int m, int n){
+	typedef typename TensorCompute<T>::type compute_t;
+
+	Tensor2(void):data(nullptr),owner(true){ d[0] = d[1] = 0; }
+	Tensor2(int m, int n):owner(true){
 		d[0] = m; d[1] = n;
-		data = new T[m * n];
+		data = TensorStorage::allocate<T>(size_t(m) * n);
 		memset(data, 0, sizeof(T)*m*n);
 	}
-	Tensor2(const Tensor2& other){
+	Tensor2(const Tensor2& other):owner(true){
 		d[0] = other.d[0]; d[1] = other.d[1];
-		data = new T[d[0] * d[1]];
+		data = TensorStorage::allocate<T>(size_t(d[0]) * d[1]);
 		memcpy(data, other.data, sizeof(T) * d[0] * d[1]);
 	}
-	Tensor2(Tensor2&& other){
+	Tensor2(Tensor2&& other):owner(other.owner){
 		d[0] = other.d[0]; d[1] = other.d[1];
 		data = other.data;
 		other.data = nullptr;
 	}
 	~Tensor2(){
-		if( data ) {
-			delete[] data;
-		}
+		if( owner ) TensorStorage::release(data);
 	}
 
 	Tensor2<T>& operator=(const Tensor2<T>& other){
 
 		if( this != &other ) {
-			d[0] = other.d[0];
-			d[1] = other.d[1];
-			if( data ) delete[] data;
-			data = new T[d[0] * d[1]];
+			resize(other.d[0], other.d[1]);
 			memcpy(data, other.data, sizeof(T) * d[0] * d[1]);
 		}
 
@@ -139,8 +616,9 @@ public:
 		if( this != &other ) {
 			d[0] = other.d[0];
 			d[1] = other.d[1];
-			if( data ) delete[] data;
+			if( owner ) TensorStorage::release(data);
 			data = other.data;
+			owner = other.owner;
 			other.data = nullptr;
 		}
 		return (*this);
@@ -168,23 +646,37 @@ public:
 	int rows() { return d[0]; }
 	int cols() { return d[1]; }
 
+	// keeps the buffer when it is owned and can hold r x c elements
 	void resize(int r, int c){
 		d[0] = r;
 		d[1] = c;
-		if( data ) delete[] data;
-		data = new T[r * c];
+		if( !owner ) {
+			data = nullptr;
+			owner = true;
+		}
+		TensorStorage::reserve(data, size_t(r) * c);
+	}
+
+	// make the tensor a non-owning r x c view of external row major memory,
+	// the memory has to outlive the tensor
+	void wrap(T* ptr, int r, int c) {
+		if( owner ) TensorStorage::release(data);
+		d[0] = r;
+		d[1] = c;
+		data = ptr;
+		owner = false;
 	}
+	bool isOwner() const { return owner; }
 
-	int modeProduct(const Tensor1<T>& v, int mid, Tensor1<T>& t1) {
+	int modeProduct(const Tensor1<compute_t>& v, int mid, Tensor1<compute_t>& t1) const {
 		switch( mid ) {
 		case 0:
 			{
 				// should use mkl
 				assert(v.length() == d[0]);
 				
-				// view the tensor as a matrix stored in column major order
-				cblas_sgemv(CblasColMajor, CblasNoTrans, d[1], d[0], 1.0,
-					data, d[1], v.rawptr(), 1, 0.0, t1.rawptr(), 1);
+				// t1 = T' * v
+				gemv(true, v.rawptr(), t1.rawptr(), is_same<T, compute_t>());
 				return 0;
 			}
 		case 1:
@@ -192,8 +684,7 @@ public:
 				// should use mkl
 				assert(v.length() == d[1]);
 				
-				cblas_sgemv(CblasRowMajor, CblasNoTrans, d[0], d[1], 1.0,
-					data, d[1], v.rawptr(), 1, 0.0, t1.rawptr(), 1);
+				gemv(false, v.rawptr(), t1.rawptr(), is_same<T, compute_t>());
 				return 0;
 			}
 		default:
@@ -203,13 +694,13 @@ public:
 		}
 	}
 
-	Tensor1<T> modeProduct(const Tensor1<T>& v, int mid) {
+	Tensor1<compute_t> modeProduct(const Tensor1<compute_t>& v, int mid) const {
 		switch( mid ) {
 		case 0:
 			{
 				// should use mkl
 				assert(v.length() == d[0]);
-				Tensor1<T> t1(d[1]);
+				Tensor1<compute_t> t1(d[1]);
 
 				/*
 				T* t1ptr = t1.rawptr();
@@ -220,9 +711,8 @@ public:
 				}
 				*/
 				
-				// view the tensor as a matrix stored in column major order
-				cblas_sgemv(CblasColMajor, CblasNoTrans, d[1], d[0], 1.0,
-					data, d[1], v.rawptr(), 1, 0.0, t1.rawptr(), 1); 
+				// t1 = T' * v
+				gemv(true, v.rawptr(), t1.rawptr(), is_same<T, compute_t>());
 					
 
 				return t1;
@@ -231,7 +721,7 @@ public:
 			{
 				// should use mkl
 				assert(v.length() == d[1]);
-				Tensor1<T> t1(d[0]);
+				Tensor1<compute_t> t1(d[0]);
 
 				// naive matrix-vector product
 				/*
@@ -242,8 +732,7 @@ public:
 				}
 				*/
 				
-				cblas_sgemv(CblasRowMajor, CblasNoTrans, d[0], d[1], 1.0,
-					data, d[1], v.rawptr(), 1, 0.0, t1.rawptr(), 1); 
+				gemv(false, v.rawptr(), t1.rawptr(), is_same<T, compute_t>());
 					
 				return t1;
 			}
@@ -310,16 +799,26 @@ public:
 	bool read(const string& filename) {
 		try {
 			cout << "reading tensor to file " << filename << endl;
-			fstream fin;
-			fin.open(filename, ios::in | ios::binary);
+			if( TensorFile::version(filename) == 2 ) {
+				TensorFile::Reader reader;
+				if( !reader.open(filename, TensorFile::DataTypeOf<T>::value, sizeof(T), 2) ) throw "Invalid tensor file!";
+				const TensorFile::Header& h = reader.header();
+				resize(int(h.dims[0]), int(h.dims[1]));
+				cout << "tensor size = " << d[0] << "x" << d[1] << endl;
+				if( !reader.readAll(reinterpret_cast<char*>(data)) ) throw "Corrupted tensor file!";
+			}
+			else {
+				fstream fin;
+				fin.open(filename, ios::in | ios::binary);
 
-			fin.read(reinterpret_cast<char*>(&(d[0])), sizeof(int)*2);	
-			cout << "tensor size = " << d[0] << "x" << d[1] << endl;
-			if( data != nullptr ) delete[] data;
-			data = new T[d[0]*d[1]];
-			fin.read(reinterpret_cast<char*>(data), sizeof(T)*d[0]*d[1]);
+				int dims[2];
+				fin.read(reinterpret_cast<char*>(dims), sizeof(int)*2);	
+				resize(dims[0], dims[1]);
+				cout << "tensor size = " << d[0] << "x" << d[1] << endl;
+				fin.read(reinterpret_cast<char*>(data), sizeof(T)*d[0]*d[1]);
 
-			fin.close();
+				fin.close();
+			}
 
 			cout << "done." << endl;
 			return true;
@@ -330,16 +829,21 @@ public:
 		}
 	}
 
-	bool write(const string& filename) {
+	// version 1 writes the legacy headerless layout
+	bool write(const string& filename, int version = TensorFile::VERSION) {
 		try {
 			cout << "writing tensor to file " << filename << endl;
-			fstream fout;
-			fout.open(filename, ios::out | ios::binary);
+			if( version == 1 ) {
+				fstream fout;
+				fout.open(filename, ios::out | ios::binary);
 
-			fout.write(reinterpret_cast<const char*>(&(d[0])), sizeof(int)*2);			
-			fout.write(reinterpret_cast<const char*>(data), sizeof(T)*d[0]*d[1]);
+				fout.write(reinterpret_cast<const char*>(&(d[0])), sizeof(int)*2);			
+				fout.write(reinterpret_cast<const char*>(data), sizeof(T)*d[0]*d[1]);
 
-			fout.close();
+				fout.close();
+			}
+			else if( !TensorFile::write(filename, TensorFile::DataTypeOf<T>::value, sizeof(T), 2, d,
+				reinterpret_cast<const char*>(data)) ) throw "Failed to write tensor file!";
 
 			cout << "done." << endl;
 			return true;
@@ -349,11 +853,55 @@ public:
 			return false;
 		}
 	}
+
+	// point the tensor at the contents of a file written by write(), e.g. a
+	// mapped file, without copying
+	bool fromBuffer(char* buffer, size_t bytes) {
+		if( TensorFile::hasMagic(buffer, bytes) ) {
+			const TensorFile::Header* h = TensorFile::parse(buffer, bytes, TensorFile::DataTypeOf<T>::value, sizeof(T), 2);
+			if( h == nullptr ) return false;
+			wrap(reinterpret_cast<T*>(buffer + h->payloadOffset), int(h->dims[0]), int(h->dims[1]));
+			return true;
+		}
+
+		if( bytes < sizeof(int)*2 ) return false;
+		int dims[2];
+		memcpy(dims, buffer, sizeof(int)*2);
+		if( bytes < sizeof(int)*2 + sizeof(T) * dims[0] * dims[1] ) return false;
+		wrap(reinterpret_cast<T*>(buffer + sizeof(int)*2), dims[0], dims[1]);
+		return true;
+	}
+	// element-wise copy into another storage type, e.g. float to Half
+	template <typename U>
+	Tensor2<U> convert() const {
+		Tensor2<U> t(d[0], d[1]);
+		TensorKernels::convert(data, t.rawptr(), size_t(d[0]) * d[1]);
+		return t;
+	}
+
+private:
+	// y = T' * x or T * x, BLAS when the storage is the compute type
+	void gemv(bool trans, const compute_t* x, compute_t* y, true_type) const {
+		TensorBlas::gemv(trans, d[0], d[1], T(1), data, d[1], x, T(0), y);
+	}
+	// converting kernels for 16-bit storage
+	void gemv(bool trans, const compute_t* x, compute_t* y, false_type) const {
+		if( trans ) {
+			memset(y, 0, sizeof(compute_t) * d[1]);
+			for(int i=0;i<d[0];i++) TensorKernels::axpy(x[i], data + i * d[1], y, d[1]);
+		}
+		else {
+			for(int i=0;i<d[0];i++) y[i] = TensorKernels::dot(data + i * d[1], x, d[1]);
+		}
+	}
+
 private:
 	int d[2];
 	
 	// row major storage
 	T* data;
+	// false when data points into memory owned by someone else
+	bool owner;
 };
 
 template <typename T>
@@ -364,368 +912,707 @@ ostream& operator<<(ostream& os, const Tensor2<T>& t) {
 	return os;
 }
 
-// Order 3 tensor
+// non-owning view of n elements spaced by a fixed stride, e.g. a fiber of a Tensor3
 template <typename T>
-class Tensor3
+class Tensor1View
 {
 public:
-	Tensor3(void){}
-	Tensor3(int l, int m, int n){
-		d[0] = l; d[1] = m; d[2] = n;
-		data.resize(l);
-		for_each(data.begin(), data.end(), [=](Tensor2<T>& t){
-			t.resize(m, n);
-		});
+	Tensor1View(void):n(0),s(0),data(nullptr){}
+	Tensor1View(T* data, int n, size_t stride = 1):n(n),s(stride),data(data){}
+	template <typename TT>
+	Tensor1View(const Tensor1View<TT>& other):n(other.length()),s(other.stride()),data(other.rawptr()){}
+
+	T& operator()(int i) const {
+		return data[i * s];
 	}
-	Tensor3(const Tensor3& other) {
-		d[0] = other.d[0]; d[1] = other.d[1]; d[2] = other.d[2];
-		data = other.data;
+
+	int length() const { return n; }
+	size_t stride() const { return s; }
+	bool isContiguous() const { return s == 1; }
+	T* rawptr() const { return data; }
+
+	Tensor1<typename remove_const<T>::type> toTensor() const {
+		Tensor1<typename remove_const<T>::type> t(n);
+		for(int i=0;i<n;i++) t(i) = data[i * s];
+		return t;
 	}
-	~Tensor3(void){}
 
-	const Tensor2<T>& operator()(int i) const {
-		return data[i];
+	void print(const string& title = "", ostream& os = cout) const{
+		if( !title.empty() ) os << title << " = " << endl;
+		for(int i=0;i<n;i++) {
+			os << data[i * s] << ((i==n-1)?'\n':' ');
+		}
 	}
-	Tensor2<T>& operator()(int i) {
-		return data[i];
+
+private:
+	int n;
+	size_t s;
+	T* data;
+};
+
+// non-owning view of a strided order 2 block, e.g. a slice of a Tensor3
+template <typename T>
+class Tensor2View
+{
+public:
+	Tensor2View(void):data(nullptr){ d[0] = d[1] = 0; s[0] = s[1] = 0; }
+	// row major block of size m x n with leading dimension n
+	Tensor2View(T* data, int m, int n):data(data){
+		d[0] = m; d[1] = n;
+		s[0] = n; s[1] = 1;
+	}
+	Tensor2View(T* data, int m, int n, size_t s0, size_t s1):data(data){
+		d[0] = m; d[1] = n;
+		s[0] = s0; s[1] = s1;
+	}
+	template <typename TT>
+	Tensor2View(const Tensor2View<TT>& other):data(other.rawptr()){
+		d[0] = other.dim(0); d[1] = other.dim(1);
+		s[0] = other.stride(0); s[1] = other.stride(1);
+	}
+
+	T& operator()(int i, int j) const {
+		return data[i * s[0] + j * s[1]];
 	}
 
-	const Tensor1<T>& operator()(int i, int j) const {
-		return data[i](j);
+	Tensor1View<T> row(int i) const {
+		return Tensor1View<T>(data + i * s[0], d[1], s[1]);
 	}
-	Tensor1<T>& operator()(int i, int j) {
-		return data[i](j);
+	Tensor1View<T> col(int j) const {
+		return Tensor1View<T>(data + j * s[1], d[0], s[0]);
 	}
 
-	const T& operator()(int i, int j, int k) const{
-		return data[i](j, k);
+	int dim(int mid) const { return d[mid]; }
+	size_t stride(int mid) const { return s[mid]; }
+	int rows() const { return d[0]; }
+	int cols() const { return d[1]; }
+
+	// rows are packed, so the block can go to BLAS as row major with lda = stride(0)
+	bool isRowMajor() const { return s[1] == 1; }
+	T* rawptr() const { return data; }
+
+	Tensor2<typename remove_const<T>::type> toTensor() const {
+		Tensor2<typename remove_const<T>::type> t(d[0], d[1]);
+		for(int i=0;i<d[0];i++) {
+			for(int j=0;j<d[1];j++) {
+				t(i, j) = (*this)(i, j);
+			}
+		}
+		return t;
 	}
-	T& operator()(int i, int j, int k) {
-		return data[i](j, k);
+
+	void print(const string& title = "", ostream& os = cout) const{
+		if( !title.empty() ) os << title << " = " << endl;
+		for(int i=0;i<d[0];i++) {
+			for(int j=0;j<d[1];j++) {
+				os << (*this)(i, j) << ((j==d[1]-1)?'\n':' ');
+			}
+		}
 	}
 
-	void resize(int l, int m, int n) {
-		d[0] = l; d[1] = m; d[2] = n;
-		data.resize(l);
-		for_each(data.begin(), data.end(), [=](Tensor2<T>& t){
-			t.resize(m, n);
-		});
+private:
+	int d[2];
+	size_t s[2];
+	T* data;
+};
+
+// mode-n unfolding of a Tensor3, seen in place
+// row r holds the elements with index r in the unfolded mode, the column index
+// is c = outer * dim(inner) + inner where inner and outer are the two other modes
+template <typename T>
+class Tensor3UnfoldView
+{
+public:
+	Tensor3UnfoldView(T* data, int m, size_t rs,
+		int innerDim, size_t innerStride, int outerDim, size_t outerStride):
+		m(m), rs(rs), data(data)
+	{
+		n[0] = innerDim; n[1] = outerDim;
+		cs[0] = innerStride; cs[1] = outerStride;
+	}
+	template <typename TT>
+	Tensor3UnfoldView(const Tensor3UnfoldView<TT>& other):
+		m(other.m), rs(other.rs), data(other.data)
+	{
+		n[0] = other.n[0]; n[1] = other.n[1];
+		cs[0] = other.cs[0]; cs[1] = other.cs[1];
 	}
 
-	int dim(int mid) const{
-		return d[mid];
+	T& operator()(int r, int c) const {
+		return data[r * rs + (c % n[0]) * cs[0] + (c / n[0]) * cs[1]];
 	}
 
-	Tensor2<T> unfold(int mid) const {
-		cout << "unfolding tensor in mode " << mid << endl;
-		switch( mid ) {
-		case 0:{
-					Tensor2<T> t(d[0], d[1] * d[2]);
-					// fill in the values
-					for(int i=0;i<d[0];i++) {
-						const Tensor2<T>& ti = data[i];
-						Tensor1<T> ti_unfold = ti.unfold();
+	int dim(int mid) const { return (mid == 0)?m:(n[0] * n[1]); }
+	int rows() const { return m; }
+	int cols() const { return n[0] * n[1]; }
 
-						// copy every thing into t
-						for(int j=0;j<d[1] * d[2];j++) {
-							t(i, j) = ti_unfold(j);
-						}
-					}
-					return t;
-			   }		
-		case 1:{			
-					Tensor2<T> t(d[1], d[0] * d[2]);
-					// fill in the values
-					for(int i=0;i<d[0];i++) {
-						// copy everything into t
-						for(int j=0;j<d[1];j++) {
-							for(int k=0, offset=0;k<d[2];k++, offset+=d[0]) {
-								t(j, offset+i) = (*this)(i, j, k);
-							}
-						}
-					}
-					return t;
-			   }
-		case 2: {
-					Tensor2<T> t(d[2], d[0] * d[1]);
-					// fill in the values
-					for(int i=0, offset=0;i<d[0];i++, offset+=d[1]) {
-						const Tensor2<T>& ti = data[i];
-						for(int j=0;j<d[1];j++) {
-							for(int k=0;k<d[2];k++) {
-								t(k, j+offset) = ti(j, k);
-							}
-						}
-					}
-					return t;
-				}		
-		default: {
-					throw "Invalid mode!";
-				 }
-		}
-		//cout << "done." << endl;
+	// row r as an outer x inner block
+	Tensor2View<T> row(int r) const {
+		return Tensor2View<T>(data + r * rs, n[1], n[0], cs[1], cs[0]);
+	}
+	// column c, a fiber along the unfolded mode
+	Tensor1View<T> col(int c) const {
+		return Tensor1View<T>(data + (c % n[0]) * cs[0] + (c / n[0]) * cs[1], m, rs);
 	}
 
-	// fold a order 2 tensor to a order 3 tensor
-	static Tensor3<T> fold(const Tensor2<T>& t, int mid, int d0, int d1, int d2) {
-		cout << "folding tensor in mode " << mid << endl;
-		switch( mid ) {
-		case 0:
-			{
-				// the tensor2 must be of the shape d0 x (d2 x d1)
-				Tensor3<T> t3(d0, d1, d2);
-				assert(t.dim(0) == d0 && t.dim(1) == d1 * d2);
-				for(int i=0;i<d0;i++) {
-					const Tensor1<T> ti = t(i);
-					for(int j=0, offset=0;j<d1;j++,offset+=d2) {
-						for(int k=0;k<d2;k++) {
-							t3(i, j, k) = ti(k+offset);
-						}
-					}
-				}
-				return t3;
-			}
-		case 1:
-			{
-				// the tensor2 must be of the shape d1 x (d0 x d3)
-				Tensor3<T> t3(d0, d1, d2);
-				assert(t.dim(0) == d1 && t.dim(1) == d0 * d2);
-				for(int i=0;i<d0;i++) {
-					for(int j=0;j<d1;j++) {
-						for(int k=0, offset=0;k<d2;k++, offset+=d0) {
-							t3(i, j, k) = t(j, i + offset);
-						}
-					}
-				}
-				return t3;
-			}
-		case 2:
-			{
-				// the tensor must be of the shape d2 x (d1 x d0)
-				Tensor3<T> t3(d0, d1, d2);
-				assert(t.dim(0) == d2 && t.dim(1) == d1*d0);
-				for(int i=0, offset=0;i<d0;i++, offset+=d1) {
-					for(int j=0;j<d1;j++) {
-						for(int k=0;k<d2;k++) {
-							t3(i, j, k) = t(k, j + offset);
-						}
-					}
-				}
-				return t3;
-			}
-		default:
-			{
-				throw "Invalid mode!";
+	Tensor2<typename remove_const<T>::type> toTensor() const {
+		Tensor2<typename remove_const<T>::type> t(m, n[0] * n[1]);
+		for(int r=0;r<m;r++) {
+			Tensor2View<T> tr = row(r);
+			typename remove_const<T>::type* dst = t(r);
+			for(int o=0;o<n[1];o++, dst+=n[0]) {
+				for(int i=0;i<n[0];i++) dst[i] = tr(o, i);
 			}
 		}
+		return t;
 	}
 
-	// mode product with a vector
-	int modeProduct(const Tensor1<T>& v, int mid, Tensor2<T>& t2) const {
-		switch( mid ) {
-		case 0:
-			{
-				assert(v.length() == d[0]);
+private:
+	template <typename TT> friend class Tensor3UnfoldView;
 
-				for(int i=0;i<d[1];i++) {
-					for(int j=0;j<d[2];j++) {
-						T val = 0;
-						for(int k=0;k<d[0];k++)
-							val += data[k](i, j) * v(k);
-						t2(i, j) = val;
-					}
-				}
-				return 0;
-			}
+	int m;			// size of the unfolded mode
+	size_t rs;		// stride of the unfolded mode
+	int n[2];		// inner, outer
+	size_t cs[2];
+	T* data;
+};
+
+// Order 3 tensor
+// all elements live in one 64-byte aligned row major buffer, element (i, j, k)
+// is at data[i * s[0] + j * s[1] + k * s[2]]; slices, fibers and unfoldings are
+// handed out as views into that buffer
+template <typename T>
+class Tensor3
+{
+public:
+	typedef typename TensorCompute<T>::type compute_t;
+
+	Tensor3(void):data(nullptr),owner(true){
+		d[0] = d[1] = d[2] = 0;
+		updateStrides();
+	}
+	Tensor3(int l, int m, int n):data(nullptr),owner(true){
+		d[0] = d[1] = d[2] = 0;
+		resize(l, m, n);
+		memset(data, 0, sizeof(T)*size());
+	}
+	Tensor3(const Tensor3& other):data(nullptr),owner(true) {
+		d[0] = d[1] = d[2] = 0;
+		resize(other.d[0], other.d[1], other.d[2]);
+		memcpy(data, other.data, sizeof(T)*size());
+	}
+	Tensor3(Tensor3&& other):owner(other.owner) {
+		d[0] = other.d[0]; d[1] = other.d[1]; d[2] = other.d[2];
+		updateStrides();
+		data = other.data;
+		other.data = nullptr;
+		other.d[0] = other.d[1] = other.d[2] = 0;
+		other.updateStrides();
+	}
+	~Tensor3(void){
+		if( owner ) TensorStorage::release(data);
+	}
+
+	Tensor3<T>& operator=(const Tensor3<T>& other) {
+		if( this != &other ) {
+			resize(other.d[0], other.d[1], other.d[2]);
+			memcpy(data, other.data, sizeof(T)*size());
+		}
+		return (*this);
+	}
+
+	Tensor3<T>& operator=(Tensor3<T>&& other) {
+		if( this != &other ) {
+			if( owner ) TensorStorage::release(data);
+			d[0] = other.d[0]; d[1] = other.d[1]; d[2] = other.d[2];
+			updateStrides();
+			data = other.data;
+			owner = other.owner;
+			other.data = nullptr;
+			other.d[0] = other.d[1] = other.d[2] = 0;
+			other.updateStrides();
+		}
+		return (*this);
+	}
+
+	Tensor2View<const T> operator()(int i) const {
+		return slice(0, i);
+	}
+	Tensor2View<T> operator()(int i) {
+		return slice(0, i);
+	}
+
+	Tensor1View<const T> operator()(int i, int j) const {
+		return fiber(2, i, j);
+	}
+	Tensor1View<T> operator()(int i, int j) {
+		return fiber(2, i, j);
+	}
+
+	const T& operator()(int i, int j, int k) const{
+		return data[i * s[0] + j * s[1] + k * s[2]];
+	}
+	T& operator()(int i, int j, int k) {
+		return data[i * s[0] + j * s[1] + k * s[2]];
+	}
+
+	// the slice with index idx in mode mid, the two remaining modes keep their order
+	Tensor2View<T> slice(int mid, int idx) {
+		switch( mid ) {
+		case 0:
+			return Tensor2View<T>(data + idx * s[0], d[1], d[2], s[1], s[2]);
 		case 1:
-			{
-				assert(v.length() == d[1]);
-				for(int i=0;i<d[0];i++) {
-					for(int j=0;j<d[2];j++) {
-						T val = 0;
-						for(int k=0;k<d[1];k++)
-							val += data[i](k, j) * v(k);
-						t2(i, j) = val;
-					}
-				}
-				return 0;
-			}
+			return Tensor2View<T>(data + idx * s[1], d[0], d[2], s[0], s[2]);
 		case 2:
-			{
-				assert(v.length() == d[2]);
-				for(int i=0;i<d[0];i++) {
-					for(int j=0;j<d[1];j++) {
-						T val = 0;
-						for(int k=0;k<d[2];k++)
-							val += data[i](j, k) * v(k);
-						t2(i, j) = val;
-					}
-				}
-				return 0;
-			}
+			return Tensor2View<T>(data + idx * s[2], d[0], d[1], s[0], s[1]);
 		default:
 			throw "Invalid mode!";
 		}
 	}
+	Tensor2View<const T> slice(int mid, int idx) const {
+		return const_cast<Tensor3<T>*>(this)->slice(mid, idx);
+	}
+
+	// the fiber along mode mid, a and b index the two remaining modes in order
+	Tensor1View<T> fiber(int mid, int a, int b) {
+		switch( mid ) {
+		case 0:
+			return Tensor1View<T>(data + a * s[1] + b * s[2], d[0], s[0]);
+		case 1:
+			return Tensor1View<T>(data + a * s[0] + b * s[2], d[1], s[1]);
+		case 2:
+			return Tensor1View<T>(data + a * s[0] + b * s[1], d[2], s[2]);
+		default:
+			throw "Invalid mode!";
+		}
+	}
+	Tensor1View<const T> fiber(int mid, int a, int b) const {
+		return const_cast<Tensor3<T>*>(this)->fiber(mid, a, b);
+	}
+
+	// the mode mid unfolding, laid out the same way as unfold(mid) but without copying
+	Tensor3UnfoldView<T> unfoldView(int mid) {
+		switch( mid ) {
+		case 0:
+			return Tensor3UnfoldView<T>(data, d[0], s[0], d[2], s[2], d[1], s[1]);
+		case 1:
+			return Tensor3UnfoldView<T>(data, d[1], s[1], d[0], s[0], d[2], s[2]);
+		case 2:
+			return Tensor3UnfoldView<T>(data, d[2], s[2], d[1], s[1], d[0], s[0]);
+		default:
+			throw "Invalid mode!";
+		}
+	}
+	Tensor3UnfoldView<const T> unfoldView(int mid) const {
+		return const_cast<Tensor3<T>*>(this)->unfoldView(mid);
+	}
+
+	// keeps the buffer when it is owned and can hold l x m x n elements
+	void resize(int l, int m, int n) {
+		d[0] = l; d[1] = m; d[2] = n;
+		updateStrides();
+		if( !owner ) {
+			data = nullptr;
+			owner = true;
+		}
+		TensorStorage::reserve(data, size());
+	}
+
+	// make the tensor a non-owning l x m x n view of external row major memory,
+	// the memory has to outlive the tensor
+	void wrap(T* ptr, int l, int m, int n) {
+		if( owner ) TensorStorage::release(data);
+		d[0] = l; d[1] = m; d[2] = n;
+		updateStrides();
+		data = ptr;
+		owner = false;
+	}
+	bool isOwner() const { return owner; }
+
+	int dim(int mid) const{
+		return d[mid];
+	}
+	size_t stride(int mid) const{
+		return s[mid];
+	}
+	size_t size() const{
+		return size_t(d[0]) * d[1] * d[2];
+	}
+
+	T* rawptr() { return data; }
+	const T* rawptr() const { return data; }
+
+	Tensor2<T> unfold(int mid) const {
+		cout << "unfolding tensor in mode " << mid << endl;
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		Tensor2<T> t(d[mid], int(size() / max(d[mid], 1)));
+		unfold(mid, t.rawptr());
+		return t;
+	}
+
+	// write the mode mid unfolding into out, which must hold size() elements,
+	// with the same layout as unfold(mid)
+	void unfold(int mid, T* out) const {
+		switch( mid ) {
+		case 0:
+			TensorTranspose::copy(data, out, size());
+			break;
+		case 1:
+			// U(j, k d0 + i) = T(i, j, k), for every j the d0 x d2 block T(:, j, :) transposed
+			TensorTranspose::run(d[1], d[0], d[2], data, s[1], s[0], out, size_t(d[0]) * d[2], d[0]);
+			break;
+		case 2:
+			// U(k, i d1 + j) = T(i, j, k), the (d0 d1) x d2 matrix transposed
+			TensorTranspose::run(1, d[0] * d[1], d[2], data, 0, s[1], out, 0, size_t(d[0]) * d[1]);
+			break;
+		default:
+			throw "Invalid mode!";
+		}
+	}
+
+	// fold a order 2 tensor to a order 3 tensor
+	// mode 0: t is d0 x (d1 x d2), mode 1: t is d1 x (d2 x d0), mode 2: t is d2 x (d0 x d1)
+	static Tensor3<T> fold(const Tensor2<T>& t, int mid, int d0, int d1, int d2) {
+		cout << "folding tensor in mode " << mid << endl;
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+
+		Tensor3<T> t3(d0, d1, d2);
+		assert(t.dim(0) == t3.dim(mid) && size_t(t.dim(0)) * t.dim(1) == t3.size());
+		fold(t.rawptr(), mid, d0, d1, d2, t3.rawptr());
+		return t3;
+	}
+
+	// inverse of unfold(mid, out), in holds the unfolding and out receives the
+	// d0 x d1 x d2 row major tensor
+	static void fold(const T* in, int mid, int d0, int d1, int d2, T* out) {
+		switch( mid ) {
+		case 0:
+			TensorTranspose::copy(in, out, size_t(d0) * d1 * d2);
+			break;
+		case 1:
+			// the d2 x d0 block of row j goes back to T(:, j, :)
+			TensorTranspose::run(d1, d2, d0, in, size_t(d2) * d0, d0, out, d2, size_t(d1) * d2);
+			break;
+		case 2:
+			TensorTranspose::run(1, d2, d0 * d1, in, 0, size_t(d0) * d1, out, 0, d2);
+			break;
+		default:
+			throw "Invalid mode!";
+		}
+	}
+
+	// copy the slices of mode mid listed in indices into t, in that order, so t
+	// is dim(mid) = indices.size() and the other two modes are unchanged
+	void gather(int mid, const vector<int>& indices, Tensor3<T>& t) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		int k = int(indices.size());
+		int nd[3] = {d[0], d[1], d[2]};
+		nd[mid] = k;
+		t.resize(nd[0], nd[1], nd[2]);
+
+		// view both as outer x dim(mid) x inner and copy inner runs
+		size_t outer = (mid == 0)?1:((mid == 1)?size_t(d[0]):size_t(d[0]) * d[1]);
+		size_t inner = s[mid];
+		T* out = t.rawptr();
+		#pragma omp parallel for num_threads(TensorThreads::get()) if(outer * k * inner > 65536)
+		for(long long r=0;r<(long long)(outer * k);r++) {
+			size_t o = r / k;
+			int idx = indices[r % k];
+			assert(idx >= 0 && idx < d[mid]);
+			const T* src = data + (o * d[mid] + idx) * inner;
+			T* dst = out + r * inner;
+			if( inner == 1 ) *dst = *src;
+			else memcpy(dst, src, sizeof(T) * inner);
+		}
+	}
+
+	Tensor3<T> gather(int mid, const vector<int>& indices) const {
+		Tensor3<T> t;
+		gather(mid, indices, t);
+		return t;
+	}
+
+	// mode product with a vector, the result goes into t2 which must already
+	// have the right size. The output is split among TensorThreads::get() threads
+	// and every element is summed in the same order by one thread, so the result
+	// does not depend on the thread count
+	int modeProduct(const Tensor1<compute_t>& v, int mid, Tensor2<compute_t>& t2) const {
+		const compute_t* pv = v.rawptr();
+		compute_t* out = t2.rawptr();
+		int nthreads = TensorThreads::get();
+		// every case reads the whole tensor once, small ones stay on this thread
+		bool parallel = size_t(size()) > 65536;
 
-	// mode product with a vector
-	Tensor2<T> modeProduct(const Tensor1<T>& v, int mid) const {
 		switch( mid ) {
 		case 0:
 			{
 				assert(v.length() == d[0]);
-				Tensor2<T> t2(d[1], d[2]);
-
-				#pragma omp parallel for shared(t2)
-				for(int i=0;i<d[1];i++) {
-					for(int j=0;j<d[2];j++) {
-						T val = 0;
-						for(int k=0;k<d[0];k++)
-							val += data[k](i, j) * v(k);
-						t2(i, j) = val;
+				assert(t2.dim(0) == d[1] && t2.dim(1) == d[2]);
+
+				// t2 = sum_i v(i) * T_i, tile the output so each tile stays in cache
+				const int TILE = 4096;
+				int n = d[1] * d[2];
+				int ntiles = (n + TILE - 1) / TILE;
+				#pragma omp parallel for num_threads(nthreads) schedule(static) if(parallel)
+				for(int t=0;t<ntiles;t++) {
+					int offset = t * TILE, len = min(TILE, n - offset);
+					compute_t* dst = out + offset;
+					memset(dst, 0, sizeof(compute_t) * len);
+					for(int i=0;i<d[0];i++) {
+						TensorKernels::axpy(pv[i], data + i * s[0] + offset, dst, len);
 					}
 				}
-				return t2;
+				return 0;
 			}
 		case 1:
 			{
 				assert(v.length() == d[1]);
-				Tensor2<T> t2(d[0], d[2]);
+				assert(t2.dim(0) == d[0] && t2.dim(1) == d[2]);
 
-				#pragma omp parallel for shared(t2)
+				// row i of t2 = sum_j v(j) * T(i, j, :)
+				#pragma omp parallel for num_threads(nthreads) schedule(static) if(parallel)
 				for(int i=0;i<d[0];i++) {
-					for(int j=0;j<d[2];j++) {
-						T val = 0;
-						for(int k=0;k<d[1];k++)
-							val += data[i](k, j) * v(k);
-						t2(i, j) = val;
+					compute_t* dst = out + i * d[2];
+					const T* ti = data + i * s[0];
+					memset(dst, 0, sizeof(compute_t) * d[2]);
+					for(int j=0;j<d[1];j++, ti+=s[1]) {
+						TensorKernels::axpy(pv[j], ti, dst, d[2]);
 					}
 				}
-				return t2;
+				return 0;
 			}
 		case 2:
 			{
 				assert(v.length() == d[2]);
-				Tensor2<T> t2(d[0], d[1]);
+				assert(t2.dim(0) == d[0] && t2.dim(1) == d[1]);
 
-				#pragma omp parallel for shared(t2)
-				for(int i=0;i<d[0];i++) {
-					for(int j=0;j<d[1];j++) {
-						T val = 0;
-						for(int k=0;k<d[2];k++)
-							val += data[i](j, k) * v(k);
-						t2(i, j) = val;
-					}
+				// one dot product per mode-2 fiber
+				int n = d[0] * d[1];
+				#pragma omp parallel for num_threads(nthreads) schedule(static) if(parallel)
+				for(int r=0;r<n;r++) {
+					out[r] = TensorKernels::dot(data + r * s[1], pv, d[2]);
 				}
-				return t2;
+				return 0;
 			}
 		default:
 			throw "Invalid mode!";
 		}
 	}
 
-	// mode product with a matrix
-	Tensor3<T> modeProduct(const Tensor2<T>& M, int mid) const {
+	// mode product with a vector
+	Tensor2<compute_t> modeProduct(const Tensor1<compute_t>& v, int mid) const {
+		Tensor2<compute_t> t2;
 		switch( mid ) {
 		case 0:
-			{
-				assert(M.dim(1) == d[0]);
-				// unfold the tensor in mode 0
-				Tensor2<T> tunfold = this->unfold(0);
+			t2.resize(d[1], d[2]);
+			break;
+		case 1:
+			t2.resize(d[0], d[2]);
+			break;
+		case 2:
+			t2.resize(d[0], d[1]);
+			break;
+		default:
+			throw "Invalid mode!";
+		}
+		modeProduct(v, mid, t2);
+		return t2;
+	}
 
-				Tensor2<T> t2(M.dim(0), d[1] * d[2]);
+	// fused contraction of the two modes other than mid, with w0 on the lower
+	// and w1 on the higher one, e.g. for mid = 0: out(i) = sum_jk T(i, j, k) w0(j) w1(k)
+	// same as two vector mode products but without the intermediate Tensor2, the
+	// result goes straight into out, which must hold dim(mid) elements
+	int contract(const Tensor1<compute_t>& w0, const Tensor1<compute_t>& w1, int mid, compute_t* out) const {
+		// slices of mode 0 reduced together, fixed so the summation order
+		// does not depend on the number of threads
+		const int BLOCK = 64;
 
-				// do the multiplication to each column vector
-				Tensor1<T> col(M.dim(0));	// store the result for current column
-				Tensor1<T> tcol(d[0]);		// column in the unfolded tensor
-				for(int i=0;i<tunfold.dim(1);i++) {
-					for(int j=0;j<tunfold.dim(0);j++) {
-						tcol(j) = tunfold(j, i);
-					}
-					for(int r=0;r<M.dim(0);r++) {
-						T sum = 0;
-						const Tensor1<T>& Mr = M(r);
-						for(int c=0;c<M.dim(1);c++) {
-							sum += Mr(c) * tcol(c);
-						}
-						col(r) = sum;
-					}
-					// copy back the result to tunfold
-					for(int j=0;j<M.dim(0);j++) {
-						t2(j, i) = col(j);
+		switch( mid ) {
+		case 0:
+			{
+				assert(w0.length() == d[1] && w1.length() == d[2]);
+				const compute_t* pw0 = w0.rawptr();
+				const compute_t* pw1 = w1.rawptr();
+
+				#pragma omp parallel for num_threads(TensorThreads::get())
+				for(int i=0;i<d[0];i++) {
+					const T* ti = data + i * s[0];
+					compute_t val = 0;
+					for(int j=0;j<d[1];j++, ti+=s[1]) {
+						val += pw0[j] * TensorKernels::dot(ti, pw1, d[2]);
 					}
+					out[i] = val;
 				}
-
-				// fold the tensor again
-				return Tensor3<T>::fold(t2, 0, M.dim(0), d[1], d[2]);
+				return 0;
 			}
 		case 1:
+		case 2:
 			{
-				assert(M.dim(1) == d[1]);
-				// unfold the tensor in mode 1
-				Tensor2<T> tunfold = this->unfold(1);
-
-				Tensor2<T> t2(M.dim(0), d[0] * d[2]);
-
-				// do the multiplication to each column vector
-				Tensor1<T> col(M.dim(0));	// store the result for current column
-				Tensor1<T> tcol(d[1]);		// column in the unfolded tensor
-				for(int i=0;i<tunfold.dim(1);i++) {
-					for(int j=0;j<tunfold.dim(0);j++) {
-						tcol(j) = tunfold(j, i);
-					}
-					for(int r=0;r<M.dim(0);r++) {
-						T sum = 0;
-						const Tensor1<T>& Mr = M(r);
-						for(int c=0;c<M.dim(1);c++) {
-							sum += Mr(c) * tcol(c);
+				int n = d[mid];
+				assert(w0.length() == d[0] && w1.length() == d[3-mid]);
+				const compute_t* pw0 = w0.rawptr();
+				const compute_t* pw1 = w1.rawptr();
+
+				// one partial result per block of slices, summed up in order afterwards
+				int nblocks = (d[0] + BLOCK - 1) / BLOCK;
+				compute_t* partial = TensorStorage::allocate<compute_t>(size_t(nblocks) * n);
+				memset(partial, 0, sizeof(compute_t) * size_t(nblocks) * n);
+
+				#pragma omp parallel for num_threads(TensorThreads::get())
+				for(int b=0;b<nblocks;b++) {
+					compute_t* pb = &partial[size_t(b) * n];
+					int iend = min(d[0], (b + 1) * BLOCK);
+					for(int i=b*BLOCK;i<iend;i++) {
+						const T* ti = data + i * s[0];
+						for(int j=0;j<d[1];j++, ti+=s[1]) {
+							if( mid == 1 ) pb[j] += pw0[i] * TensorKernels::dot(ti, pw1, d[2]);
+							else TensorKernels::axpy(pw0[i] * pw1[j], ti, pb, d[2]);
 						}
-						col(r) = sum;
-					}
-					// copy back the result to tunfold
-					for(int j=0;j<M.dim(0);j++) {
-						t2(j, i) = col(j);
 					}
 				}
 
-				return Tensor3<T>::fold(t2, 1, d[0], M.dim(0), d[2]);
+				memset(out, 0, sizeof(compute_t) * n);
+				for(int b=0;b<nblocks;b++) {
+					TensorKernels::axpy(compute_t(1), partial + size_t(b) * n, out, n);
+				}
+				TensorStorage::release(partial);
+				return 0;
 			}
-		case 2:
-			{
-				assert(M.dim(1) == d[2]);
-				// unfold the tensor in mode 2
-				Tensor2<T> tunfold = this->unfold(2);
+		default:
+			throw "Invalid mode!";
+		}
+	}
 
-				Tensor2<T> t2(M.dim(0), d[1] * d[0]);
+	int contract(const Tensor1<compute_t>& w0, const Tensor1<compute_t>& w1, int mid, Tensor1<compute_t>& t1) const {
+		assert(t1.length() == d[mid]);
+		return contract(w0, w1, mid, t1.rawptr());
+	}
 
-				// do the multiplication to each column vector
-				Tensor1<T> col(M.dim(0));	// store the result for current column
-				Tensor1<T> tcol(d[2]);		// column in the unfolded tensor
-				for(int i=0;i<tunfold.dim(1);i++) {
-					for(int j=0;j<tunfold.dim(0);j++) {
-						tcol(j) = tunfold(j, i);
-					}
-					for(int r=0;r<M.dim(0);r++) {
-						T sum = 0;
-						const Tensor1<T>& Mr = M(r);
-						for(int c=0;c<M.dim(1);c++) {
-							sum += Mr(c) * tcol(c);
+	Tensor1<compute_t> contract(const Tensor1<compute_t>& w0, const Tensor1<compute_t>& w1, int mid) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		Tensor1<compute_t> t1(d[mid]);
+		contract(w0, w1, mid, t1.rawptr());
+		return t1;
+	}
+
+	// contract(w0, w1, mid) together with its Jacobian with respect to [w0, w1]:
+	// row i of J holds dy(i)/dw0 followed by dy(i)/dw1, i.e. the partial
+	// contractions T x w1 and T x w0 side by side, and y = (T x w1) w0. J is
+	// dim(mid) rows with leading dimension ldj, which is what jacf in
+	// GaussNewton fills for x = [w0, w1]; extra parameters can follow them
+	int contractWithJacobian(const Tensor1<compute_t>& w0, const Tensor1<compute_t>& w1, int mid, compute_t* y, compute_t* J, int ldj) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		int m0 = (mid == 0)?1:0, m1 = (mid == 2)?1:2;
+		int n0 = d[m0], n1 = d[m1];
+		assert(w0.length() == n0 && w1.length() == n1 && ldj >= n0 + n1);
+		const compute_t* p0 = w0.rawptr();
+		const compute_t* p1 = w1.rawptr();
+		int nthreads = TensorThreads::get();
+
+		if( mid == 2 ) {
+			// one pass over T in tiles of mode 2, with both partials of the tile in cache:
+			// A(i, k) = sum_j T(i, j, k) w1(j), B(j, k) = sum_i T(i, j, k) w0(i)
+			// long tiles keep the d0 d1 row streams friendly to the prefetcher
+			const int TILE = 1024;
+			int ntiles = (d[2] + TILE - 1) / TILE;
+			#pragma omp parallel num_threads(nthreads)
+			{
+				compute_t* A = TensorStorage::allocate<compute_t>(size_t(n0 + n1) * TILE);
+				compute_t* B = A + n0 * TILE;
+				#pragma omp for schedule(static)
+				for(int t=0;t<ntiles;t++) {
+					int offset = t * TILE, len = min(TILE, d[2] - offset);
+					memset(A, 0, sizeof(compute_t) * (n0 + n1) * TILE);
+					for(int i=0;i<n0;i++) {
+						const T* ti = data + i * s[0] + offset;
+						for(int j=0;j<n1;j++, ti+=s[1]) {
+							TensorKernels::axpy(p1[j], ti, A + i * TILE, len);
+							TensorKernels::axpy(p0[i], ti, B + j * TILE, len);
 						}
-						col(r) = sum;
 					}
-					// copy back the result to tunfold
-					for(int j=0;j<M.dim(0);j++) {
-						t2(j, i) = col(j);
+					for(int k=0;k<len;k++) {
+						compute_t* row = J + size_t(offset + k) * ldj;
+						for(int i=0;i<n0;i++) row[i] = A[i * TILE + k];
+						for(int j=0;j<n1;j++) row[n0 + j] = B[j * TILE + k];
 					}
 				}
-
-				return Tensor3<T>::fold(t2, 2, d[0], d[1], M.dim(0));
+				TensorStorage::release(A);
 			}
-		default:
-			{
-				throw "Invalid mode!";
+		}
+		else {
+			// T x w1 has modes (mid, m0) for mid = 0 and (m0, mid) for mid = 1,
+			// T x w0 always has modes (mid, m1)
+			Tensor2<compute_t> A = modeProduct(w1, m1);
+			Tensor2<compute_t> B = modeProduct(w0, m0);
+			#pragma omp parallel for num_threads(nthreads) schedule(static)
+			for(int k=0;k<d[mid];k++) {
+				compute_t* row = J + size_t(k) * ldj;
+				if( mid == 0 ) memcpy(row, A(k), sizeof(compute_t) * n0);
+				else for(int i=0;i<n0;i++) row[i] = A(i, k);
+				memcpy(row + n0, B(k), sizeof(compute_t) * n1);
 			}
 		}
+
+		// y(k) = sum_i dy(k)/dw0(i) w0(i)
+		#pragma omp parallel for num_threads(nthreads) schedule(static)
+		for(int k=0;k<d[mid];k++) {
+			y[k] = TensorKernels::dot(J + size_t(k) * ldj, p0, n0);
+		}
+		return 0;
+	}
+
+	// y must hold dim(mid) elements and J must be dim(mid) x at least
+	// w0.length() + w1.length()
+	int contractWithJacobian(const Tensor1<compute_t>& w0, const Tensor1<compute_t>& w1, int mid, Tensor1<compute_t>& y, Tensor2<compute_t>& J) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		assert(y.length() == d[mid] && J.dim(0) == d[mid]);
+		return contractWithJacobian(w0, w1, mid, y.rawptr(), J.rawptr(), J.dim(1));
+	}
+
+	// mode product with a matrix, M is r x dim(mid)
+	// 16-bit storage is converted to float first, since BLAS cannot read it
+	Tensor3<compute_t> modeProduct(const Tensor2<compute_t>& M, int mid) const {
+		return modeProduct(M, mid, is_same<T, compute_t>());
+	}
+
+	// vector mode products for a batch of weight vectors, row b of W is the b-th
+	// vector. Slice b of the result is modeProduct(W(b, :), mid), so t3 is
+	// W.dim(0) x the two remaining modes in order and must already have that
+	// size. The whole batch runs as GEMM instead of one GEMV per vector
+	int modeProductBatch(const Tensor2<compute_t>& W, int mid, Tensor3<compute_t>& t3) const {
+		return modeProductBatch(W, mid, t3, is_same<T, compute_t>());
+	}
+
+	Tensor3<compute_t> modeProductBatch(const Tensor2<compute_t>& W, int mid) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		int m0 = (mid == 0)?1:0, m1 = (mid == 2)?1:2;
+		Tensor3<compute_t> t3;
+		t3.resize(W.dim(0), d[m0], d[m1]);
+		modeProductBatch(W, mid, t3);
+		return t3;
+	}
+
+	// fused contraction for a batch, row b of t2 is contract(W0(b, :), W1(b, :), mid),
+	// so t2 is W0.dim(0) x dim(mid) and must already have that size
+	int contractBatch(const Tensor2<compute_t>& W0, const Tensor2<compute_t>& W1, int mid, Tensor2<compute_t>& t2) const {
+		return contractBatch(W0, W1, mid, t2, is_same<T, compute_t>());
+	}
+
+	Tensor2<compute_t> contractBatch(const Tensor2<compute_t>& W0, const Tensor2<compute_t>& W1, int mid) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		Tensor2<compute_t> t2;
+		t2.resize(W0.dim(0), d[mid]);
+		contractBatch(W0, W1, mid, t2);
+		return t2;
+	}
+
+	// element-wise copy into another storage type, e.g. float to Half
+	template <typename U>
+	Tensor3<U> convert() const {
+		Tensor3<U> t(d[0], d[1], d[2]);
+		TensorKernels::convertParallel(data, t.rawptr(), size_t(size()));
+		return t;
 	}
 
 #if USE_ARMADILLO
@@ -812,34 +1699,98 @@ public:
 	}
 #endif
 
+	// truncated higher order svd on the given modes, computed without armadillo.
+	// Each factor comes from a randomized range finder on the mode unfolding:
+	// Y = X * Omega with oversampled Gaussian Omega, a few power iterations
+	// Y = X * X' * Q, then the small Gram matrix Q' * X * X' * Q is diagonalized.
+	// X is only ever touched through blocks of the tensor storage, so no
+	// unfolding is formed. Returns the core and the dim(mode) x rank factors,
+	// the core is T x_0 U0' x_1 U1' x_2 U2' over the given modes
+	tuple<Tensor3<T>, vector<Tensor2<T> > > hosvd(
+			const vector<int>& modes,	// modes to perform svd
+			const vector<int>& ranks,	// truncated dimensions
+			int oversampling = 10,
+			int powerIterations = 1,
+			unsigned int seed = 0
+		) const
+	{
+		vector<Tensor2<T>> tu;
+		for(size_t i=0;i<modes.size();i++) {
+			cout << "svd on mode " << modes[i] << endl;
+			tu.push_back(rangeFinder(modes[i], ranks[i], oversampling, powerIterations, seed));
+			cout << "done." << endl;
+		}
+
+		// project the modes with the largest reduction first, that shrinks the tensor fastest
+		vector<int> order(modes.size());
+		for(size_t i=0;i<order.size();i++) order[i] = int(i);
+		sort(order.begin(), order.end(), [&](int a, int b) {
+			return tu[a].dim(1) * d[modes[b]] < tu[b].dim(1) * d[modes[a]];
+		});
+
+		Tensor3<T> core = (*this);
+		for(size_t i=0;i<order.size();i++) {
+			const Tensor2<T>& u = tu[order[i]];
+			Tensor2<T> ut(u.dim(1), u.dim(0));
+			for(int r=0;r<u.dim(0);r++) {
+				for(int c=0;c<u.dim(1);c++) ut(c, r) = u(r, c);
+			}
+			core = core.modeProduct(ut, modes[order[i]]);
+		}
+
+		return make_tuple(core, tu);
+	}
+
+#if !USE_ARMADILLO
+	tuple<Tensor3<T>, vector<Tensor2<T> > > svd(
+			const vector<int>& modes,	// modes to perform svd
+			const vector<int>& dims		// truncated dimensions
+		) const
+	{
+		return hosvd(modes, dims);
+	}
+
+	tuple<Tensor3<T>, Tensor2<T>, Tensor2<T>, Tensor2<T>> svd() const {
+		vector<int> modes = {0, 1, 2};
+		vector<int> dims = {d[0], d[1], d[2]};
+		auto res = hosvd(modes, dims);
+		vector<Tensor2<T>>& tu = get<1>(res);
+		return make_tuple(get<0>(res), tu[0], tu[1], tu[2]);
+	}
+#endif
+
 
 	void print(const string& title="") {
 		if( !title.empty() )
 			cout << title << " = " << endl;
 		for(int i=0;i<d[0];i++) {
-			data[i].print();
+			(*this)(i).print();
 		}
 	}
 
 	bool read(const string& filename) {
 		try {
 			cout << "Reading tensor file " << filename << endl;
-			fstream fin;
-			fin.open(filename, ios::in | ios::binary);
+			if( TensorFile::version(filename) == 2 ) {
+				TensorFile::Reader reader;
+				if( !reader.open(filename, TensorFile::DataTypeOf<T>::value, sizeof(T), 3) ) throw "Invalid tensor file!";
+				const TensorFile::Header& h = reader.header();
+				this->resize(int(h.dims[0]), int(h.dims[1]), int(h.dims[2]));
+				if( !reader.readAll(reinterpret_cast<char*>(data)) ) throw "Corrupted tensor file!";
+			}
+			else {
+				fstream fin;
+				fin.open(filename, ios::in | ios::binary);
 
-			fin.read(reinterpret_cast<char*>(&(d[0])), sizeof(int)*3);
+				int dims[3];
+				fin.read(reinterpret_cast<char*>(dims), sizeof(int)*3);
+				this->resize(dims[0], dims[1], dims[2]);
 
-			this->resize(d[0], d[1], d[2]);
+				fin.read(reinterpret_cast<char*>(data), sizeof(T)*size());
 
-			for(int i=0;i<d[0];i++) {
-				Tensor2<T>& ti = data[i];
-				for(int j=0;j<d[1];j++) {
-					fin.read(reinterpret_cast<char*>(ti(j)), sizeof(T)*d[2]);
-				}				
+				fin.close();
 			}
 
-			fin.close();
-
 			cout << "done." << endl;
 
 			return true;
@@ -850,22 +1801,22 @@ public:
 		}
 	}
 
-	bool write(const string& filename) {
+	// version 1 writes the legacy headerless layout
+	bool write(const string& filename, int version = TensorFile::VERSION) {
 		try {
 			cout << "writing tensor to file " << filename << endl;
-			fstream fout;
-			fout.open(filename, ios::out | ios::binary);
+			if( version == 1 ) {
+				fstream fout;
+				fout.open(filename, ios::out | ios::binary);
 
-			fout.write(reinterpret_cast<char*>(&(d[0])), sizeof(int)*3);
+				fout.write(reinterpret_cast<char*>(&(d[0])), sizeof(int)*3);
 
-			for(int i=0;i<d[0];i++) {
-				const Tensor2<T>& ti = data[i];
-				for(int j=0;j<d[1];j++) {
-					fout.write(reinterpret_cast<const char*>(ti(j)), sizeof(T)*d[2]);
-				}				
-			}
+				fout.write(reinterpret_cast<const char*>(data), sizeof(T)*size());
 
-			fout.close();
+				fout.close();
+			}
+			else if( !TensorFile::write(filename, TensorFile::DataTypeOf<T>::value, sizeof(T), 3, d,
+				reinterpret_cast<const char*>(data)) ) throw "Failed to write tensor file!";
 
 			cout << "done." << endl;
 			return true;
@@ -876,8 +1827,695 @@ public:
 		}
 	}
 
+	// point the tensor at the contents of a file written by write(), e.g. a
+	// mapped file, without copying
+	bool fromBuffer(char* buffer, size_t bytes) {
+		if( TensorFile::hasMagic(buffer, bytes) ) {
+			const TensorFile::Header* h = TensorFile::parse(buffer, bytes, TensorFile::DataTypeOf<T>::value, sizeof(T), 3);
+			if( h == nullptr ) return false;
+			wrap(reinterpret_cast<T*>(buffer + h->payloadOffset), int(h->dims[0]), int(h->dims[1]), int(h->dims[2]));
+			return true;
+		}
+
+		if( bytes < sizeof(int)*3 ) return false;
+		int dims[3];
+		memcpy(dims, buffer, sizeof(int)*3);
+		if( bytes < sizeof(int)*3 + sizeof(T) * size_t(dims[0]) * dims[1] * dims[2] ) return false;
+		wrap(reinterpret_cast<T*>(buffer + sizeof(int)*3), dims[0], dims[1], dims[2]);
+		return true;
+	}
+
+	// read only the block [b0, b0+e0) x [b1, b1+e1) x [b2, b2+e2) of a version 2
+	// tensor file, e.g. a few slices or a fiber, a negative extent takes the rest of
+	// that mode. Blocks of whole mode-0 slices are read chunk by chunk and checked
+	// against the chunk checksums, other blocks are read in place unchecked
+	bool readBlock(const string& filename, int b0, int e0, int b1, int e1, int b2, int e2) {
+		cout << "Reading tensor block from file " << filename << endl;
+		TensorFile::Reader reader;
+		if( !reader.open(filename, TensorFile::DataTypeOf<T>::value, sizeof(T), 3) ) {
+			cerr << "Failed to read tensor from file " << filename << endl;
+			return false;
+		}
+
+		const TensorFile::Header& h = reader.header();
+		int fd[3] = {int(h.dims[0]), int(h.dims[1]), int(h.dims[2])};
+		int b[3] = {b0, b1, b2}, e[3] = {e0, e1, e2};
+		for(int m=0;m<3;m++) {
+			if( e[m] < 0 ) e[m] = fd[m] - b[m];
+			if( b[m] < 0 || e[m] < 0 || b[m] + e[m] > fd[m] ) {
+				cerr << "Block is out of range in mode " << m << endl;
+				return false;
+			}
+		}
+		this->resize(e[0], e[1], e[2]);
+		if( e[0] == 0 || e[1] == 0 || e[2] == 0 ) {
+			// empty block, nothing to read, and a file with an empty mode has no slices
+			return true;
+		}
+
+		char* dst = reinterpret_cast<char*>(data);
+		size_t rowBytes = sizeof(T) * fd[2];
+		size_t sliceBytes = rowBytes * fd[1];
+		bool ok = true;
+		if( e[1] == fd[1] && e[2] == fd[2] ) {
+			// whole slices, read every chunk covering them and check it
+			const vector<TensorFile::ChunkEntry>& chunks = reader.chunks();
+			uint64_t upc = h.unitsPerChunk;
+			uint64_t first = b[0], last = b[0] + e[0];
+			vector<char> buffer;
+			for(uint64_t c=first/upc;ok && c<chunks.size() && c*upc<last;c++) {
+				uint64_t cfirst = c * upc, clast = cfirst + chunks[c].bytes / sliceBytes;
+				if( cfirst >= first && clast <= last ) {
+					ok = reader.readChunk(c, dst + (cfirst - first) * sliceBytes);
+				}
+				else {
+					buffer.resize(chunks[c].bytes);
+					ok = reader.readChunk(c, buffer.data());
+					uint64_t from = max(cfirst, first), to = min(clast, last);
+					memcpy(dst + (from - first) * sliceBytes, buffer.data() + (from - cfirst) * sliceBytes,
+						(to - from) * sliceBytes);
+				}
+			}
+		}
+		else if( e[2] == fd[2] ) {
+			// whole rows, one read per slice
+			for(int i=0;ok && i<e[0];i++) {
+				ok = reader.readRaw((b[0] + i) * sliceBytes + b[1] * rowBytes, e[1] * rowBytes,
+					dst + i * e[1] * rowBytes);
+			}
+		}
+		else {
+			for(int i=0;ok && i<e[0];i++) {
+				for(int j=0;ok && j<e[1];j++) {
+					ok = reader.readRaw((b[0] + i) * sliceBytes + (b[1] + j) * rowBytes + b[2] * sizeof(T),
+						e[2] * sizeof(T), reinterpret_cast<char*>(&(*this)(i, j, 0)));
+				}
+			}
+		}
+
+		if( !ok ) cerr << "Failed to read tensor from file " << filename << endl;
+		return ok;
+	}
+
+	// read count slices of mode mid starting at first
+	bool readSlices(const string& filename, int mid, int first, int count) {
+		switch( mid ) {
+		case 0:
+			return readBlock(filename, first, count, 0, -1, 0, -1);
+		case 1:
+			return readBlock(filename, 0, -1, first, count, 0, -1);
+		case 2:
+			return readBlock(filename, 0, -1, 0, -1, first, count);
+		default:
+			throw "Invalid mode!";
+		}
+	}
+
+private:
+	// the unfolding is never formed, every mode maps onto row major GEMM directly
+	Tensor3<T> modeProduct(const Tensor2<T>& M, int mid, true_type) const {
+		int r = M.dim(0);
+		switch( mid ) {
+		case 0:
+			{
+				assert(M.dim(1) == d[0]);
+				// R(r x (d1 d2)) = M * T(d0 x (d1 d2))
+				Tensor3<T> t3(r, d[1], d[2]);
+				int n = d[1] * d[2];
+				TensorBlas::gemm(false, false, r, n, d[0], T(1), M.rawptr(), d[0],
+					data, n, T(0), t3.rawptr(), n);
+				return t3;
+			}
+		case 1:
+			{
+				assert(M.dim(1) == d[1]);
+				// every slice R_i(r x d2) = M * T_i(d1 x d2)
+				Tensor3<T> t3(d[0], r, d[2]);
+				#pragma omp parallel for num_threads(TensorThreads::get())
+				for(int i=0;i<d[0];i++) {
+					TensorBlas::gemm(false, false, r, d[2], d[1], T(1), M.rawptr(), d[1],
+						data + i * s[0], d[2], T(0), t3.rawptr() + i * t3.stride(0), d[2]);
+				}
+				return t3;
+			}
+		case 2:
+			{
+				assert(M.dim(1) == d[2]);
+				// R((d0 d1) x r) = T((d0 d1) x d2) * M'
+				Tensor3<T> t3(d[0], d[1], r);
+				int m = d[0] * d[1];
+				TensorBlas::gemm(false, true, m, r, d[2], T(1), data, d[2],
+					M.rawptr(), d[2], T(0), t3.rawptr(), r);
+				return t3;
+			}
+		default:
+			{
+				throw "Invalid mode!";
+			}
+		}
+	}
+
+	// 16-bit storage, the same GEMMs on panels widened on load
+	Tensor3<compute_t> modeProduct(const Tensor2<compute_t>& M, int mid, false_type) const {
+		int r = M.dim(0);
+		switch( mid ) {
+		case 0:
+			{
+				assert(M.dim(1) == d[0]);
+				// R(:, cols) = M * T(d0 x cols) for every block of columns
+				Tensor3<compute_t> t3(r, d[1], d[2]);
+				int n = d[1] * d[2], w = TensorKernels::panelWidth(d[0]);
+				int nblocks = (n + w - 1) / w;
+				#pragma omp parallel num_threads(TensorThreads::get())
+				{
+					compute_t* panel = TensorStorage::allocate<compute_t>(size_t(d[0]) * w);
+					#pragma omp for
+					for(int blk=0;blk<nblocks;blk++) {
+						int c = blk * w, b = min(w, n - c);
+						TensorKernels::widenPanel(data + c, n, panel, d[0], b);
+						TensorBlas::gemm(false, false, r, b, d[0], compute_t(1), M.rawptr(), d[0],
+							panel, b, compute_t(0), t3.rawptr() + c, n);
+					}
+					TensorStorage::release(panel);
+				}
+				return t3;
+			}
+		case 1:
+			{
+				assert(M.dim(1) == d[1]);
+				// R_i(:, cols) = M * T_i(d1 x cols) for every slice and block of columns
+				Tensor3<compute_t> t3(d[0], r, d[2]);
+				int w = TensorKernels::panelWidth(d[1]);
+				int ncb = (d[2] + w - 1) / w, npanels = d[0] * ncb;
+				#pragma omp parallel num_threads(TensorThreads::get())
+				{
+					compute_t* panel = TensorStorage::allocate<compute_t>(size_t(d[1]) * w);
+					#pragma omp for
+					for(int p=0;p<npanels;p++) {
+						int i = p / ncb, c = (p % ncb) * w, b = min(w, d[2] - c);
+						TensorKernels::widenPanel(data + i * s[0] + c, d[2], panel, d[1], b);
+						TensorBlas::gemm(false, false, r, b, d[1], compute_t(1), M.rawptr(), d[1],
+							panel, b, compute_t(0), t3.rawptr() + i * t3.stride(0) + c, d[2]);
+					}
+					TensorStorage::release(panel);
+				}
+				return t3;
+			}
+		case 2:
+			{
+				assert(M.dim(1) == d[2]);
+				// R(rows x r) = T(rows x d2) * M' for every block of rows
+				Tensor3<compute_t> t3(d[0], d[1], r);
+				int m = d[0] * d[1], h = TensorKernels::panelWidth(d[2]);
+				int nblocks = (m + h - 1) / h;
+				#pragma omp parallel num_threads(TensorThreads::get())
+				{
+					compute_t* panel = TensorStorage::allocate<compute_t>(size_t(h) * d[2]);
+					#pragma omp for
+					for(int blk=0;blk<nblocks;blk++) {
+						int row = blk * h, b = min(h, m - row);
+						TensorKernels::widen(data + row * s[1], panel, b * d[2]);
+						TensorBlas::gemm(false, true, b, r, d[2], compute_t(1), panel, d[2],
+							M.rawptr(), d[2], compute_t(0), t3.rawptr() + size_t(row) * r, r);
+					}
+					TensorStorage::release(panel);
+				}
+				return t3;
+			}
+		default:
+			{
+				throw "Invalid mode!";
+			}
+		}
+	}
+
+	int modeProductBatch(const Tensor2<T>& W, int mid, Tensor3<T>& t3, true_type) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		assert(W.dim(1) == d[mid]);
+		int nb = W.dim(0);
+		switch( mid ) {
+		case 0:
+			{
+				// R(b x (d1 d2)) = W * T(d0 x (d1 d2))
+				assert(t3.dim(0) == nb && t3.dim(1) == d[1] && t3.dim(2) == d[2]);
+				int n = d[1] * d[2];
+				TensorBlas::gemm(false, false, nb, n, d[0], T(1), W.rawptr(), d[0],
+					data, n, T(0), t3.rawptr(), n);
+				break;
+			}
+		case 1:
+			{
+				// R(:, i, :) = W * T_i(d1 x d2), the rows of each block are d0 d2 apart
+				assert(t3.dim(0) == nb && t3.dim(1) == d[0] && t3.dim(2) == d[2]);
+				int ldr = d[0] * d[2];
+				#pragma omp parallel for num_threads(TensorThreads::get())
+				for(int i=0;i<d[0];i++) {
+					TensorBlas::gemm(false, false, nb, d[2], d[1], T(1), W.rawptr(), d[1],
+						data + i * s[0], d[2], T(0), t3.rawptr() + i * d[2], ldr);
+				}
+				break;
+			}
+		case 2:
+			{
+				// R(b x (d0 d1)) = W * T((d0 d1) x d2)'
+				assert(t3.dim(0) == nb && t3.dim(1) == d[0] && t3.dim(2) == d[1]);
+				int m = d[0] * d[1];
+				TensorBlas::gemm(false, true, nb, m, d[2], T(1), W.rawptr(), d[2],
+					data, d[2], T(0), t3.rawptr(), m);
+				break;
+			}
+		}
+		return 0;
+	}
+
+	// 16-bit storage, the same GEMMs on panels widened on load
+	int modeProductBatch(const Tensor2<compute_t>& W, int mid, Tensor3<compute_t>& t3, false_type) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		assert(W.dim(1) == d[mid]);
+		int nb = W.dim(0);
+		switch( mid ) {
+		case 0:
+			{
+				// R(:, cols) = W * T(d0 x cols) for every block of columns
+				assert(t3.dim(0) == nb && t3.dim(1) == d[1] && t3.dim(2) == d[2]);
+				int n = d[1] * d[2], w = TensorKernels::panelWidth(d[0]);
+				int nblocks = (n + w - 1) / w;
+				#pragma omp parallel num_threads(TensorThreads::get())
+				{
+					compute_t* panel = TensorStorage::allocate<compute_t>(size_t(d[0]) * w);
+					#pragma omp for
+					for(int blk=0;blk<nblocks;blk++) {
+						int c = blk * w, b = min(w, n - c);
+						TensorKernels::widenPanel(data + c, n, panel, d[0], b);
+						TensorBlas::gemm(false, false, nb, b, d[0], compute_t(1), W.rawptr(), d[0],
+							panel, b, compute_t(0), t3.rawptr() + c, n);
+					}
+					TensorStorage::release(panel);
+				}
+				break;
+			}
+		case 1:
+			{
+				// R(:, i, cols) = W * T_i(d1 x cols) for every slice and block of columns
+				assert(t3.dim(0) == nb && t3.dim(1) == d[0] && t3.dim(2) == d[2]);
+				int ldr = d[0] * d[2], w = TensorKernels::panelWidth(d[1]);
+				int ncb = (d[2] + w - 1) / w, npanels = d[0] * ncb;
+				#pragma omp parallel num_threads(TensorThreads::get())
+				{
+					compute_t* panel = TensorStorage::allocate<compute_t>(size_t(d[1]) * w);
+					#pragma omp for
+					for(int p=0;p<npanels;p++) {
+						int i = p / ncb, c = (p % ncb) * w, b = min(w, d[2] - c);
+						TensorKernels::widenPanel(data + i * s[0] + c, d[2], panel, d[1], b);
+						TensorBlas::gemm(false, false, nb, b, d[1], compute_t(1), W.rawptr(), d[1],
+							panel, b, compute_t(0), t3.rawptr() + i * d[2] + c, ldr);
+					}
+					TensorStorage::release(panel);
+				}
+				break;
+			}
+		case 2:
+			{
+				// R(:, rows) = W * T(rows x d2)' for every block of rows
+				assert(t3.dim(0) == nb && t3.dim(1) == d[0] && t3.dim(2) == d[1]);
+				int m = d[0] * d[1], h = TensorKernels::panelWidth(d[2]);
+				int nblocks = (m + h - 1) / h;
+				#pragma omp parallel num_threads(TensorThreads::get())
+				{
+					compute_t* panel = TensorStorage::allocate<compute_t>(size_t(h) * d[2]);
+					#pragma omp for
+					for(int blk=0;blk<nblocks;blk++) {
+						int row = blk * h, b = min(h, m - row);
+						TensorKernels::widen(data + row * s[1], panel, b * d[2]);
+						TensorBlas::gemm(false, true, nb, b, d[2], compute_t(1), W.rawptr(), d[2],
+							panel, d[2], compute_t(0), t3.rawptr() + row, m);
+					}
+					TensorStorage::release(panel);
+				}
+				break;
+			}
+		}
+		return 0;
+	}
+
+	// Stored is true_type when T is compute_t and false_type for 16-bit storage
+	template <typename Stored>
+	int contractBatch(const Tensor2<compute_t>& W0, const Tensor2<compute_t>& W1, int mid, Tensor2<compute_t>& t2, Stored stored) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		int m0 = (mid == 0)?1:0, m1 = (mid == 2)?1:2;
+		int nb = W0.dim(0);
+		assert(W1.dim(0) == nb && W0.dim(1) == d[m0] && W1.dim(1) == d[m1]);
+		assert(t2.dim(0) == nb && t2.dim(1) == d[mid]);
+
+		// when the contracted modes are adjacent, one GEMM with the row-wise
+		// Kronecker products K(b, :) = W0(b, :) x W1(b, :) gives the result
+		// directly, as long as K is smaller than the intermediate of two passes
+		size_t nk = size_t(d[m0]) * d[m1];
+		if( mid != 1 && nk <= size_t(d[m0]) * d[mid] ) {
+			Tensor2<compute_t> K;
+			K.resize(nb, int(nk));
+			#pragma omp parallel for num_threads(TensorThreads::get())
+			for(int b=0;b<nb;b++) {
+				compute_t* kb = K(b);
+				for(int i=0;i<d[m0];i++) {
+					compute_t w = W0(b, i);
+					const compute_t* w1 = W1(b);
+					for(int j=0;j<d[m1];j++) kb[i * d[m1] + j] = w * w1[j];
+				}
+			}
+			kroneckerProduct(K, mid, t2, stored);
+			return 0;
+		}
+
+		// otherwise contract the higher mode for the whole batch first, slice b
+		// then holds modes m0 and mid in order and W0(b, :) finishes it
+		Tensor3<compute_t> P;
+		P.resize(nb, d[min(m0, mid)], d[max(m0, mid)]);
+		modeProductBatch(W1, m1, P, stored);
+		#pragma omp parallel for num_threads(TensorThreads::get())
+		for(int b=0;b<nb;b++) {
+			const compute_t* pb = P.rawptr() + b * P.stride(0);
+			if( mid == 0 ) {
+				TensorBlas::gemv(false, d[0], d[m0], compute_t(1), pb, d[m0], W0(b), compute_t(0), t2(b));
+			}
+			else {
+				TensorBlas::gemv(true, d[m0], d[mid], compute_t(1), pb, d[mid], W0(b), compute_t(0), t2(b));
+			}
+		}
+		return 0;
+	}
+
+	// R = K * T(d0 x (d1 d2))' for mid 0 and R = K * T((d0 d1) x d2) for mid 2
+	void kroneckerProduct(const Tensor2<T>& K, int mid, Tensor2<T>& t2, true_type) const {
+		int nb = K.dim(0), nk = K.dim(1);
+		if( mid == 0 ) {
+			TensorBlas::gemm(false, true, nb, d[0], nk, T(1), K.rawptr(), nk,
+				data, nk, T(0), t2.rawptr(), d[0]);
+		}
+		else {
+			TensorBlas::gemm(false, false, nb, d[2], nk, T(1), K.rawptr(), nk,
+				data, d[2], T(0), t2.rawptr(), d[2]);
+		}
+	}
+
+	// 16-bit storage, R(:, rows) for every block of d0 rows or R(:, cols) for
+	// every block of d2 columns, on widened panels
+	void kroneckerProduct(const Tensor2<compute_t>& K, int mid, Tensor2<compute_t>& t2, false_type) const {
+		int nb = K.dim(0), nk = K.dim(1);
+		int n = (mid == 0)?d[0]:d[2], w = TensorKernels::panelWidth(nk);
+		int nblocks = (n + w - 1) / w;
+		#pragma omp parallel num_threads(TensorThreads::get())
+		{
+			compute_t* panel = TensorStorage::allocate<compute_t>(size_t(nk) * w);
+			#pragma omp for
+			for(int blk=0;blk<nblocks;blk++) {
+				int c = blk * w, b = min(w, n - c);
+				if( mid == 0 ) {
+					TensorKernels::widen(data + c * s[0], panel, b * nk);
+					TensorBlas::gemm(false, true, nb, b, nk, compute_t(1), K.rawptr(), nk,
+						panel, nk, compute_t(0), t2.rawptr() + c, d[0]);
+				}
+				else {
+					TensorKernels::widenPanel(data + c, d[2], panel, nk, b);
+					TensorBlas::gemm(false, false, nb, b, nk, compute_t(1), K.rawptr(), nk,
+						panel, b, compute_t(0), t2.rawptr() + c, d[2]);
+				}
+			}
+			TensorStorage::release(panel);
+		}
+	}
+
+	// visit the unfolding X of mode mid, dim(mid) x (product of the other dims), one
+	// column block at a time. f(M, b, ld, trans) gets a row major block M of the
+	// tensor storage with leading dimension ld: the block of X is M (dim(mid) x b)
+	// when trans is false and M' (M is b x dim(mid)) when it is true
+	template <typename F>
+	void forEachUnfoldingBlock(int mid, F f) const {
+		const int BLOCK = 256;
+		switch( mid ) {
+		case 0:
+			{
+				int n = d[1] * d[2];
+				for(int c=0;c<n;c+=BLOCK) f(data + c, min(BLOCK, n - c), int(s[0]), false);
+				break;
+			}
+		case 1:
+			{
+				for(int i=0;i<d[0];i++) f(data + i * s[0], d[2], d[2], false);
+				break;
+			}
+		case 2:
+			{
+				int n = d[0] * d[1];
+				for(int r=0;r<n;r+=BLOCK) f(data + r * s[1], min(BLOCK, n - r), d[2], true);
+				break;
+			}
+		default:
+			throw "Invalid mode!";
+		}
+	}
+
+	// leading rank left singular vectors of the mode mid unfolding, see hosvd()
+	Tensor2<T> rangeFinder(int mid, int rank, int oversampling, int powerIterations, unsigned int seed) const {
+		int m = d[mid];
+		rank = min(rank, m);
+		int l = min(m, rank + oversampling);
+
+		// Y = X * Omega, Omega is drawn block by block from a seed derived from the
+		// block index, so it never has to be stored and the result is reproducible
+		vector<T> Y(size_t(m) * l, T(0)), W, Omega;
+		int block = 0;
+		forEachUnfoldingBlock(mid, [&](const T* M, int b, int ld, bool trans) {
+			mt19937 rng(seed * 2654435761u + mid * 40503u + block++);
+			normal_distribution<double> gauss(0.0, 1.0);
+			Omega.resize(size_t(b) * l);
+			for(size_t i=0;i<Omega.size();i++) Omega[i] = T(gauss(rng));
+			TensorBlas::gemm(trans, false, m, l, b, T(1), M, ld, Omega.data(), l, T(1), Y.data(), l);
+		});
+		TensorBlas::orthonormalize(m, l, Y.data());
+
+		// power iterations, Y = X * (X' * Q)
+		vector<T> Ynext(Y.size());
+		for(int it=0;it<powerIterations;it++) {
+			fill(Ynext.begin(), Ynext.end(), T(0));
+			forEachUnfoldingBlock(mid, [&](const T* M, int b, int ld, bool trans) {
+				W.resize(size_t(b) * l);
+				TensorBlas::gemm(!trans, false, b, l, m, T(1), M, ld, Y.data(), l, T(0), W.data(), l);
+				TensorBlas::gemm(trans, false, m, l, b, T(1), M, ld, W.data(), l, T(1), Ynext.data(), l);
+			});
+			Y.swap(Ynext);
+			TensorBlas::orthonormalize(m, l, Y.data());
+		}
+
+		// G = Q' * X * X' * Q = V * S^2 * V', then U = Q * V
+		vector<T> G(size_t(l) * l, T(0)), ev(l);
+		forEachUnfoldingBlock(mid, [&](const T* M, int b, int ld, bool trans) {
+			W.resize(size_t(b) * l);
+			TensorBlas::gemm(!trans, false, b, l, m, T(1), M, ld, Y.data(), l, T(0), W.data(), l);
+			TensorBlas::syrk(true, l, b, T(1), W.data(), l, T(1), G.data(), l);
+		});
+		TensorBlas::syev(l, G.data(), ev.data());
+
+		// eigenvalues come in ascending order, keep the last rank vectors in reverse
+		Tensor2<T> V(l, rank);
+		for(int r=0;r<l;r++) {
+			for(int c=0;c<rank;c++) V(r, c) = G[size_t(r) * l + (l - 1 - c)];
+		}
+		Tensor2<T> U(m, rank);
+		TensorBlas::gemm(false, false, m, rank, l, T(1), Y.data(), l, V.rawptr(), rank, T(0), U.rawptr(), rank);
+		return U;
+	}
+
+	void updateStrides() {
+		s[2] = 1;
+		s[1] = d[2];
+		s[0] = size_t(d[1]) * d[2];
+	}
+
 private:
 	// mode 0, mode 1, mode 2
 	int d[3];
-	vector<Tensor2<T>> data;
+	size_t s[3];
+	T* data;
+	// false when data points into memory owned by someone else
+	bool owner;
+};
+
+// a tensor file mapped read-only into memory, the tensor reads straight from
+// the mapped pages, so every process mapping the same file shares one copy in
+// the page cache. TensorType is Tensor2<T> or Tensor3<T>
+template <typename TensorType>
+class MappedTensor
+{
+public:
+	MappedTensor(void){}
+	MappedTensor(const string& filename){ map(filename); }
+	~MappedTensor(void){ unmap(); }
+
+	bool map(const string& filename) {
+		unmap();
+		cout << "mapping tensor file " << filename << endl;
+		mapper.reset(new PhGUtils::FileMapper(filename));
+		if( !mapper->map() ) {
+			cerr << "Failed to map tensor file " << filename << endl;
+			mapper.reset();
+			return false;
+		}
+		if( !t.fromBuffer(mapper->buffer(), mapper->size()) ) {
+			cerr << "Invalid tensor file " << filename << endl;
+			unmap();
+			return false;
+		}
+		return true;
+	}
+
+	void unmap() {
+		t = TensorType();
+		if( mapper ) {
+			mapper->unmap();
+			mapper.reset();
+		}
+	}
+
+	bool isMapped() const { return mapper != nullptr; }
+
+	// the mapped pages are read-only
+	const TensorType& tensor() const { return t; }
+
+private:
+	MappedTensor(const MappedTensor&);
+	MappedTensor& operator=(const MappedTensor&);
+
+	shared_ptr<PhGUtils::FileMapper> mapper;
+	TensorType t;
+};
+
+// Repeated bilinear evaluation of a core tensor where the weights of one mode
+// change rarely, e.g. identity weights in tracking. The core contracted with
+// the weights of the fixed mode is kept, and recomputed only when those
+// weights change, so each evaluation is a single Tensor2 GEMV. The core must
+// outlive the cache; call invalidate() if it is modified in place.
+template <typename T>
+class ContractionCache
+{
+public:
+	typedef typename TensorCompute<T>::type compute_t;
+
+	ContractionCache(const Tensor3<T>& core, int fixedMode):core(core),fixed(fixedMode),valid(false){
+		if( fixed < 0 || fixed > 2 ) throw "Invalid mode!";
+		partialTensor.resize(core.dim((fixed == 0)?1:0), core.dim((fixed == 2)?1:2));
+	}
+
+	// core x_fixed wf, the remaining two modes keep their order
+	const Tensor2<compute_t>& partial(const Tensor1<compute_t>& wf) {
+		assert(wf.length() == core.dim(fixed));
+		if( !valid || memcmp(wf.rawptr(), weights.rawptr(), sizeof(compute_t) * wf.length()) != 0 ) {
+			weights = wf;
+			core.modeProduct(wf, fixed, partialTensor);
+			valid = true;
+		}
+		return partialTensor;
+	}
+
+	// contract the fixed mode with wf and mode mid with w, the result runs
+	// along the third mode, same as Tensor3::contract
+	int contract(const Tensor1<compute_t>& wf, const Tensor1<compute_t>& w, int mid, Tensor1<compute_t>& t1) {
+		if( mid < 0 || mid > 2 || mid == fixed ) throw "Invalid mode!";
+		partial(wf);
+		return partialTensor.modeProduct(w, (mid < fixed)?mid:(mid - 1), t1);
+	}
+
+	Tensor1<compute_t> contract(const Tensor1<compute_t>& wf, const Tensor1<compute_t>& w, int mid) {
+		if( mid < 0 || mid > 2 || mid == fixed ) throw "Invalid mode!";
+		partial(wf);
+		return partialTensor.modeProduct(w, (mid < fixed)?mid:(mid - 1));
+	}
+
+	void invalidate() { valid = false; }
+	bool isValid() const { return valid; }
+	int fixedMode() const { return fixed; }
+
+private:
+	ContractionCache(const ContractionCache&);
+	ContractionCache& operator=(const ContractionCache&);
+
+	const Tensor3<T>& core;
+	int fixed;
+	bool valid;
+	Tensor1<compute_t> weights;
+	Tensor2<compute_t> partialTensor;
+};
+
+// Mode products restricted to a few indices along one mode, e.g. the landmark
+// vertices when tracking, so the cost scales with the landmarks instead of the
+// whole mesh. The listed slices are gathered into a compact tensor that is
+// kept until a call passes a different index list; results are laid out as
+// for the gathered tensor, i.e. the subset mode has indices.size() entries in
+// the order given. The core must outlive the cache; call invalidate() if it
+// is modified in place.
+template <typename T>
+class SubsetCache
+{
+public:
+	typedef typename TensorCompute<T>::type compute_t;
+
+	SubsetCache(const Tensor3<T>& core, int subsetMode):core(core),mode(subsetMode),valid(false){
+		if( mode < 0 || mode > 2 ) throw "Invalid mode!";
+	}
+
+	// the gathered sub-tensor for indices, only rebuilt when the list changes
+	const Tensor3<T>& gather(const vector<int>& indices) {
+		if( !valid || indices != subset ) {
+			subset = indices;
+			core.gather(mode, subset, sub);
+			valid = true;
+		}
+		return sub;
+	}
+
+	int modeProduct(const vector<int>& indices, const Tensor1<compute_t>& v, int mid, Tensor2<compute_t>& t2) {
+		return gather(indices).modeProduct(v, mid, t2);
+	}
+
+	Tensor2<compute_t> modeProduct(const vector<int>& indices, const Tensor1<compute_t>& v, int mid) {
+		return gather(indices).modeProduct(v, mid);
+	}
+
+	Tensor3<compute_t> modeProduct(const vector<int>& indices, const Tensor2<compute_t>& M, int mid) {
+		return gather(indices).modeProduct(M, mid);
+	}
+
+	int contract(const vector<int>& indices, const Tensor1<compute_t>& w0, const Tensor1<compute_t>& w1, int mid, Tensor1<compute_t>& t1) {
+		return gather(indices).contract(w0, w1, mid, t1);
+	}
+
+	Tensor1<compute_t> contract(const vector<int>& indices, const Tensor1<compute_t>& w0, const Tensor1<compute_t>& w1, int mid) {
+		return gather(indices).contract(w0, w1, mid);
+	}
+
+	// indices of width consecutive entries per item, e.g. width 3 turns vertex
+	// indices into the x, y, z rows of a mode that stores 3 values per vertex
+	static vector<int> expand(const vector<int>& items, int width) {
+		vector<int> indices(items.size() * width);
+		for(size_t i=0;i<items.size();i++) {
+			for(int j=0;j<width;j++) indices[i * width + j] = items[i] * width + j;
+		}
+		return indices;
+	}
+
+	void invalidate() { valid = false; }
+	bool isValid() const { return valid; }
+	int subsetMode() const { return mode; }
+	const vector<int>& indices() const { return subset; }
+	const Tensor3<T>& subTensor() const { return sub; }
+
+private:
+	SubsetCache(const SubsetCache&);
+	SubsetCache& operator=(const SubsetCache&);
+
+	const Tensor3<T>& core;
+	int mode;
+	bool valid;
+	vector<int> subset;
+	Tensor3<T> sub;
 };
\ No newline at end of file
@@ -0,0 +1,270 @@
+#pragma once
+
+#include "../phgutils.h"
+#include "HalfFloat.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Version 2 tensor file container
+//
+//	[header][chunk index][zero padding] [payload]
+//	                                     ^ 4 KiB aligned
+//
+// The payload is the row major element array, so a mapped file can be used in
+// place. It is split into chunks of whole mode-0 slices (rows for an order 2
+// tensor); the chunk index records offset, size and crc32 of every chunk, so a
+// reader can fetch and verify any part of the file on its own.
+// Version 1 files are the bare int dimensions followed by the elements.
+namespace TensorFile {
+	const char MAGIC[8] = {'P', 'H', 'G', 'T', 'E', 'N', 'S', 'R'};
+	const uint32_t VERSION = 2;
+	// written in native byte order, reads back differently on a machine of the other endianness
+	const uint32_t ENDIAN_TAG = 0x01020304;
+	const uint64_t PAYLOAD_ALIGNMENT = 4096;
+	// target chunk size, rounded down to whole mode-0 slices
+	const uint64_t CHUNK_BYTES = 1 << 20;
+
+	enum DataType {
+		UNKNOWN = 0,
+		FLOAT32,
+		FLOAT64,
+		INT32,
+		UINT8,
+		FLOAT16,
+		BFLOAT16
+	};
+
+	template <typename T> struct DataTypeOf { static const uint32_t value = UNKNOWN; };
+	template <> struct DataTypeOf<float> { static const uint32_t value = FLOAT32; };
+	template <> struct DataTypeOf<double> { static const uint32_t value = FLOAT64; };
+	template <> struct DataTypeOf<int> { static const uint32_t value = INT32; };
+	template <> struct DataTypeOf<unsigned char> { static const uint32_t value = UINT8; };
+	template <> struct DataTypeOf<Half> { static const uint32_t value = FLOAT16; };
+	template <> struct DataTypeOf<BFloat16> { static const uint32_t value = BFLOAT16; };
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t endian;
+		uint32_t dtype;
+		uint32_t elemSize;
+		uint32_t order;
+		uint32_t reserved;
+		uint64_t dims[4];			// unused dimensions are 1
+		uint64_t unitsPerChunk;		// mode-0 slices per chunk
+		uint64_t numChunks;
+		uint64_t payloadOffset;		// from the start of the file
+		uint64_t payloadBytes;
+		uint32_t indexCrc;			// crc32 of the chunk index
+		uint32_t headerCrc;			// crc32 of all the fields above
+	};
+
+	struct ChunkEntry {
+		uint64_t offset;			// from the start of the payload
+		uint64_t bytes;
+		uint32_t crc;
+		uint32_t reserved;
+	};
+
+	static_assert(sizeof(Header) == 104, "unexpected tensor file header layout");
+	static_assert(sizeof(ChunkEntry) == 24, "unexpected tensor file chunk entry layout");
+
+	struct CrcTable {
+		CrcTable() {
+			for(uint32_t i=0;i<256;i++) {
+				uint32_t c = i;
+				for(int k=0;k<8;k++) c = (c & 1)?(0xEDB88320u ^ (c >> 1)):(c >> 1);
+				table[i] = c;
+			}
+		}
+		uint32_t table[256];
+	};
+
+	// standard crc32 (zlib polynomial), pass the previous value to continue a running checksum
+	inline uint32_t crc32(const void* buffer, size_t bytes, uint32_t crc = 0) {
+		static const CrcTable t;
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(buffer);
+		crc = ~crc;
+		for(size_t i=0;i<bytes;i++) crc = t.table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	inline uint32_t headerCrc(const Header& h) {
+		return crc32(&h, offsetof(Header, headerCrc));
+	}
+
+	inline bool hasMagic(const char* buffer, size_t bytes) {
+		return bytes >= sizeof(MAGIC) && memcmp(buffer, MAGIC, sizeof(MAGIC)) == 0;
+	}
+
+	// 2 for a version 2 file, 1 for anything else that can be opened, 0 otherwise
+	inline int version(const string& filename) {
+		fstream fin;
+		fin.open(filename, ios::in | ios::binary);
+		if( !fin ) return 0;
+		char magic[sizeof(MAGIC)];
+		fin.read(magic, sizeof(MAGIC));
+		return (fin && hasMagic(magic, sizeof(MAGIC)))?2:1;
+	}
+
+	inline uint64_t numElements(const Header& h) {
+		return h.dims[0] * h.dims[1] * h.dims[2] * h.dims[3];
+	}
+
+	// bytes of one mode-0 slice
+	inline uint64_t unitBytes(const Header& h) {
+		return h.dims[0] == 0 ? 0 : numElements(h) / h.dims[0] * h.elemSize;
+	}
+
+	// checks the header alone, and that it describes an order `order` tensor of dtype/elemSize
+	inline bool checkHeader(const Header& h, uint32_t dtype, uint32_t elemSize, uint32_t order) {
+		if( memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 ) {
+			cerr << "Not a tensor file." << endl;
+			return false;
+		}
+		if( h.endian != ENDIAN_TAG ) {
+			cerr << "Tensor file was written on a machine with different endianness." << endl;
+			return false;
+		}
+		if( h.version != VERSION || h.headerCrc != headerCrc(h) ) {
+			cerr << "Unsupported or corrupted tensor file header." << endl;
+			return false;
+		}
+		if( h.dtype != dtype || h.elemSize != elemSize || h.order != order ) {
+			cerr << "Tensor file holds an order " << h.order << " tensor of type " << h.dtype
+				 << ", expected order " << order << " of type " << dtype << "." << endl;
+			return false;
+		}
+		if( h.payloadOffset % PAYLOAD_ALIGNMENT != 0 || h.payloadBytes != numElements(h) * h.elemSize ) {
+			cerr << "Invalid tensor file layout." << endl;
+			return false;
+		}
+		return true;
+	}
+
+	// checks one chunk against the index
+	inline bool checkChunk(const ChunkEntry& c, const char* data) {
+		return crc32(data, c.bytes) == c.crc;
+	}
+
+	// write a version 2 file, payload holds the row major elements
+	inline bool write(const string& filename, uint32_t dtype, uint32_t elemSize,
+		uint32_t order, const int* dims, const char* payload)
+	{
+		Header h;
+		memset(&h, 0, sizeof(Header));
+		memcpy(h.magic, MAGIC, sizeof(MAGIC));
+		h.version = VERSION;
+		h.endian = ENDIAN_TAG;
+		h.dtype = dtype;
+		h.elemSize = elemSize;
+		h.order = order;
+		for(int i=0;i<4;i++) h.dims[i] = (i < int(order))?uint64_t(dims[i]):1;
+		h.payloadBytes = numElements(h) * elemSize;
+
+		uint64_t ub = unitBytes(h);
+		h.unitsPerChunk = (ub == 0 || ub >= CHUNK_BYTES)?1:(CHUNK_BYTES / ub);
+		h.numChunks = (h.dims[0] + h.unitsPerChunk - 1) / h.unitsPerChunk;
+
+		vector<ChunkEntry> index(h.numChunks);
+		for(uint64_t c=0;c<h.numChunks;c++) {
+			ChunkEntry& e = index[c];
+			memset(&e, 0, sizeof(ChunkEntry));
+			e.offset = c * h.unitsPerChunk * ub;
+			e.bytes = min(h.unitsPerChunk, h.dims[0] - c * h.unitsPerChunk) * ub;
+			e.crc = crc32(payload + e.offset, e.bytes);
+		}
+
+		uint64_t indexBytes = sizeof(ChunkEntry) * h.numChunks;
+		h.payloadOffset = (sizeof(Header) + indexBytes + PAYLOAD_ALIGNMENT - 1) / PAYLOAD_ALIGNMENT * PAYLOAD_ALIGNMENT;
+		h.indexCrc = crc32(index.data(), indexBytes);
+		h.headerCrc = headerCrc(h);
+
+		fstream fout;
+		fout.open(filename, ios::out | ios::binary);
+		if( !fout ) return false;
+		fout.write(reinterpret_cast<const char*>(&h), sizeof(Header));
+		fout.write(reinterpret_cast<const char*>(index.data()), indexBytes);
+		vector<char> padding(h.payloadOffset - sizeof(Header) - indexBytes, 0);
+		fout.write(padding.data(), padding.size());
+		fout.write(payload, h.payloadBytes);
+		fout.close();
+		return !fout.fail();
+	}
+
+	// header of a whole version 2 file held in memory, e.g. a mapped file, nullptr if invalid
+	inline const Header* parse(const char* buffer, size_t bytes,
+		uint32_t dtype, uint32_t elemSize, uint32_t order)
+	{
+		if( !hasMagic(buffer, bytes) || bytes < sizeof(Header) ) return nullptr;
+		const Header* h = reinterpret_cast<const Header*>(buffer);
+		if( !checkHeader(*h, dtype, elemSize, order) ) return nullptr;
+		if( bytes < h->payloadOffset + h->payloadBytes ) return nullptr;
+		return h;
+	}
+
+	// check every chunk of a file held in memory, this touches the whole payload
+	inline bool verify(const char* buffer) {
+		const Header* h = reinterpret_cast<const Header*>(buffer);
+		const ChunkEntry* index = reinterpret_cast<const ChunkEntry*>(buffer + sizeof(Header));
+		if( crc32(index, sizeof(ChunkEntry) * h->numChunks) != h->indexCrc ) return false;
+		for(uint64_t c=0;c<h->numChunks;c++) {
+			if( !checkChunk(index[c], buffer + h->payloadOffset + index[c].offset) ) return false;
+		}
+		return true;
+	}
+
+	// random access reader for version 2 files
+	class Reader {
+	public:
+		bool open(const string& filename, uint32_t dtype, uint32_t elemSize, uint32_t order) {
+			fin.open(filename, ios::in | ios::binary);
+			if( !fin ) return false;
+
+			fin.read(reinterpret_cast<char*>(&h), sizeof(Header));
+			if( !fin || !checkHeader(h, dtype, elemSize, order) ) return false;
+
+			index.resize(h.numChunks);
+			fin.read(reinterpret_cast<char*>(index.data()), sizeof(ChunkEntry) * h.numChunks);
+			if( !fin || crc32(index.data(), sizeof(ChunkEntry) * h.numChunks) != h.indexCrc ) {
+				cerr << "Corrupted tensor file chunk index." << endl;
+				return false;
+			}
+			return true;
+		}
+
+		const Header& header() const { return h; }
+		const vector<ChunkEntry>& chunks() const { return index; }
+
+		// read chunk c into dst and check it
+		bool readChunk(uint64_t c, char* dst) {
+			if( !readRaw(index[c].offset, index[c].bytes, dst) ) return false;
+			if( !checkChunk(index[c], dst) ) {
+				cerr << "Checksum mismatch in tensor file chunk " << c << "." << endl;
+				return false;
+			}
+			return true;
+		}
+
+		// read the whole payload into dst, checking every chunk
+		bool readAll(char* dst) {
+			for(uint64_t c=0;c<index.size();c++) {
+				if( !readChunk(c, dst + index[c].offset) ) return false;
+			}
+			return true;
+		}
+
+		// read bytes at offset from the start of the payload, without checking
+		bool readRaw(uint64_t offset, uint64_t bytes, char* dst) {
+			fin.seekg(h.payloadOffset + offset);
+			fin.read(dst, bytes);
+			return !fin.fail();
+		}
+
+	private:
+		fstream fin;
+		Header h;
+		vector<ChunkEntry> index;
+	};
+}
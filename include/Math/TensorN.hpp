@@ -0,0 +1,370 @@
+#pragma once
+
+#include "Tensor.hpp"
+#include <array>
+
+// Tensor of any order N fixed at compile time, row major like Tensor3.
+// Every mode operation views the tensor as outer x d(mid) x inner, where outer
+// and inner are the products of the dimensions before and after mid, so one
+// kernel covers all modes of all orders. TensorFile stores orders up to 4.
+template <typename T, int N>
+class TensorN
+{
+	static_assert(N >= 1, "TensorN needs at least one mode");
+
+public:
+	typedef typename TensorCompute<T>::type compute_t;
+	typedef array<int, N> dims_t;
+
+	TensorN(void):data(nullptr),owner(true){
+		d.fill(0);
+		updateStrides();
+	}
+	explicit TensorN(const dims_t& dims):data(nullptr),owner(true){
+		d.fill(0);
+		resize(dims);
+		memset(data, 0, sizeof(T)*size());
+	}
+	template <typename... Dims>
+	explicit TensorN(int d0, Dims... dims):data(nullptr),owner(true){
+		static_assert(sizeof...(Dims) + 1 == N, "wrong number of dimensions");
+		d.fill(0);
+		dims_t nd = {{d0, dims...}};
+		resize(nd);
+		memset(data, 0, sizeof(T)*size());
+	}
+	TensorN(const TensorN& other):data(nullptr),owner(true){
+		d.fill(0);
+		resize(other.d);
+		memcpy(data, other.data, sizeof(T)*size());
+	}
+	TensorN(TensorN&& other):d(other.d),data(other.data),owner(other.owner){
+		updateStrides();
+		other.data = nullptr;
+		other.d.fill(0);
+		other.updateStrides();
+	}
+	~TensorN(void){
+		if( owner ) TensorStorage::release(data);
+	}
+
+	TensorN& operator=(const TensorN& other) {
+		if( this != &other ) {
+			resize(other.d);
+			memcpy(data, other.data, sizeof(T)*size());
+		}
+		return (*this);
+	}
+
+	TensorN& operator=(TensorN&& other) {
+		if( this != &other ) {
+			if( owner ) TensorStorage::release(data);
+			d = other.d;
+			updateStrides();
+			data = other.data;
+			owner = other.owner;
+			other.data = nullptr;
+			other.d.fill(0);
+			other.updateStrides();
+		}
+		return (*this);
+	}
+
+	template <typename... Idx>
+	const T& operator()(Idx... idx) const {
+		static_assert(sizeof...(Idx) == N, "wrong number of indices");
+		return data[offset(0, idx...)];
+	}
+	template <typename... Idx>
+	T& operator()(Idx... idx) {
+		static_assert(sizeof...(Idx) == N, "wrong number of indices");
+		return data[offset(0, idx...)];
+	}
+
+	// keeps the buffer when it is owned and big enough
+	void resize(const dims_t& dims) {
+		d = dims;
+		updateStrides();
+		if( !owner ) {
+			data = nullptr;
+			owner = true;
+		}
+		TensorStorage::reserve(data, size());
+	}
+
+	// make the tensor a non-owning view of external row major memory, e.g. the
+	// buffer of a Tensor3 for N = 3, the memory has to outlive the tensor
+	void wrap(T* ptr, const dims_t& dims) {
+		if( owner ) TensorStorage::release(data);
+		d = dims;
+		updateStrides();
+		data = ptr;
+		owner = false;
+	}
+	bool isOwner() const { return owner; }
+
+	static int order() { return N; }
+	int dim(int mid) const { return d[mid]; }
+	const dims_t& dims() const { return d; }
+	size_t stride(int mid) const { return s[mid]; }
+	size_t size() const { return size_t(d[0]) * s[0]; }
+
+	T* rawptr() { return data; }
+	const T* rawptr() const { return data; }
+
+	// element-wise copy into another storage type, e.g. float to Half
+	template <typename U>
+	TensorN<U, N> convert() const {
+		TensorN<U, N> t(d);
+		TensorKernels::convertParallel(data, t.rawptr(), size());
+		return t;
+	}
+
+	// mode product with a vector, the result has mode mid removed and goes into
+	// t which must already have the right size. Each output element is summed in
+	// a fixed order by one thread, so the result does not depend on the thread count
+	int modeProduct(const Tensor1<compute_t>& v, int mid, TensorN<compute_t, N-1>& t) const {
+		static_assert(N >= 2, "the mode product of an order 1 tensor is a scalar");
+		if( mid < 0 || mid >= N ) throw "Invalid mode!";
+		assert(v.length() == d[mid]);
+		assert(t.size() == size() / max(d[mid], 1));
+
+		if( mid == N - 1 ) modeProductKernel(v, mid, t, true_type());
+		else modeProductKernel(v, mid, t, false_type());
+		return 0;
+	}
+
+	TensorN<compute_t, N-1> modeProduct(const Tensor1<compute_t>& v, int mid) const {
+		if( mid < 0 || mid >= N ) throw "Invalid mode!";
+		TensorN<compute_t, N-1> t(removeMode(mid));
+		modeProduct(v, mid, t);
+		return t;
+	}
+
+	// the same with the mode known at compile time, only its kernel is instantiated
+	template <int M>
+	TensorN<compute_t, N-1> modeProduct(const Tensor1<compute_t>& v) const {
+		static_assert(M >= 0 && M < N, "Invalid mode!");
+		assert(v.length() == d[M]);
+		TensorN<compute_t, N-1> t(removeMode(M));
+		modeProductKernel(v, M, t, integral_constant<bool, M == N - 1>());
+		return t;
+	}
+
+	// mode product with a matrix, M is r x dim(mid)
+	// 16-bit storage is converted to float first, since BLAS cannot read it
+	TensorN<compute_t, N> modeProduct(const Tensor2<compute_t>& M, int mid) const {
+		return modeProduct(M, mid, is_same<T, compute_t>());
+	}
+
+	// einsum style contraction of the listed modes, one weight vector per mode
+	// in the same order, e.g. for N = 4: t.contract<1, 3>(w1, w3) sums over
+	// modes 1 and 3 and leaves an order 2 tensor in modes 0 and 2. Modes must
+	// be strictly increasing, the highest one is contracted first so the lower
+	// mode indices stay valid. Each step is one vector mode product into an
+	// intermediate tensor, with its kernel picked at compile time from the mode
+	template <int M>
+	TensorN<compute_t, N-1> contract(const Tensor1<compute_t>& w) const {
+		return modeProduct<M>(w);
+	}
+
+	template <int M0, int M1, int... Ms, typename... W>
+	TensorN<compute_t, N-2-int(sizeof...(Ms))> contract(const Tensor1<compute_t>& w0, const Tensor1<compute_t>& w1, const W&... ws) const {
+		static_assert(sizeof...(Ms) == sizeof...(W), "one weight vector per contracted mode");
+		static_assert(M0 < M1, "contraction modes must be strictly increasing");
+		static_assert(N - 2 - int(sizeof...(Ms)) >= 1, "use a dot product to contract every mode");
+		return contract<M1, Ms...>(w1, ws...).template modeProduct<M0>(w0);
+	}
+
+	void print(const string& title = "") const {
+		if( !title.empty() ) cout << title << " = " << endl;
+		for(size_t i=0;i<size();i++) {
+			cout << data[i] << (((i + 1) % d[N-1] == 0)?'\n':' ');
+		}
+	}
+
+	bool read(const string& filename) {
+		static_assert(N <= 4, "tensor files hold up to 4 modes");
+		cout << "Reading tensor file " << filename << endl;
+		TensorFile::Reader reader;
+		if( !reader.open(filename, TensorFile::DataTypeOf<T>::value, sizeof(T), N) ) {
+			cerr << "Failed to read tensor from file " << filename << endl;
+			return false;
+		}
+		const TensorFile::Header& h = reader.header();
+		dims_t nd;
+		for(int i=0;i<N;i++) nd[i] = int(h.dims[i]);
+		resize(nd);
+		if( !reader.readAll(reinterpret_cast<char*>(data)) ) {
+			cerr << "Failed to read tensor from file " << filename << endl;
+			return false;
+		}
+		cout << "done." << endl;
+		return true;
+	}
+
+	// always the version 2 format, version 1 has no room for the order
+	bool write(const string& filename) const {
+		static_assert(N <= 4, "tensor files hold up to 4 modes");
+		cout << "writing tensor to file " << filename << endl;
+		if( !TensorFile::write(filename, TensorFile::DataTypeOf<T>::value, sizeof(T), N, d.data(),
+			reinterpret_cast<const char*>(data)) ) {
+			cerr << "Failed to write tensor to file " << filename << endl;
+			return false;
+		}
+		cout << "done." << endl;
+		return true;
+	}
+
+	// point the tensor at a version 2 file held in memory, e.g. for MappedTensor
+	bool fromBuffer(char* buffer, size_t bytes) {
+		static_assert(N <= 4, "tensor files hold up to 4 modes");
+		const TensorFile::Header* h = TensorFile::parse(buffer, bytes, TensorFile::DataTypeOf<T>::value, sizeof(T), N);
+		if( h == nullptr ) return false;
+		dims_t nd;
+		for(int i=0;i<N;i++) nd[i] = int(h->dims[i]);
+		wrap(reinterpret_cast<T*>(buffer + h->payloadOffset), nd);
+		return true;
+	}
+
+private:
+	// vector mode product kernels, the last mode has contiguous fibers
+	void modeProductKernel(const Tensor1<compute_t>& v, int mid, TensorN<compute_t, N-1>& t, true_type) const {
+		// one dot product per fiber
+		const compute_t* pv = v.rawptr();
+		compute_t* out = t.rawptr();
+		int len = d[mid];
+		size_t outer = outerSize(mid);
+		#pragma omp parallel for num_threads(TensorThreads::get()) schedule(static)
+		for(long long o=0;o<(long long)outer;o++) {
+			out[o] = TensorKernels::dot(data + o * len, pv, len);
+		}
+	}
+
+	void modeProductKernel(const Tensor1<compute_t>& v, int mid, TensorN<compute_t, N-1>& t, false_type) const {
+		// out(o, :) = sum_l v(l) * T(o, l, :), tiled so each tile stays in cache
+		const compute_t* pv = v.rawptr();
+		compute_t* out = t.rawptr();
+		int len = d[mid];
+		size_t outer = outerSize(mid), inner = s[mid];
+		const int TILE = 4096;
+		long long ntiles = (inner + TILE - 1) / TILE;
+		#pragma omp parallel for num_threads(TensorThreads::get()) schedule(static)
+		for(long long ot=0;ot<(long long)outer*ntiles;ot++) {
+			size_t o = ot / ntiles, offset = (ot % ntiles) * TILE;
+			int n = int(min(size_t(TILE), inner - offset));
+			compute_t* dst = out + o * inner + offset;
+			const T* src = data + o * len * inner + offset;
+			memset(dst, 0, sizeof(compute_t) * n);
+			for(int l=0;l<len;l++, src+=inner) {
+				TensorKernels::axpy(pv[l], src, dst, n);
+			}
+		}
+	}
+
+	TensorN<T, N> modeProduct(const Tensor2<T>& M, int mid, true_type) const {
+		if( mid < 0 || mid >= N ) throw "Invalid mode!";
+		assert(M.dim(1) == d[mid]);
+		int r = M.dim(0), len = d[mid];
+		dims_t nd = d;
+		nd[mid] = r;
+		TensorN<T, N> t(nd);
+		size_t outer = outerSize(mid), inner = s[mid];
+
+		if( inner == 1 ) {
+			// R(outer x r) = T(outer x len) * M'
+			TensorBlas::gemm(false, true, int(outer), r, len, T(1), data, len,
+				M.rawptr(), len, T(0), t.rawptr(), r);
+		}
+		else {
+			// every block R_o(r x inner) = M * T_o(len x inner)
+			#pragma omp parallel for num_threads(TensorThreads::get()) if(outer > 1)
+			for(long long o=0;o<(long long)outer;o++) {
+				TensorBlas::gemm(false, false, r, int(inner), len, T(1), M.rawptr(), len,
+					data + o * len * inner, int(inner), T(0), t.rawptr() + o * r * inner, int(inner));
+			}
+		}
+		return t;
+	}
+
+	// 16-bit storage, the same GEMMs on panels widened on load
+	TensorN<compute_t, N> modeProduct(const Tensor2<compute_t>& M, int mid, false_type) const {
+		if( mid < 0 || mid >= N ) throw "Invalid mode!";
+		assert(M.dim(1) == d[mid]);
+		int r = M.dim(0), len = d[mid];
+		dims_t nd = d;
+		nd[mid] = r;
+		TensorN<compute_t, N> t(nd);
+		size_t outer = outerSize(mid), inner = s[mid];
+
+		if( inner == 1 ) {
+			// R(rows x r) = T(rows x len) * M' for every block of rows
+			int h = TensorKernels::panelWidth(len);
+			long long nblocks = ((long long)outer + h - 1) / h;
+			#pragma omp parallel num_threads(TensorThreads::get())
+			{
+				compute_t* panel = TensorStorage::allocate<compute_t>(size_t(h) * len);
+				#pragma omp for
+				for(long long blk=0;blk<nblocks;blk++) {
+					size_t row = size_t(blk) * h;
+					int b = int(min(size_t(h), outer - row));
+					TensorKernels::widen(data + row * len, panel, b * len);
+					TensorBlas::gemm(false, true, b, r, len, compute_t(1), panel, len,
+						M.rawptr(), len, compute_t(0), t.rawptr() + row * r, r);
+				}
+				TensorStorage::release(panel);
+			}
+		}
+		else {
+			// R_o(:, cols) = M * T_o(len x cols) for every block and block of columns
+			int w = TensorKernels::panelWidth(len);
+			long long ncb = ((long long)inner + w - 1) / w, npanels = (long long)outer * ncb;
+			#pragma omp parallel num_threads(TensorThreads::get())
+			{
+				compute_t* panel = TensorStorage::allocate<compute_t>(size_t(len) * w);
+				#pragma omp for
+				for(long long p=0;p<npanels;p++) {
+					size_t o = size_t(p / ncb), c = size_t(p % ncb) * w;
+					int b = int(min(size_t(w), inner - c));
+					TensorKernels::widenPanel(data + o * len * inner + c, int(inner), panel, len, b);
+					TensorBlas::gemm(false, false, r, b, len, compute_t(1), M.rawptr(), len,
+						panel, b, compute_t(0), t.rawptr() + o * r * inner + c, int(inner));
+				}
+				TensorStorage::release(panel);
+			}
+		}
+		return t;
+	}
+
+	size_t offset(int) const { return 0; }
+	template <typename... Idx>
+	size_t offset(int m, int i, Idx... rest) const {
+		return i * s[m] + offset(m + 1, rest...);
+	}
+
+	size_t outerSize(int mid) const {
+		size_t n = 1;
+		for(int i=0;i<mid;i++) n *= d[i];
+		return n;
+	}
+
+	array<int, (N > 1)?(N-1):1> removeMode(int mid) const {
+		array<int, (N > 1)?(N-1):1> nd;
+		for(int i=0, j=0;i<N;i++) if( i != mid ) nd[j++] = d[i];
+		return nd;
+	}
+
+	void updateStrides() {
+		s[N-1] = 1;
+		for(int i=N-2;i>=0;i--) s[i] = s[i+1] * d[i+1];
+	}
+
+private:
+	dims_t d;
+	array<size_t, N> s;
+	T* data;
+	// false when data points into memory owned by someone else
+	bool owner;
+};
+
+template <typename T> using Tensor4 = TensorN<T, 4>;
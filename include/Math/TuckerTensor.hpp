@@ -0,0 +1,151 @@
+#pragma once
+
+#include "Tensor.hpp"
+
+// Order 3 tensor kept in Tucker form, T = G x_0 U0 x_1 U1 x_2 U2, with a
+// r0 x r1 x r2 core G and dim(m) x r(m) factors Um, e.g. the result of
+// Tensor3::hosvd. The mode products work through the factors: weights are
+// projected onto the ranks first, so memory and work scale with the ranks and
+// the dense tensor is only formed when a result needs full dimensions.
+// T is float or double, the factors go through BLAS.
+template <typename T>
+class TuckerTensor3
+{
+	static_assert(is_same<T, float>::value || is_same<T, double>::value, "TuckerTensor3 stores float or double");
+
+public:
+	TuckerTensor3(void){}
+	TuckerTensor3(const Tensor3<T>& core, const Tensor2<T>& u0, const Tensor2<T>& u1, const Tensor2<T>& u2):core(core){
+		u[0] = u0; u[1] = u1; u[2] = u2;
+		for(int i=0;i<3;i++) {
+			if( u[i].dim(1) != core.dim(i) ) throw "Invalid factor size!";
+		}
+	}
+	// truncated HOSVD of a dense tensor, one rank per mode
+	TuckerTensor3(const Tensor3<T>& t, const vector<int>& ranks){
+		compress(t, ranks);
+	}
+
+	void compress(const Tensor3<T>& t, const vector<int>& ranks) {
+		if( ranks.size() != 3 ) throw "Invalid ranks!";
+		vector<int> modes = {0, 1, 2};
+		auto res = t.hosvd(modes, ranks);
+		core = std::move(get<0>(res));
+		for(int i=0;i<3;i++) u[i] = std::move(get<1>(res)[i]);
+	}
+
+	int dim(int mid) const { return u[mid].dim(0); }
+	int rank(int mid) const { return core.dim(mid); }
+	const Tensor3<T>& coreTensor() const { return core; }
+	const Tensor2<T>& factor(int mid) const { return u[mid]; }
+
+	// storage of the core and the factors
+	size_t bytes() const {
+		size_t n = core.size();
+		for(int i=0;i<3;i++) n += size_t(u[i].dim(0)) * u[i].dim(1);
+		return n * sizeof(T);
+	}
+
+	// multiply the factors back in
+	Tensor3<T> toTensor() const {
+		// largest expansion last, the intermediates stay small
+		int order[3] = {0, 1, 2};
+		sort(order, order + 3, [&](int a, int b) {
+			return dim(a) * rank(b) < dim(b) * rank(a);
+		});
+		Tensor3<T> t = core.modeProduct(u[order[0]], order[0]);
+		t = t.modeProduct(u[order[1]], order[1]);
+		return t.modeProduct(u[order[2]], order[2]);
+	}
+
+	// mode product with a vector, same result as Tensor3::modeProduct:
+	// T x_mid v = (G x_mid U_mid' v) x U_a x U_b over the remaining modes a < b
+	Tensor2<T> modeProduct(const Tensor1<T>& v, int mid) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		assert(v.length() == dim(mid));
+		int a = (mid == 0)?1:0, b = (mid == 2)?1:2;
+		Tensor2<T> g = core.modeProduct(project(v, mid), mid);
+
+		// R(da x db) = Ua * G * Ub'
+		Tensor2<T> gu, t2;
+		gu.resize(rank(a), dim(b));
+		t2.resize(dim(a), dim(b));
+		TensorBlas::gemm(false, true, rank(a), dim(b), rank(b), T(1), g.rawptr(), rank(b),
+			u[b].rawptr(), rank(b), T(0), gu.rawptr(), dim(b));
+		TensorBlas::gemm(false, false, dim(a), dim(b), rank(a), T(1), u[a].rawptr(), rank(a),
+			gu.rawptr(), dim(b), T(0), t2.rawptr(), dim(b));
+		return t2;
+	}
+
+	// mode product with a matrix, M is r x dim(mid). Only the factor of mode mid
+	// changes, to M * U_mid, so the result stays in Tucker form
+	TuckerTensor3<T> modeProduct(const Tensor2<T>& M, int mid) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		assert(M.dim(1) == dim(mid));
+		TuckerTensor3<T> t(*this);
+		t.u[mid].resize(M.dim(0), rank(mid));
+		TensorBlas::gemm(false, false, M.dim(0), rank(mid), dim(mid), T(1), M.rawptr(), dim(mid),
+			u[mid].rawptr(), rank(mid), T(0), t.u[mid].rawptr(), rank(mid));
+		return t;
+	}
+
+	// fused contraction of the two modes other than mid, same as
+	// Tensor3::contract: both weights are projected, the core is contracted at
+	// rank size and only the result is expanded by U_mid
+	int contract(const Tensor1<T>& w0, const Tensor1<T>& w1, int mid, Tensor1<T>& t1) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		int m0 = (mid == 0)?1:0, m1 = (mid == 2)?1:2;
+		assert(w0.length() == dim(m0) && w1.length() == dim(m1));
+		assert(t1.length() == dim(mid));
+		Tensor1<T> g = core.contract(project(w0, m0), project(w1, m1), mid);
+		TensorBlas::gemv(false, dim(mid), rank(mid), T(1), u[mid].rawptr(), rank(mid),
+			g.rawptr(), T(0), t1.rawptr());
+		return 0;
+	}
+
+	Tensor1<T> contract(const Tensor1<T>& w0, const Tensor1<T>& w1, int mid) const {
+		if( mid < 0 || mid > 2 ) throw "Invalid mode!";
+		Tensor1<T> t1(dim(mid));
+		contract(w0, w1, mid, t1);
+		return t1;
+	}
+
+	// the core goes to filename and the factors to filename.u0, .u1 and .u2,
+	// all in the regular tensor file format
+	bool write(const string& filename) {
+		if( !core.write(filename) ) return false;
+		for(int i=0;i<3;i++) {
+			if( !u[i].write(factorFile(filename, i)) ) return false;
+		}
+		return true;
+	}
+
+	bool read(const string& filename) {
+		if( !core.read(filename) ) return false;
+		for(int i=0;i<3;i++) {
+			if( !u[i].read(factorFile(filename, i)) ) return false;
+			if( u[i].dim(1) != core.dim(i) ) {
+				cerr << "Factor " << i << " does not match the core in " << filename << endl;
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	// U_mid' v, the weights in rank space
+	Tensor1<T> project(const Tensor1<T>& v, int mid) const {
+		Tensor1<T> p(rank(mid));
+		TensorBlas::gemv(true, dim(mid), rank(mid), T(1), u[mid].rawptr(), rank(mid),
+			v.rawptr(), T(0), p.rawptr());
+		return p;
+	}
+
+	static string factorFile(const string& filename, int mid) {
+		return filename + ".u" + to_string(mid);
+	}
+
+private:
+	Tensor3<T> core;
+	Tensor2<T> u[3];
+};
@@ -7,7 +7,7 @@ template <typename T>
 class VectorBase {
 public:
     typedef T elem_t;
-    typedef idx_t idx_t;
+    typedef ::idx_t idx_t;
 
     enum VectorType
     {
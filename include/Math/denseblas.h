@@ -3,10 +3,15 @@
 #include "DenseMatrix.hpp"
 #include "DenseVector.hpp"
 #include <armadillo>
-#include "mkl.h"
+#include "BlasBackend.hpp"
 #include "cula.h"
 #include "cula_lapack.h"
 
+// the least squares and LDL' solvers below call LAPACKE directly
+#if PHG_BLAS == PHG_BLAS_BUILTIN
+#error "denseblas.h needs LAPACK, build it with the MKL or OpenBLAS backend"
+#endif
+
 namespace PhGUtils {
 
   template <typename T, typename MT>
@@ -74,17 +79,27 @@ namespace PhGUtils {
     return bvec;
   }
 
-  // least square solver
+  // least square solver, works in place on views, e.g. blocks of a larger
+  // Jacobian: A is overwritten and the first n entries of b get the solution
   template <typename T>
-  lapack_int leastsquare(PhGUtils::DenseMatrix<T>& A, PhGUtils::DenseVector<T>& b) {
-    MKL_INT rank;
+  lapack_int leastsquare(const PhGUtils::DenseMatrixView<T>& A, const PhGUtils::DenseVectorView<T>& b) {
+    if (!b.isContiguous()) {
+      cerr << "leastsquare: b has to be contiguous" << endl;
+      return -1;
+    }
+    lapack_int rank;
     lapack_int m = A.rows(), n = A.cols();
     PhGUtils::DenseVector<T> s(m);
     // call the wrapper
-    return xgels<T>(LAPACK_COL_MAJOR, m, n, 1, A.ptr(), m, b.ptr(), m,
+    return xgels<T>(LAPACK_COL_MAJOR, m, n, 1, A.ptr(), A.ld(), b.ptr(), b.length(),
       s.ptr(), -1.0, &rank);
   }
 
+  template <typename T>
+  lapack_int leastsquare(PhGUtils::DenseMatrix<T>& A, PhGUtils::DenseVector<T>& b) {
+    return leastsquare(A.view(), b.view());
+  }
+
   template <typename T>
   PhGUtils::DenseVector<T> solve(const PhGUtils::DenseMatrix<T>& A, const PhGUtils::DenseVector<T>& b) {
     arma::mat Amat = toMat(A);
@@ -101,19 +116,19 @@ namespace PhGUtils {
     return res;
   }
 
-  // least square solver using normal equation
-  template <typename T>
-  lapack_int leastsquare_normalmat(PhGUtils::DenseMatrix<T>& A, PhGUtils::DenseVector<T>& b,
-    PhGUtils::DenseMatrix<T>& AtA, PhGUtils::DenseVector<T>& Atb)
-  {}
-
-  template <>
-  inline lapack_int leastsquare_normalmat<double>(PhGUtils::DenseMatrix<double>& A, PhGUtils::DenseVector<double>& b,
-    PhGUtils::DenseMatrix<double>& AtA, PhGUtils::DenseVector<double>& Atb)
+  // least square solver using normal equation, on views so A can be a block of
+  // a larger Jacobian. AtA is n x n, b and Atb have to be contiguous
+  inline lapack_int leastsquare_normalmat(const PhGUtils::DenseMatrixView<const double>& A,
+    const PhGUtils::DenseVectorView<const double>& b,
+    const PhGUtils::DenseMatrixView<double>& AtA, const PhGUtils::DenseVectorView<double>& Atb)
   {
+    if (!b.isContiguous() || !Atb.isContiguous()) {
+      cerr << "leastsquare_normalmat: b and Atb have to be contiguous" << endl;
+      return -1;
+    }
     lapack_int m = A.rows(), n = A.cols();
     // compute AtA
-    cblas_dsyrk(CblasRowMajor, CblasUpper, CblasNoTrans, n, m, 1.0, A.ptr(), m, 0, AtA.ptr(), n);
+    BlasBackend::syrk(BlasBackend::RowMajor, true, false, n, m, 1.0, A.ptr(), A.ld(), 0.0, AtA.ptr(), AtA.ld());
 
     //ofstream fout0("A.txt");
     //A.print("", fout0);
@@ -124,7 +139,7 @@ namespace PhGUtils {
     //fout.close();
 
     // compute Atb
-    cblas_dgemv(CblasRowMajor, CblasNoTrans, n, m, 1.0, A.ptr(), m, b.ptr(), 1, 0, Atb.ptr(), 1);
+    BlasBackend::gemv(BlasBackend::RowMajor, false, n, m, 1.0, A.ptr(), A.ld(), b.ptr(), 0.0, Atb.ptr());
     //ofstream fout2("b.txt");
     //b.print("", fout2);
     //fout2.close();
@@ -136,20 +151,25 @@ namespace PhGUtils {
     // compute AtA\Atb, since AtA is only semi-positive definite, we need to use LU-decomposition
 #if 0
     PhGUtils::DenseVector<int> ipiv(n);
-    LAPACKE_dsytrf( LAPACK_COL_MAJOR, 'L', n, AtA.ptr(), n, ipiv.ptr() );
-    return LAPACKE_dsytrs(LAPACK_COL_MAJOR, 'L', n, 1, AtA.ptr(), n, ipiv.ptr(), Atb.ptr(), n);
+    LAPACKE_dsytrf( LAPACK_COL_MAJOR, 'L', n, AtA.ptr(), AtA.ld(), ipiv.ptr() );
+    return LAPACKE_dsytrs(LAPACK_COL_MAJOR, 'L', n, 1, AtA.ptr(), AtA.ld(), ipiv.ptr(), Atb.ptr(), n);
 #else
-    LAPACKE_dpotrf(LAPACK_COL_MAJOR, 'L', n, AtA.ptr(), n);
-    return LAPACKE_dpotrs(LAPACK_COL_MAJOR, 'L', n, 1, AtA.ptr(), n, Atb.ptr(), n);
+    BlasBackend::potrf(BlasBackend::ColMajor, false, n, AtA.ptr(), AtA.ld());
+    return BlasBackend::potrs(BlasBackend::ColMajor, false, n, 1, AtA.ptr(), AtA.ld(), Atb.ptr(), n);
 #endif
   }
 
-  template <>
-  inline lapack_int leastsquare_normalmat<float>(PhGUtils::DenseMatrix<float>& A, PhGUtils::DenseVector<float>& b,
-    PhGUtils::DenseMatrix<float>& AtA, PhGUtils::DenseVector<float>& Atb) {
+  inline lapack_int leastsquare_normalmat(const PhGUtils::DenseMatrixView<const float>& A,
+    const PhGUtils::DenseVectorView<const float>& b,
+    const PhGUtils::DenseMatrixView<float>& AtA, const PhGUtils::DenseVectorView<float>& Atb)
+  {
+    if (!b.isContiguous() || !Atb.isContiguous()) {
+      cerr << "leastsquare_normalmat: b and Atb have to be contiguous" << endl;
+      return -1;
+    }
     lapack_int m = A.rows(), n = A.cols();
     // compute AtA
-    cblas_ssyrk(CblasRowMajor, CblasUpper, CblasNoTrans, n, m, 1.0, A.ptr(), m, 0, AtA.ptr(), n);
+    BlasBackend::syrk(BlasBackend::RowMajor, true, false, n, m, 1.0f, A.ptr(), A.ld(), 0.0f, AtA.ptr(), AtA.ld());
 
     //ofstream fout0("A.txt");
     //A.print("", fout0);
@@ -160,7 +180,7 @@ namespace PhGUtils {
     //fout.close();
 
     // compute Atb
-    cblas_sgemv(CblasRowMajor, CblasNoTrans, n, m, 1.0, A.ptr(), m, b.ptr(), 1, 0, Atb.ptr(), 1);
+    BlasBackend::gemv(BlasBackend::RowMajor, false, n, m, 1.0f, A.ptr(), A.ld(), b.ptr(), 0.0f, Atb.ptr());
     //ofstream fout2("b.txt");
     //b.print("", fout2);
     //fout2.close();
@@ -172,12 +192,19 @@ namespace PhGUtils {
     // compute AtA\Atb, since AtA is only semi-positive definite, we need to use LU-decomposition
 #if 1
     PhGUtils::DenseVector<int> ipiv(n);
-    LAPACKE_ssytrf(LAPACK_COL_MAJOR, 'L', n, AtA.ptr(), n, ipiv.ptr());
-    return LAPACKE_ssytrs(LAPACK_COL_MAJOR, 'L', n, 1, AtA.ptr(), n, ipiv.ptr(), Atb.ptr(), n);
+    LAPACKE_ssytrf(LAPACK_COL_MAJOR, 'L', n, AtA.ptr(), AtA.ld(), ipiv.ptr());
+    return LAPACKE_ssytrs(LAPACK_COL_MAJOR, 'L', n, 1, AtA.ptr(), AtA.ld(), ipiv.ptr(), Atb.ptr(), n);
 #else
-    LAPACKE_spotrf( LAPACK_COL_MAJOR, 'L', n, AtA.ptr(), n );
-    return LAPACKE_spotrs( LAPACK_COL_MAJOR, 'L', n, 1, AtA.ptr(), n, Atb.ptr(), n );
+    BlasBackend::potrf(BlasBackend::ColMajor, false, n, AtA.ptr(), AtA.ld());
+    return BlasBackend::potrs(BlasBackend::ColMajor, false, n, 1, AtA.ptr(), AtA.ld(), Atb.ptr(), n);
 #endif
   }
 
+  template <typename T>
+  lapack_int leastsquare_normalmat(PhGUtils::DenseMatrix<T>& A, PhGUtils::DenseVector<T>& b,
+    PhGUtils::DenseMatrix<T>& AtA, PhGUtils::DenseVector<T>& Atb)
+  {
+    return leastsquare_normalmat(A.view(), b.view(), AtA.view(), Atb.view());
+  }
+
 }
\ No newline at end of file